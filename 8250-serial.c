@@ -1,19 +1,48 @@
+#define _GNU_SOURCE
 #include "kvm/8250-serial.h"
 
+#include "kvm/boot-profile.h"
+#include "kvm/event-loop.h"
+#include "kvm/console.h"
 #include "kvm/ioport.h"
 #include "kvm/util.h"
 #include "kvm/kvm.h"
 
 #include <linux/serial_reg.h>
 
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <pthread.h>
 #include <stdbool.h>
-#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+
+/* 16550A */
+#define SERIAL_FIFO_SIZE	16
+
+/* IIR bits 7:6, set while the FIFOs are enabled */
+#define UART_IIR_FIFO_ENABLED	0xc0
+
+enum serial8250_backend {
+	SERIAL8250_BACKEND_NONE,
+	SERIAL8250_BACKEND_STDIO,	/* console output, stdin */
+	SERIAL8250_BACKEND_FILE,	/* output only */
+	SERIAL8250_BACKEND_UNIX,	/* one client at a time */
+	SERIAL8250_BACKEND_PTY,
+};
 
 struct serial8250_device {
+	pthread_mutex_t		mutex;
+
 	uint16_t		iobase;
 	uint8_t			irq;
 
-	uint8_t			thr;
 	uint8_t			dll;
 	uint8_t			dlm;
 	uint8_t			iir;
@@ -23,158 +52,426 @@ struct serial8250_device {
 	uint8_t			mcr;
 	uint8_t			lsr;
 	uint8_t			scr;
+
+	/*
+	 * Transmitted bytes go straight to the backend, so the TX FIFO is
+	 * always empty and only the receive side is buffered.
+	 */
+	uint8_t			rx_fifo[SERIAL_FIFO_SIZE];
+	unsigned int		rx_head;
+	unsigned int		rx_count;
+
+	/* THRE interrupt raised and not yet acknowledged by an IIR read */
+	bool			thri_pending;
+
+	/* This port's share of the interrupt line, see serial8250__set_irq() */
+	bool			irq_level;
+
+	enum serial8250_backend	backend;
+	const char		*path;
+
+	/* -1 while there is nowhere to send output, e.g. no socket client */
+	int			out_fd;
+
+	struct kvm		*kvm;
+	struct event_handler	input;
+	bool			input_open;
+	bool			input_armed;
+
+	/* UNIX socket backend */
+	struct event_handler	listen;
+
+	/* PTY backend, the slave is held open so the master never hangs up */
+	int			pty_slave_fd;
 };
 
-static struct serial8250_device device = {
-	.iobase			= 0x3f8,	/* ttyS0 */
-	.irq			= 4,
+#define SERIAL8250_DEVICE(_iobase, _irq, _backend)			\
+	{								\
+		.mutex			= PTHREAD_MUTEX_INITIALIZER,	\
+		.iobase			= _iobase,			\
+		.irq			= _irq,				\
+		.iir			= UART_IIR_NO_INT,		\
+		.lsr			= UART_LSR_TEMT | UART_LSR_THRE, \
+		.backend		= _backend,			\
+		.out_fd			= -1,				\
+	}
 
-	.iir			= UART_IIR_NO_INT,
-	.lsr			= UART_LSR_TEMT | UART_LSR_THRE,
+static struct serial8250_device devices[] = {
+	/* ttyS0, the guest console */
+	SERIAL8250_DEVICE(0x3f8, 4, SERIAL8250_BACKEND_STDIO),
+	/* ttyS1 */
+	SERIAL8250_DEVICE(0x2f8, 3, SERIAL8250_BACKEND_NONE),
+	/* ttyS2 */
+	SERIAL8250_DEVICE(0x3e8, 4, SERIAL8250_BACKEND_NONE),
+	/* ttyS3 */
+	SERIAL8250_DEVICE(0x2e8, 3, SERIAL8250_BACKEND_NONE),
 };
 
-static int read_char(int fd)
+/* COM1/COM3 and COM2/COM4 share their interrupt lines */
+static pthread_mutex_t irq_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int serial8250__rx_trigger(struct serial8250_device *dev)
 {
-	int c;
+	if (!(dev->fcr & UART_FCR_ENABLE_FIFO))
+		return 1;
 
-	if (read(fd, &c, 1) < 0)
-		return -1;
+	switch (dev->fcr & UART_FCR_TRIGGER_MASK) {
+	case UART_FCR_TRIGGER_4:
+		return 4;
+	case UART_FCR_TRIGGER_8:
+		return 8;
+	case UART_FCR_TRIGGER_14:
+		return 14;
+	default:
+		return 1;
+	}
+}
 
-	return c;
+/* Without the FIFOs the receive buffer register holds a single byte */
+static unsigned int serial8250__rx_room(struct serial8250_device *dev)
+{
+	if (!(dev->fcr & UART_FCR_ENABLE_FIFO))
+		return dev->rx_count ? 0 : 1;
+
+	return SERIAL_FIFO_SIZE - dev->rx_count;
 }
 
-static bool is_readable(int fd)
+/* The line stays up for as long as any port on it asks for an interrupt */
+static void serial8250__set_irq(struct kvm *self, struct serial8250_device *dev, bool level)
 {
-	struct pollfd pollfd = (struct pollfd) {
-		.fd	= fd,
-		.events	= POLLIN,
-	};
+	bool line = false;
+	unsigned int i;
+
+	pthread_mutex_lock(&irq_lock);
+
+	dev->irq_level		= level;
 
-	return poll(&pollfd, 1, 0) > 0;
+	for (i = 0; i < ARRAY_SIZE(devices); i++) {
+		if (devices[i].irq == dev->irq && devices[i].irq_level)
+			line		= true;
+	}
+
+	kvm__irq_line(self, dev->irq, line);
+
+	pthread_mutex_unlock(&irq_lock);
+}
+
+/*
+ * Recomputes IIR from the device state; the interrupt line only changes, and
+ * costs a KVM_IRQ_LINE ioctl, when IIR goes from or to "no interrupt".
+ *
+ * Input is read from the host in bulk, so data below the trigger level means
+ * there is no more for now: that is reported as a character timeout right
+ * away rather than after four character times.
+ *
+ * Called with ->mutex held.
+ */
+static void serial8250__update_irq(struct kvm *self, struct serial8250_device *dev)
+{
+	uint8_t iir = UART_IIR_NO_INT;
+
+	if ((dev->ier & UART_IER_RDI) && dev->rx_count >= serial8250__rx_trigger(dev))
+		iir		= UART_IIR_RDI;
+	else if ((dev->ier & UART_IER_RDI) && dev->rx_count)
+		iir		= UART_IIR_RX_TIMEOUT;
+	else if ((dev->ier & UART_IER_THRI) && dev->thri_pending)
+		iir		= UART_IIR_THRI;
+
+	if ((iir & UART_IIR_NO_INT) != (dev->iir & UART_IIR_NO_INT))
+		serial8250__set_irq(self, dev, !(iir & UART_IIR_NO_INT));
+
+	if (dev->fcr & UART_FCR_ENABLE_FIFO)
+		iir		|= UART_IIR_FIFO_ENABLED;
+
+	dev->iir		= iir;
+}
+
+/* Called with ->mutex held, watches the host fd again if there is room */
+static void serial8250__rearm_input(struct serial8250_device *dev)
+{
+	if (!dev->input_open || dev->input_armed || !serial8250__rx_room(dev))
+		return;
+
+	event_loop__modify(&dev->input, EPOLLIN | EPOLLONESHOT);
+	dev->input_armed	= true;
 }
 
-void serial8250__interrupt(struct kvm *self)
+/* Called with ->mutex held */
+static void serial8250__disconnect(struct serial8250_device *dev)
 {
-	if (!(device.lsr & UART_LSR_DR) && is_readable(fileno(stdin))) {
-		int c;
+	event_loop__del(&dev->input);
+	dev->input_open		= false;
+
+	/* A socket client may come back, everything else is gone for good */
+	if (dev->backend == SERIAL8250_BACKEND_UNIX) {
+		close(dev->out_fd);
+		dev->out_fd		= -1;
+	}
+}
+
+/*
+ * The input fd is watched with EPOLLONESHOT: each event reads as much as
+ * fits in the receive FIFO, and the fd is only rearmed once there is room
+ * again.
+ */
+static void serial8250__input(struct event_handler *handler, uint32_t events)
+{
+	struct serial8250_device *dev = handler->ptr;
+	uint8_t buf[SERIAL_FIFO_SIZE];
+	unsigned int i;
+	ssize_t nr;
+
+	pthread_mutex_lock(&dev->mutex);
+
+	dev->input_armed	= false;
+
+	if (!serial8250__rx_room(dev))
+		goto out_unlock;
 
-		c			= read_char(fileno(stdin));
-		if (c >= 0) {
-			device.thr		= c;
-			device.lsr		|= UART_LSR_DR;
+	nr			= read(handler->fd, buf, serial8250__rx_room(dev));
+	if (nr > 0) {
+		for (i = 0; i < nr; i++) {
+			dev->rx_fifo[(dev->rx_head + dev->rx_count) % SERIAL_FIFO_SIZE]	= buf[i];
+			dev->rx_count++;
 		}
+
+		serial8250__update_irq(dev->kvm, dev);
+	} else if (nr == 0 || (errno != EAGAIN && errno != EINTR)) {
+		/* EOF or hangup, the guest gets no more input */
+		serial8250__disconnect(dev);
 	}
 
-	if (device.ier & UART_IER_THRI || device.lsr & UART_LSR_DR) {
-		device.iir		&= ~UART_IIR_NO_INT;
-		kvm__irq_line(self, device.irq, 1);
+	serial8250__rearm_input(dev);
+
+out_unlock:
+	pthread_mutex_unlock(&dev->mutex);
+}
+
+/* Called with ->mutex held */
+static void serial8250__connect(struct serial8250_device *dev, int fd)
+{
+	dev->input.fd		= fd;
+	dev->input.callback	= serial8250__input;
+	dev->input.ptr		= dev;
+
+	/* Not everything can be polled, /dev/null for one */
+	dev->input_open		= event_loop__add(&dev->input, EPOLLIN | EPOLLONESHOT);
+	dev->input_armed	= dev->input_open;
+}
+
+/* Takes a new client if there is none; a second one is turned away */
+static void serial8250__accept(struct event_handler *handler, uint32_t events)
+{
+	struct serial8250_device *dev = handler->ptr;
+	int fd;
+
+	fd			= accept4(handler->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	pthread_mutex_lock(&dev->mutex);
+
+	if (dev->out_fd >= 0) {
+		close(fd);
+	} else {
+		dev->out_fd		= fd;
+		serial8250__connect(dev, fd);
 	}
+
+	pthread_mutex_unlock(&dev->mutex);
 }
 
-static bool serial8250_out(struct kvm *self, uint16_t port, void *data, int size, uint32_t count)
+/*
+ * Only stdio goes through the console thread, everything else is written
+ * right away from the vCPU thread. Sockets and PTYs don't block: with
+ * nobody reading, output is dropped rather than stalling the guest.
+ *
+ * Called with ->mutex held.
+ */
+static void serial8250__output(struct serial8250_device *dev, const char *buf, size_t len)
 {
-	uint16_t offset = port - device.iobase;
+	ssize_t nr;
 
-	if (device.lcr & UART_LCR_DLAB) {
-		switch (offset) {
-		case UART_DLL:
-			device.dll		= ioport__read8(data);
-			break;
-		case UART_DLM:
-			device.dlm		= ioport__read8(data);
-			break;
-		case UART_FCR:
-			device.fcr		= ioport__read8(data);
-			break;
-		case UART_LCR:
-			device.lcr		= ioport__read8(data);
+	/* Coalesced writes only show up here when the ring is drained */
+	boot_profile__event(BOOT_PROFILE_FIRST_SERIAL);
+
+	if (dev->backend == SERIAL8250_BACKEND_STDIO) {
+		console__write(buf, len);
+		return;
+	}
+
+	while (len && dev->out_fd >= 0) {
+		if (dev->backend == SERIAL8250_BACKEND_UNIX)
+			nr	= send(dev->out_fd, buf, len, MSG_NOSIGNAL);
+		else
+			nr	= write(dev->out_fd, buf, len);
+		if (nr < 0 && errno == EINTR)
+			continue;
+		if (nr <= 0)
+			return;
+
+		buf	+= nr;
+		len	-= nr;
+	}
+}
+
+static uint8_t serial8250__rx_pop(struct serial8250_device *dev)
+{
+	uint8_t c;
+
+	if (!dev->rx_count)
+		return 0;
+
+	c			= dev->rx_fifo[dev->rx_head];
+	dev->rx_head		= (dev->rx_head + 1) % SERIAL_FIFO_SIZE;
+	dev->rx_count--;
+
+	return c;
+}
+
+static void serial8250__write_fcr(struct serial8250_device *dev, uint8_t fcr)
+{
+	/* Switching the FIFOs on or off empties them */
+	if ((fcr ^ dev->fcr) & UART_FCR_ENABLE_FIFO)
+		fcr		|= UART_FCR_CLEAR_RCVR;
+
+	if (fcr & UART_FCR_CLEAR_RCVR) {
+		dev->rx_head		= 0;
+		dev->rx_count		= 0;
+	}
+
+	dev->fcr		= fcr & ~(UART_FCR_CLEAR_RCVR | UART_FCR_CLEAR_XMIT);
+}
+
+/* Only ports with a backend are registered, so this always finds one */
+static struct serial8250_device *serial8250__find(uint16_t port)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(devices) - 1; i++) {
+		if (port >= devices[i].iobase && port < devices[i].iobase + 8)
 			break;
-		default:
-			return false;
-		}
-	} else {
-		switch (offset) {
-		case UART_TX: {
-			char *p = data;
-			int i;
+	}
+
+	return &devices[i];
+}
 
-			while (count--) {
-				for (i = 0; i < size; i++)
-					fprintf(stdout, "%c", *p++);
-			}
-			fflush(stdout);
+static bool serial8250_out(struct kvm *self, uint16_t port, void *data, int size, uint32_t count)
+{
+	struct serial8250_device *dev = serial8250__find(port);
+	uint16_t offset = port - dev->iobase;
+	bool ret = true;
 
-			device.iir		|= UART_IIR_NO_INT;
-			kvm__irq_line(self, device.irq, 0);
+	pthread_mutex_lock(&dev->mutex);
 
+	switch (offset) {
+	case UART_TX:
+		if (dev->lcr & UART_LCR_DLAB) {
+			dev->dll		= ioport__read8(data);
 			break;
 		}
-		case UART_IER:
-			device.ier		= ioport__read8(data);
-			break;
-		case UART_FCR:
-			device.fcr		= ioport__read8(data);
-			break;
-		case UART_LCR:
-			device.lcr		= ioport__read8(data);
-			break;
-		case UART_MCR:
-			device.mcr		= ioport__read8(data);
-			break;
-		case UART_SCR:
-			device.scr		= ioport__read8(data);
+
+		serial8250__output(dev, data, size * count);
+
+		/* The holding register is empty again right away */
+		dev->thri_pending	= true;
+		break;
+	case UART_IER:
+		if (dev->lcr & UART_LCR_DLAB) {
+			dev->dlm		= ioport__read8(data);
 			break;
-		default:
-			return false;
 		}
+
+		/* Enabling THRI with the holding register empty interrupts */
+		if (!(dev->ier & UART_IER_THRI))
+			dev->thri_pending	= true;
+
+		dev->ier		= ioport__read8(data) & 0x0f;
+		break;
+	case UART_FCR:
+		serial8250__write_fcr(dev, ioport__read8(data));
+		serial8250__rearm_input(dev);
+		break;
+	case UART_LCR:
+		dev->lcr		= ioport__read8(data);
+		break;
+	case UART_MCR:
+		dev->mcr		= ioport__read8(data);
+		break;
+	case UART_SCR:
+		dev->scr		= ioport__read8(data);
+		break;
+	default:
+		ret		= false;
 	}
 
-	return true;
+	serial8250__update_irq(self, dev);
+
+	pthread_mutex_unlock(&dev->mutex);
+
+	return ret;
 }
 
 static bool serial8250_in(struct kvm *self, uint16_t port, void *data, int size, uint32_t count)
 {
-	uint16_t offset = port - device.iobase;
+	struct serial8250_device *dev = serial8250__find(port);
+	uint16_t offset = port - dev->iobase;
+	uint32_t nr = size * count;
+	uint8_t *p = data;
+	bool ret = true;
 
-	if (device.lcr & UART_LCR_DLAB)
-		return false;
+	pthread_mutex_lock(&dev->mutex);
 
 	switch (offset) {
-	case UART_TX:
-		if (device.lsr & UART_LSR_DR) {
-			device.lsr		&= ~UART_LSR_DR;
-			ioport__write8(data, device.thr);
-
-			device.iir		|= UART_IIR_NO_INT;
-			kvm__irq_line(self, device.irq, 0);
+	case UART_RX:
+		if (dev->lcr & UART_LCR_DLAB) {
+			ioport__write8(data, dev->dll);
+			break;
 		}
+
+		/* INSB drains the FIFO with a single exit */
+		while (nr--)
+			*p++		= serial8250__rx_pop(dev);
+
+		serial8250__rearm_input(dev);
 		break;
 	case UART_IER:
-		ioport__write8(data, device.ier);
+		if (dev->lcr & UART_LCR_DLAB)
+			ioport__write8(data, dev->dlm);
+		else
+			ioport__write8(data, dev->ier);
 		break;
 	case UART_IIR:
-		ioport__write8(data, device.iir);
+		ioport__write8(data, dev->iir);
+
+		/* Reading IIR acknowledges a THRE interrupt */
+		if ((dev->iir & UART_IIR_ID) == UART_IIR_THRI)
+			dev->thri_pending	= false;
 		break;
 	case UART_LCR:
-		ioport__write8(data, device.lcr);
+		ioport__write8(data, dev->lcr);
 		break;
 	case UART_MCR:
-		ioport__write8(data, device.mcr);
+		ioport__write8(data, dev->mcr);
 		break;
 	case UART_LSR:
-		ioport__write8(data, device.lsr);
+		ioport__write8(data, dev->lsr | (dev->rx_count ? UART_LSR_DR : 0));
 		break;
 	case UART_MSR:
 		ioport__write8(data, UART_MSR_CTS);
 		break;
 	case UART_SCR:
-		ioport__write8(data, device.scr);
+		ioport__write8(data, dev->scr);
 		break;
 	default:
-		return false;
+		ret		= false;
 	}
 
-	return true;
+	serial8250__update_irq(self, dev);
+
+	pthread_mutex_unlock(&dev->mutex);
+
+	return ret;
 }
 
 static struct ioport_operations serial8250_ops = {
@@ -182,7 +479,157 @@ static struct ioport_operations serial8250_ops = {
 	.io_out		= serial8250_out,
 };
 
-void serial8250__init(void)
+/*
+ * <port>,<backend> with port 0-3 for ttyS0-ttyS3 and the backend one of
+ * "stdio", "none", "pty", "unix:<socket-path>" or a file to write to.
+ */
+bool serial8250__set_backend(const char *arg)
 {
-	ioport__register(device.iobase, &serial8250_ops, 8);
+	struct serial8250_device *dev;
+	const char *backend;
+	char *end;
+	long port;
+
+	port		= strtol(arg, &end, 10);
+	if (end == arg || *end != ',' || port < 0 || port >= (long) ARRAY_SIZE(devices))
+		return false;
+
+	dev		= &devices[port];
+	backend		= end + 1;
+
+	if (!strcmp(backend, "stdio")) {
+		dev->backend	= SERIAL8250_BACKEND_STDIO;
+	} else if (!strcmp(backend, "none")) {
+		dev->backend	= SERIAL8250_BACKEND_NONE;
+	} else if (!strcmp(backend, "pty")) {
+		dev->backend	= SERIAL8250_BACKEND_PTY;
+	} else if (!strncmp(backend, "unix:", 5) && backend[5]) {
+		dev->backend	= SERIAL8250_BACKEND_UNIX;
+		dev->path	= &backend[5];
+	} else if (*backend) {
+		dev->backend	= SERIAL8250_BACKEND_FILE;
+		dev->path	= backend;
+	} else
+		return false;
+
+	return true;
+}
+
+static void serial8250__cleanup(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(devices); i++) {
+		if (devices[i].backend == SERIAL8250_BACKEND_UNIX)
+			unlink(devices[i].path);
+	}
+}
+
+static void serial8250__open_unix(struct serial8250_device *dev)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX, };
+	int fd;
+
+	if (strlen(dev->path) >= sizeof(addr.sun_path))
+		die("Serial socket path too long: %s", dev->path);
+
+	strcpy(addr.sun_path, dev->path);
+
+	fd		= socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		die_perror("socket");
+
+	unlink(dev->path);
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 1) < 0)
+		die("Unable to create serial socket %s", dev->path);
+
+	dev->listen.fd		= fd;
+	dev->listen.callback	= serial8250__accept;
+	dev->listen.ptr		= dev;
+
+	if (!event_loop__add(&dev->listen, EPOLLIN))
+		die("Unable to watch serial socket %s", dev->path);
+}
+
+static void serial8250__open_pty(struct serial8250_device *dev, unsigned int nr)
+{
+	struct termios tio;
+	const char *name;
+	int fd;
+
+	fd		= posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0)
+		die_perror("posix_openpt");
+
+	name		= ptsname(fd);
+	if (!name)
+		die_perror("ptsname");
+
+	dev->pty_slave_fd	= open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (dev->pty_slave_fd < 0)
+		die("Unable to open %s", name);
+
+	/* Bytes go through as they are, like on a real line */
+	if (tcgetattr(dev->pty_slave_fd, &tio) == 0) {
+		cfmakeraw(&tio);
+		tcsetattr(dev->pty_slave_fd, TCSANOW, &tio);
+	}
+
+	info("ttyS%u is on %s", nr, name);
+
+	dev->out_fd		= fd;
+	serial8250__connect(dev, fd);
+}
+
+static void serial8250__open(struct serial8250_device *dev, unsigned int nr)
+{
+	switch (dev->backend) {
+	case SERIAL8250_BACKEND_STDIO:
+		/* Output only if virtio-console or another port took stdin */
+		if (console__claim_stdin())
+			serial8250__connect(dev, fileno(stdin));
+		break;
+	case SERIAL8250_BACKEND_FILE:
+		dev->out_fd	= open(dev->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (dev->out_fd < 0)
+			die("Unable to open %s", dev->path);
+		break;
+	case SERIAL8250_BACKEND_UNIX:
+		serial8250__open_unix(dev);
+		break;
+	case SERIAL8250_BACKEND_PTY:
+		serial8250__open_pty(dev, nr);
+		break;
+	case SERIAL8250_BACKEND_NONE:
+		break;
+	}
+}
+
+/* Ports without a backend are left to the dummy handlers in ioport.c */
+void serial8250__init(struct kvm *self)
+{
+	struct serial8250_device *dev;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(devices); i++) {
+		dev		= &devices[i];
+		if (dev->backend == SERIAL8250_BACKEND_NONE)
+			continue;
+
+		dev->kvm	= self;
+
+		serial8250__open(dev, i);
+
+		ioport__register(dev->iobase, &serial8250_ops, 8);
+
+		/*
+		 * Transmitted bytes can wait in the coalesced ring: the guest
+		 * finds out whether they went out through LSR or IIR, and
+		 * reading those exits.
+		 */
+		kvm__register_coalesced_pio(self, dev->iobase + UART_TX, 1);
+	}
+
+	atexit(serial8250__cleanup);
 }
@@ -0,0 +1,1438 @@
+#define _GNU_SOURCE
+
+#include "kvm/9p-virtio.h"
+
+#include "kvm/virtio-pci-dev.h"
+#include "kvm/virtio_pci.h"
+#include "kvm/virtio_9p.h"
+#include "kvm/virtio.h"
+#include "kvm/ioport.h"
+#include "kvm/util.h"
+#include "kvm/kvm.h"
+#include "kvm/pci.h"
+
+#include <sys/eventfd.h>
+#include <sys/statfs.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <fcntl.h>
+
+/*
+ * A 9P2000.L server for a host directory. It implements what the Linux
+ * v9fs client needs for regular files and directories; links, device
+ * nodes, extended attributes and locks are refused with EOPNOTSUPP.
+ *
+ * Guest paths are kept relative to the shared directory with ".." folded
+ * away, and they are resolved one component at a time without following
+ * symlinks, so a symlink in the share can't lead outside of it. The guest
+ * sees symlinks as such and resolves them itself.
+ */
+
+#define VIRTIO_9P_QUEUE_SIZE	128
+#define VIRTIO_9P_IRQ		5
+
+#define P9_MAX_MSIZE		(128 * 1024)
+#define P9_HDR_SIZE		7		/* size[4] type[1] tag[2] */
+#define P9_READ_HDR_SIZE	(P9_HDR_SIZE + 4)	/* ... count[4] */
+#define P9_WRITE_HDR_SIZE	(P9_HDR_SIZE + 4 + 8 + 4)	/* ... fid[4] offset[8] count[4] */
+
+#define P9_FID_BUCKETS		256
+#define P9_MAX_WALK		16
+#define P9_NOFID		(~0U)
+
+enum {
+	P9_TLERROR	= 6,
+	P9_RLERROR,
+	P9_TSTATFS	= 8,
+	P9_RSTATFS,
+	P9_TLOPEN	= 12,
+	P9_RLOPEN,
+	P9_TLCREATE	= 14,
+	P9_RLCREATE,
+	P9_TREADLINK	= 22,
+	P9_RREADLINK,
+	P9_TGETATTR	= 24,
+	P9_RGETATTR,
+	P9_TSETATTR	= 26,
+	P9_RSETATTR,
+	P9_TREADDIR	= 40,
+	P9_RREADDIR,
+	P9_TFSYNC	= 50,
+	P9_RFSYNC,
+	P9_TMKDIR	= 72,
+	P9_RMKDIR,
+	P9_TRENAMEAT	= 74,
+	P9_RRENAMEAT,
+	P9_TUNLINKAT	= 76,
+	P9_RUNLINKAT,
+	P9_TVERSION	= 100,
+	P9_RVERSION,
+	P9_TATTACH	= 104,
+	P9_RATTACH,
+	P9_TFLUSH	= 108,
+	P9_RFLUSH,
+	P9_TWALK	= 110,
+	P9_RWALK,
+	P9_TREAD	= 116,
+	P9_RREAD,
+	P9_TWRITE	= 118,
+	P9_RWRITE,
+	P9_TCLUNK	= 120,
+	P9_RCLUNK,
+};
+
+#define P9_QTDIR		0x80
+#define P9_QTSYMLINK		0x02
+#define P9_QTFILE		0x00
+
+#define P9_GETATTR_BASIC	0x000007ffULL
+
+#define P9_SETATTR_MODE		0x00000001
+#define P9_SETATTR_UID		0x00000002
+#define P9_SETATTR_GID		0x00000004
+#define P9_SETATTR_SIZE		0x00000008
+#define P9_SETATTR_ATIME	0x00000010
+#define P9_SETATTR_MTIME	0x00000020
+#define P9_SETATTR_ATIME_SET	0x00000080
+#define P9_SETATTR_MTIME_SET	0x00000100
+
+/* Open flags the client may pass through; they match the host's on x86 */
+#define P9_OPEN_FLAGS		(O_ACCMODE | O_CREAT | O_EXCL | O_TRUNC | O_APPEND | \
+				 O_DIRECTORY | O_NOFOLLOW | O_SYNC | O_DSYNC)
+
+struct p9_fid {
+	uint32_t		fid;
+	char			path[PATH_MAX];	/* relative to the root, "." for the root */
+	int			fd;
+	DIR			*dir;
+	struct p9_fid		*next;
+};
+
+/* A 9P message being parsed or built */
+struct p9_pdu {
+	uint8_t			*buf;
+	size_t			size;
+	size_t			pos;
+	bool			error;
+};
+
+struct p9_request {
+	uint16_t		head;
+
+	/* T-message as laid out in guest memory, and room for the R-message */
+	struct iovec		tiov[VIRTIO_9P_QUEUE_SIZE];
+	int			nr_tiov;
+	size_t			tlen;
+	struct iovec		riov[VIRTIO_9P_QUEUE_SIZE];
+	int			nr_riov;
+	size_t			rlen;
+
+	struct p9_pdu		t;
+	struct p9_pdu		r;
+
+	/* Payload placed directly in guest memory after the R-message */
+	size_t			rdata;
+};
+
+struct p9_device {
+	struct kvm		*kvm;
+	int			root_fd;
+	uint32_t		msize;
+
+	struct p9_fid		*fids[P9_FID_BUCKETS];
+
+	uint8_t			config[sizeof(struct virtio_9p_config) + NAME_MAX];
+	size_t			config_size;
+	uint32_t		host_features;
+	uint32_t		guest_features;
+	uint8_t			status;
+
+	struct virt_queue	queue;
+
+	struct pci_device_header pci_header;
+
+	pthread_t		io_thread;
+	int			io_efd;
+
+	struct p9_request	req;
+	uint8_t			tbuf[P9_MAX_MSIZE];
+	uint8_t			rbuf[P9_MAX_MSIZE];
+};
+
+static struct p9_device *p9_dev;
+
+/*
+ * Guest buffer helpers
+ */
+static size_t iov_copy_from(const struct iovec *iov, int nr, void *buf, size_t len)
+{
+	size_t done = 0, n;
+	int i;
+
+	for (i = 0; i < nr && done < len; i++) {
+		n	= MIN(len - done, iov[i].iov_len);
+		memcpy(buf + done, iov[i].iov_base, n);
+		done	+= n;
+	}
+
+	return done;
+}
+
+static void iov_copy_to(const struct iovec *iov, int nr, void *buf, size_t len)
+{
+	size_t done = 0, n;
+	int i;
+
+	for (i = 0; i < nr && done < len; i++) {
+		n	= MIN(len - done, iov[i].iov_len);
+		memcpy(iov[i].iov_base, buf + done, n);
+		done	+= n;
+	}
+}
+
+/* Points @dst at @len bytes of @src starting @skip bytes in */
+static int iov_slice(struct iovec *dst, const struct iovec *src, int nr, size_t skip, size_t len)
+{
+	int i, n = 0;
+
+	for (i = 0; i < nr && len; i++) {
+		size_t seg = src[i].iov_len;
+
+		if (skip >= seg) {
+			skip	-= seg;
+			continue;
+		}
+
+		dst[n].iov_base	= src[i].iov_base + skip;
+		dst[n].iov_len	= MIN(seg - skip, len);
+		len		-= dst[n].iov_len;
+		skip		= 0;
+		n++;
+	}
+
+	return n;
+}
+
+/*
+ * Message encoding
+ */
+static void p9_pdu__get(struct p9_pdu *pdu, void *p, size_t n)
+{
+	if (pdu->pos + n > pdu->size) {
+		pdu->error	= true;
+		memset(p, 0, n);
+		return;
+	}
+
+	memcpy(p, pdu->buf + pdu->pos, n);
+	pdu->pos	+= n;
+}
+
+static uint16_t p9_pdu__get16(struct p9_pdu *pdu)
+{
+	uint16_t v;
+
+	p9_pdu__get(pdu, &v, sizeof(v));
+
+	return v;
+}
+
+static uint32_t p9_pdu__get32(struct p9_pdu *pdu)
+{
+	uint32_t v;
+
+	p9_pdu__get(pdu, &v, sizeof(v));
+
+	return v;
+}
+
+static uint64_t p9_pdu__get64(struct p9_pdu *pdu)
+{
+	uint64_t v;
+
+	p9_pdu__get(pdu, &v, sizeof(v));
+
+	return v;
+}
+
+static void p9_pdu__get_str(struct p9_pdu *pdu, char *s, size_t size)
+{
+	uint16_t len = p9_pdu__get16(pdu);
+
+	if (len >= size || pdu->pos + len > pdu->size) {
+		pdu->error	= true;
+		s[0]		= '\0';
+		return;
+	}
+
+	memcpy(s, pdu->buf + pdu->pos, len);
+	s[len]		= '\0';
+	pdu->pos	+= len;
+}
+
+static void p9_pdu__put(struct p9_pdu *pdu, const void *p, size_t n)
+{
+	if (pdu->pos + n > pdu->size) {
+		pdu->error	= true;
+		return;
+	}
+
+	memcpy(pdu->buf + pdu->pos, p, n);
+	pdu->pos	+= n;
+}
+
+static void p9_pdu__put8(struct p9_pdu *pdu, uint8_t v)
+{
+	p9_pdu__put(pdu, &v, sizeof(v));
+}
+
+static void p9_pdu__put16(struct p9_pdu *pdu, uint16_t v)
+{
+	p9_pdu__put(pdu, &v, sizeof(v));
+}
+
+static void p9_pdu__put32(struct p9_pdu *pdu, uint32_t v)
+{
+	p9_pdu__put(pdu, &v, sizeof(v));
+}
+
+static void p9_pdu__put64(struct p9_pdu *pdu, uint64_t v)
+{
+	p9_pdu__put(pdu, &v, sizeof(v));
+}
+
+static void p9_pdu__put_str(struct p9_pdu *pdu, const char *s)
+{
+	uint16_t len = strlen(s);
+
+	p9_pdu__put16(pdu, len);
+	p9_pdu__put(pdu, s, len);
+}
+
+static void p9_pdu__put_qid(struct p9_pdu *pdu, struct stat *st)
+{
+	uint8_t type = P9_QTFILE;
+
+	if (S_ISDIR(st->st_mode))
+		type	= P9_QTDIR;
+	else if (S_ISLNK(st->st_mode))
+		type	= P9_QTSYMLINK;
+
+	p9_pdu__put8(pdu, type);
+	p9_pdu__put32(pdu, st->st_mtime);
+	p9_pdu__put64(pdu, st->st_ino);
+}
+
+/*
+ * Fids
+ */
+static struct p9_fid *p9_fid__find(uint32_t fid)
+{
+	struct p9_fid *f;
+
+	for (f = p9_dev->fids[fid % P9_FID_BUCKETS]; f; f = f->next) {
+		if (f->fid == fid)
+			return f;
+	}
+
+	return NULL;
+}
+
+static struct p9_fid *p9_fid__new(uint32_t fid)
+{
+	struct p9_fid *f;
+
+	if (fid == P9_NOFID || p9_fid__find(fid))
+		return NULL;
+
+	f	= calloc(1, sizeof *f);
+	if (!f)
+		return NULL;
+
+	f->fid	= fid;
+	f->fd	= -1;
+	f->next	= p9_dev->fids[fid % P9_FID_BUCKETS];
+
+	p9_dev->fids[fid % P9_FID_BUCKETS]	= f;
+
+	return f;
+}
+
+static void p9_fid__close(struct p9_fid *f)
+{
+	if (f->dir)
+		closedir(f->dir);
+	else if (f->fd >= 0)
+		close(f->fd);
+
+	f->dir	= NULL;
+	f->fd	= -1;
+}
+
+static void p9_fid__free(struct p9_fid *f)
+{
+	struct p9_fid **p;
+
+	for (p = &p9_dev->fids[f->fid % P9_FID_BUCKETS]; *p != f; p = &(*p)->next)
+		;
+	*p	= f->next;
+
+	p9_fid__close(f);
+	free(f);
+}
+
+/*
+ * Appends @name to the directory path @dir. ".." never leaves the root and
+ * names can't smuggle in path separators.
+ */
+static int p9_path__join(char *dst, const char *dir, const char *name)
+{
+	char *slash;
+
+	if (!*name || strchr(name, '/'))
+		return EINVAL;
+
+	if (!strcmp(name, "."))
+		return snprintf(dst, PATH_MAX, "%s", dir) >= PATH_MAX ? ENAMETOOLONG : 0;
+
+	if (!strcmp(name, "..")) {
+		snprintf(dst, PATH_MAX, "%s", dir);
+		slash	= strrchr(dst, '/');
+		if (slash)
+			*slash	= '\0';
+		else
+			strcpy(dst, ".");
+		return 0;
+	}
+
+	if (!strcmp(dir, "."))
+		return snprintf(dst, PATH_MAX, "%s", name) >= PATH_MAX ? ENAMETOOLONG : 0;
+
+	return snprintf(dst, PATH_MAX, "%s/%s", dir, name) >= PATH_MAX ? ENAMETOOLONG : 0;
+}
+
+static void p9_path__put_dir(int dfd)
+{
+	if (dfd != p9_dev->root_fd)
+		close(dfd);
+}
+
+/*
+ * Opens the directory that holds the last component of @path and points
+ * @name at that component. Every directory on the way is opened with
+ * O_NOFOLLOW, so a symlink in the middle of @path fails with ENOTDIR
+ * instead of being followed. Returns the directory fd or -errno.
+ */
+static int p9_path__get_dir(const char *path, const char **name)
+{
+	char comp[NAME_MAX + 1];
+	const char *slash;
+	int dfd, fd, err;
+
+	dfd	= p9_dev->root_fd;
+
+	while ((slash = strchr(path, '/'))) {
+		if (slash - path > NAME_MAX) {
+			p9_path__put_dir(dfd);
+			return -ENAMETOOLONG;
+		}
+
+		memcpy(comp, path, slash - path);
+		comp[slash - path]	= '\0';
+
+		fd	= openat(dfd, comp, O_PATH | O_DIRECTORY | O_NOFOLLOW);
+		err	= errno;
+		p9_path__put_dir(dfd);
+		if (fd < 0)
+			return -err;
+
+		dfd	= fd;
+		path	= slash + 1;
+	}
+
+	*name	= path;
+
+	return dfd;
+}
+
+static int p9_stat(const char *path, struct stat *st)
+{
+	const char *name;
+	int dfd, err = 0;
+
+	dfd	= p9_path__get_dir(path, &name);
+	if (dfd < 0)
+		return -dfd;
+
+	if (fstatat(dfd, name, st, AT_SYMLINK_NOFOLLOW) < 0)
+		err	= errno;
+
+	p9_path__put_dir(dfd);
+
+	return err;
+}
+
+/* Like openat() below the root, but never follows a symlink */
+static int p9_path__open(const char *path, int flags, mode_t mode)
+{
+	const char *name;
+	int dfd, fd, err;
+
+	dfd	= p9_path__get_dir(path, &name);
+	if (dfd < 0) {
+		errno	= -dfd;
+		return -1;
+	}
+
+	fd	= openat(dfd, name, flags | O_NOFOLLOW, mode);
+	err	= errno;
+	p9_path__put_dir(dfd);
+	errno	= err;
+
+	return fd;
+}
+
+/*
+ * Message handlers. They return 0 or an errno for Rlerror.
+ */
+static int p9_version(struct p9_request *req)
+{
+	char version[32];
+	uint32_t msize;
+
+	msize		= p9_pdu__get32(&req->t);
+	p9_pdu__get_str(&req->t, version, sizeof(version));
+
+	p9_dev->msize	= MIN(msize, P9_MAX_MSIZE);
+
+	/* A new session: forget everything about the old one */
+	while (1) {
+		int i;
+
+		for (i = 0; i < P9_FID_BUCKETS && !p9_dev->fids[i]; i++)
+			;
+		if (i == P9_FID_BUCKETS)
+			break;
+		p9_fid__free(p9_dev->fids[i]);
+	}
+
+	p9_pdu__put32(&req->r, p9_dev->msize);
+	p9_pdu__put_str(&req->r, strcmp(version, "9P2000.L") ? "unknown" : "9P2000.L");
+
+	return 0;
+}
+
+static int p9_attach(struct p9_request *req)
+{
+	char uname[NAME_MAX], aname[PATH_MAX];
+	struct p9_fid *f;
+	struct stat st;
+	uint32_t fid;
+	int err;
+
+	fid	= p9_pdu__get32(&req->t);
+	p9_pdu__get32(&req->t);			/* afid */
+	p9_pdu__get_str(&req->t, uname, sizeof(uname));
+	p9_pdu__get_str(&req->t, aname, sizeof(aname));
+
+	err	= p9_stat(".", &st);
+	if (err)
+		return err;
+
+	f	= p9_fid__new(fid);
+	if (!f)
+		return EINVAL;
+
+	strcpy(f->path, ".");
+
+	p9_pdu__put_qid(&req->r, &st);
+
+	return 0;
+}
+
+static int p9_walk(struct p9_request *req)
+{
+	char path[PATH_MAX], tmp[PATH_MAX], name[NAME_MAX + 1];
+	uint32_t fid, newfid;
+	struct p9_fid *f, *nf;
+	uint16_t nwname, i;
+	size_t nwqid_pos;
+	struct stat st;
+	int err = 0;
+
+	fid	= p9_pdu__get32(&req->t);
+	newfid	= p9_pdu__get32(&req->t);
+	nwname	= p9_pdu__get16(&req->t);
+
+	f	= p9_fid__find(fid);
+	if (!f || nwname > P9_MAX_WALK)
+		return EINVAL;
+
+	strcpy(path, f->path);
+
+	nwqid_pos	= req->r.pos;
+	p9_pdu__put16(&req->r, 0);
+
+	for (i = 0; i < nwname; i++) {
+		p9_pdu__get_str(&req->t, name, sizeof(name));
+		if (req->t.error)
+			return EINVAL;
+
+		err	= p9_path__join(tmp, path, name);
+		if (!err)
+			err	= p9_stat(tmp, &st);
+		if (err)
+			break;
+
+		strcpy(path, tmp);
+		p9_pdu__put_qid(&req->r, &st);
+	}
+
+	/* Failing on the first element is an error, otherwise a partial walk */
+	if (err && i == 0)
+		return err;
+
+	memcpy(req->r.buf + nwqid_pos, &i, sizeof(i));
+
+	if (i < nwname)
+		return 0;
+
+	if (newfid == fid) {
+		p9_fid__close(f);
+		strcpy(f->path, path);
+		return 0;
+	}
+
+	nf	= p9_fid__new(newfid);
+	if (!nf)
+		return EINVAL;
+
+	strcpy(nf->path, path);
+
+	return 0;
+}
+
+static int p9_clunk(struct p9_request *req)
+{
+	struct p9_fid *f;
+
+	f	= p9_fid__find(p9_pdu__get32(&req->t));
+	if (!f)
+		return EINVAL;
+
+	p9_fid__free(f);
+
+	return 0;
+}
+
+static int p9_fid__open(struct p9_fid *f, uint32_t flags)
+{
+	struct stat st;
+	int err;
+
+	err	= p9_stat(f->path, &st);
+	if (err)
+		return err;
+
+	if (S_ISDIR(st.st_mode)) {
+		f->fd	= p9_path__open(f->path, O_RDONLY | O_DIRECTORY, 0);
+		if (f->fd < 0)
+			return errno;
+
+		f->dir	= fdopendir(f->fd);
+		if (!f->dir) {
+			err	= errno;
+			close(f->fd);
+			f->fd	= -1;
+			return err;
+		}
+
+		return 0;
+	}
+
+	f->fd	= p9_path__open(f->path, flags & P9_OPEN_FLAGS & ~O_CREAT, 0);
+	if (f->fd < 0)
+		return errno;
+
+	return 0;
+}
+
+static int p9_lopen(struct p9_request *req)
+{
+	struct p9_fid *f;
+	struct stat st;
+	uint32_t flags;
+	int err;
+
+	f	= p9_fid__find(p9_pdu__get32(&req->t));
+	flags	= p9_pdu__get32(&req->t);
+	if (!f || f->fd >= 0)
+		return EINVAL;
+
+	err	= p9_fid__open(f, flags);
+	if (err)
+		return err;
+
+	if (fstat(f->fd, &st) < 0)
+		return errno;
+
+	p9_pdu__put_qid(&req->r, &st);
+	p9_pdu__put32(&req->r, 0);		/* iounit: let the client pick */
+
+	return 0;
+}
+
+static int p9_lcreate(struct p9_request *req)
+{
+	char name[NAME_MAX + 1], path[PATH_MAX];
+	uint32_t flags, mode;
+	struct p9_fid *f;
+	struct stat st;
+	int fd, err;
+
+	f	= p9_fid__find(p9_pdu__get32(&req->t));
+	p9_pdu__get_str(&req->t, name, sizeof(name));
+	flags	= p9_pdu__get32(&req->t);
+	mode	= p9_pdu__get32(&req->t);
+	p9_pdu__get32(&req->t);			/* gid */
+	if (!f || f->fd >= 0 || req->t.error)
+		return EINVAL;
+
+	err	= p9_path__join(path, f->path, name);
+	if (err)
+		return err;
+
+	fd	= p9_path__open(path, (flags & P9_OPEN_FLAGS) | O_CREAT, mode & 07777);
+	if (fd < 0)
+		return errno;
+
+	if (fstat(fd, &st) < 0) {
+		err	= errno;
+		close(fd);
+		return err;
+	}
+
+	/* The fid now stands for the new file */
+	strcpy(f->path, path);
+	f->fd	= fd;
+
+	p9_pdu__put_qid(&req->r, &st);
+	p9_pdu__put32(&req->r, 0);
+
+	return 0;
+}
+
+static int p9_getattr(struct p9_request *req)
+{
+	struct p9_fid *f;
+	struct stat st;
+	int err;
+
+	f	= p9_fid__find(p9_pdu__get32(&req->t));
+	p9_pdu__get64(&req->t);			/* request_mask */
+	if (!f)
+		return EINVAL;
+
+	err	= p9_stat(f->path, &st);
+	if (err)
+		return err;
+
+	p9_pdu__put64(&req->r, P9_GETATTR_BASIC);
+	p9_pdu__put_qid(&req->r, &st);
+	p9_pdu__put32(&req->r, st.st_mode);
+	p9_pdu__put32(&req->r, st.st_uid);
+	p9_pdu__put32(&req->r, st.st_gid);
+	p9_pdu__put64(&req->r, st.st_nlink);
+	p9_pdu__put64(&req->r, st.st_rdev);
+	p9_pdu__put64(&req->r, st.st_size);
+	p9_pdu__put64(&req->r, st.st_blksize);
+	p9_pdu__put64(&req->r, st.st_blocks);
+	p9_pdu__put64(&req->r, st.st_atim.tv_sec);
+	p9_pdu__put64(&req->r, st.st_atim.tv_nsec);
+	p9_pdu__put64(&req->r, st.st_mtim.tv_sec);
+	p9_pdu__put64(&req->r, st.st_mtim.tv_nsec);
+	p9_pdu__put64(&req->r, st.st_ctim.tv_sec);
+	p9_pdu__put64(&req->r, st.st_ctim.tv_nsec);
+	p9_pdu__put64(&req->r, 0);		/* btime */
+	p9_pdu__put64(&req->r, 0);
+	p9_pdu__put64(&req->r, 0);		/* gen */
+	p9_pdu__put64(&req->r, 0);		/* data_version */
+
+	return 0;
+}
+
+static int p9_setattr(struct p9_request *req)
+{
+	uint32_t valid, mode, uid, gid;
+	uint64_t size, atime_sec, atime_nsec, mtime_sec, mtime_nsec;
+	struct timespec times[2];
+	const char *name;
+	struct p9_fid *f;
+	int dfd, err = 0;
+
+	f		= p9_fid__find(p9_pdu__get32(&req->t));
+	valid		= p9_pdu__get32(&req->t);
+	mode		= p9_pdu__get32(&req->t);
+	uid		= p9_pdu__get32(&req->t);
+	gid		= p9_pdu__get32(&req->t);
+	size		= p9_pdu__get64(&req->t);
+	atime_sec	= p9_pdu__get64(&req->t);
+	atime_nsec	= p9_pdu__get64(&req->t);
+	mtime_sec	= p9_pdu__get64(&req->t);
+	mtime_nsec	= p9_pdu__get64(&req->t);
+	if (!f || req->t.error)
+		return EINVAL;
+
+	dfd	= p9_path__get_dir(f->path, &name);
+	if (dfd < 0)
+		return -dfd;
+
+	/* Symlinks have no mode of their own, fchmodat() refuses them */
+	if ((valid & P9_SETATTR_MODE) &&
+	    (f->fd >= 0 ? fchmod(f->fd, mode & 07777) :
+			  fchmodat(dfd, name, mode & 07777, AT_SYMLINK_NOFOLLOW)) < 0) {
+		err	= errno;
+		goto out;
+	}
+
+	if ((valid & (P9_SETATTR_UID | P9_SETATTR_GID)) &&
+	    fchownat(dfd, name,
+		     (valid & P9_SETATTR_UID) ? uid : (uid_t) -1,
+		     (valid & P9_SETATTR_GID) ? gid : (gid_t) -1, AT_SYMLINK_NOFOLLOW) < 0) {
+		err	= errno;
+		goto out;
+	}
+
+	if (valid & P9_SETATTR_SIZE) {
+		int fd = openat(dfd, name, O_WRONLY | O_NOFOLLOW);
+		int ret;
+
+		if (fd < 0) {
+			err	= errno;
+			goto out;
+		}
+
+		ret	= ftruncate(fd, size);
+		close(fd);
+		if (ret < 0) {
+			err	= errno;
+			goto out;
+		}
+	}
+
+	if (valid & (P9_SETATTR_ATIME | P9_SETATTR_MTIME)) {
+		times[0]	= (struct timespec) { .tv_nsec = UTIME_OMIT };
+		times[1]	= (struct timespec) { .tv_nsec = UTIME_OMIT };
+
+		if (valid & P9_SETATTR_ATIME)
+			times[0]	= (valid & P9_SETATTR_ATIME_SET) ?
+				(struct timespec) { atime_sec, atime_nsec } :
+				(struct timespec) { .tv_nsec = UTIME_NOW };
+
+		if (valid & P9_SETATTR_MTIME)
+			times[1]	= (valid & P9_SETATTR_MTIME_SET) ?
+				(struct timespec) { mtime_sec, mtime_nsec } :
+				(struct timespec) { .tv_nsec = UTIME_NOW };
+
+		if (utimensat(dfd, name, times, AT_SYMLINK_NOFOLLOW) < 0)
+			err	= errno;
+	}
+
+out:
+	p9_path__put_dir(dfd);
+
+	return err;
+}
+
+/* File data goes straight between the file and the guest buffers */
+static int p9_read(struct p9_request *req)
+{
+	struct iovec iov[VIRTIO_9P_QUEUE_SIZE];
+	uint32_t count;
+	uint64_t offset;
+	struct p9_fid *f;
+	ssize_t n;
+	int nr;
+
+	f	= p9_fid__find(p9_pdu__get32(&req->t));
+	offset	= p9_pdu__get64(&req->t);
+	count	= p9_pdu__get32(&req->t);
+	if (!f || f->fd < 0 || f->dir || req->t.error)
+		return EINVAL;
+
+	count	= MIN(count, p9_dev->msize - P9_READ_HDR_SIZE);
+	if (req->rlen < P9_READ_HDR_SIZE)
+		return EINVAL;
+	count	= MIN(count, req->rlen - P9_READ_HDR_SIZE);
+
+	nr	= iov_slice(iov, req->riov, req->nr_riov, P9_READ_HDR_SIZE, count);
+
+	n	= preadv(f->fd, iov, nr, offset);
+	if (n < 0)
+		return errno;
+
+	p9_pdu__put32(&req->r, n);
+	req->rdata	= n;
+
+	return 0;
+}
+
+static int p9_write(struct p9_request *req)
+{
+	struct iovec iov[VIRTIO_9P_QUEUE_SIZE];
+	uint32_t count;
+	uint64_t offset;
+	struct p9_fid *f;
+	ssize_t n;
+	int nr;
+
+	f	= p9_fid__find(p9_pdu__get32(&req->t));
+	offset	= p9_pdu__get64(&req->t);
+	count	= p9_pdu__get32(&req->t);
+	if (!f || f->fd < 0 || f->dir || req->t.error)
+		return EINVAL;
+
+	if (req->tlen < P9_WRITE_HDR_SIZE || count > req->tlen - P9_WRITE_HDR_SIZE)
+		return EINVAL;
+
+	nr	= iov_slice(iov, req->tiov, req->nr_tiov, P9_WRITE_HDR_SIZE, count);
+
+	n	= pwritev(f->fd, iov, nr, offset);
+	if (n < 0)
+		return errno;
+
+	p9_pdu__put32(&req->r, n);
+
+	return 0;
+}
+
+static int p9_readdir(struct p9_request *req)
+{
+	struct dirent *de;
+	uint64_t offset;
+	uint32_t count;
+	size_t count_pos, start, entry_size;
+	struct p9_fid *f;
+	struct stat st;
+
+	f	= p9_fid__find(p9_pdu__get32(&req->t));
+	offset	= p9_pdu__get64(&req->t);
+	count	= p9_pdu__get32(&req->t);
+	if (!f || !f->dir || req->t.error)
+		return EINVAL;
+
+	if (offset)
+		seekdir(f->dir, offset);
+	else
+		rewinddir(f->dir);
+
+	count_pos	= req->r.pos;
+	p9_pdu__put32(&req->r, 0);
+	start		= req->r.pos;
+
+	count		= MIN(count, req->r.size - start);
+
+	for (;;) {
+		long pos = telldir(f->dir);
+
+		errno	= 0;
+		de	= readdir(f->dir);
+		if (!de)
+			break;
+
+		entry_size	= 13 + 8 + 1 + 2 + strlen(de->d_name);
+		if (req->r.pos - start + entry_size > count) {
+			seekdir(f->dir, pos);
+			break;
+		}
+
+		if (fstatat(dirfd(f->dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+			memset(&st, 0, sizeof(st));
+			st.st_ino	= de->d_ino;
+		}
+
+		p9_pdu__put_qid(&req->r, &st);
+		p9_pdu__put64(&req->r, telldir(f->dir));
+		p9_pdu__put8(&req->r, de->d_type);
+		p9_pdu__put_str(&req->r, de->d_name);
+	}
+
+	if (errno)
+		return errno;
+
+	count	= req->r.pos - start;
+	memcpy(req->r.buf + count_pos, &count, sizeof(count));
+
+	return 0;
+}
+
+static int p9_mkdir(struct p9_request *req)
+{
+	char name[NAME_MAX + 1], path[PATH_MAX];
+	const char *last;
+	struct p9_fid *f;
+	struct stat st;
+	uint32_t mode;
+	int dfd, err;
+
+	f	= p9_fid__find(p9_pdu__get32(&req->t));
+	p9_pdu__get_str(&req->t, name, sizeof(name));
+	mode	= p9_pdu__get32(&req->t);
+	p9_pdu__get32(&req->t);			/* gid */
+	if (!f || req->t.error)
+		return EINVAL;
+
+	err	= p9_path__join(path, f->path, name);
+	if (err)
+		return err;
+
+	dfd	= p9_path__get_dir(path, &last);
+	if (dfd < 0)
+		return -dfd;
+
+	if (mkdirat(dfd, last, mode & 07777) < 0 ||
+	    fstatat(dfd, last, &st, AT_SYMLINK_NOFOLLOW) < 0)
+		err	= errno;
+
+	p9_path__put_dir(dfd);
+	if (err)
+		return err;
+
+	p9_pdu__put_qid(&req->r, &st);
+
+	return 0;
+}
+
+static int p9_renameat(struct p9_request *req)
+{
+	char oldname[NAME_MAX + 1], newname[NAME_MAX + 1];
+	char oldpath[PATH_MAX], newpath[PATH_MAX];
+	struct p9_fid *olddir, *newdir;
+	const char *oldlast, *newlast;
+	int olddfd, newdfd, err = 0;
+
+	olddir	= p9_fid__find(p9_pdu__get32(&req->t));
+	p9_pdu__get_str(&req->t, oldname, sizeof(oldname));
+	newdir	= p9_fid__find(p9_pdu__get32(&req->t));
+	p9_pdu__get_str(&req->t, newname, sizeof(newname));
+	if (!olddir || !newdir || req->t.error)
+		return EINVAL;
+
+	err	= p9_path__join(oldpath, olddir->path, oldname);
+	if (!err)
+		err	= p9_path__join(newpath, newdir->path, newname);
+	if (err)
+		return err;
+
+	olddfd	= p9_path__get_dir(oldpath, &oldlast);
+	if (olddfd < 0)
+		return -olddfd;
+
+	newdfd	= p9_path__get_dir(newpath, &newlast);
+	if (newdfd < 0) {
+		p9_path__put_dir(olddfd);
+		return -newdfd;
+	}
+
+	if (renameat(olddfd, oldlast, newdfd, newlast) < 0)
+		err	= errno;
+
+	p9_path__put_dir(newdfd);
+	p9_path__put_dir(olddfd);
+
+	return err;
+}
+
+static int p9_unlinkat(struct p9_request *req)
+{
+	char name[NAME_MAX + 1], path[PATH_MAX];
+	const char *last;
+	struct p9_fid *f;
+	uint32_t flags;
+	int dfd, err = 0;
+
+	f	= p9_fid__find(p9_pdu__get32(&req->t));
+	p9_pdu__get_str(&req->t, name, sizeof(name));
+	flags	= p9_pdu__get32(&req->t);
+	if (!f || req->t.error)
+		return EINVAL;
+
+	err	= p9_path__join(path, f->path, name);
+	if (err)
+		return err;
+
+	dfd	= p9_path__get_dir(path, &last);
+	if (dfd < 0)
+		return -dfd;
+
+	if (unlinkat(dfd, last, flags & AT_REMOVEDIR) < 0)
+		err	= errno;
+
+	p9_path__put_dir(dfd);
+
+	return err;
+}
+
+static int p9_readlink(struct p9_request *req)
+{
+	char target[PATH_MAX];
+	const char *name;
+	struct p9_fid *f;
+	ssize_t n;
+	int dfd, err;
+
+	f	= p9_fid__find(p9_pdu__get32(&req->t));
+	if (!f)
+		return EINVAL;
+
+	dfd	= p9_path__get_dir(f->path, &name);
+	if (dfd < 0)
+		return -dfd;
+
+	n	= readlinkat(dfd, name, target, sizeof(target) - 1);
+	err	= errno;
+	p9_path__put_dir(dfd);
+	if (n < 0)
+		return err;
+
+	target[n]	= '\0';
+	p9_pdu__put_str(&req->r, target);
+
+	return 0;
+}
+
+static int p9_statfs(struct p9_request *req)
+{
+	struct statfs sfs;
+	struct p9_fid *f;
+
+	f	= p9_fid__find(p9_pdu__get32(&req->t));
+	if (!f)
+		return EINVAL;
+
+	if (fstatfs(p9_dev->root_fd, &sfs) < 0)
+		return errno;
+
+	p9_pdu__put32(&req->r, sfs.f_type);
+	p9_pdu__put32(&req->r, sfs.f_bsize);
+	p9_pdu__put64(&req->r, sfs.f_blocks);
+	p9_pdu__put64(&req->r, sfs.f_bfree);
+	p9_pdu__put64(&req->r, sfs.f_bavail);
+	p9_pdu__put64(&req->r, sfs.f_files);
+	p9_pdu__put64(&req->r, sfs.f_ffree);
+	p9_pdu__put64(&req->r, 0);		/* fsid */
+	p9_pdu__put32(&req->r, sfs.f_namelen);
+
+	return 0;
+}
+
+static int p9_fsync(struct p9_request *req)
+{
+	struct p9_fid *f;
+
+	f	= p9_fid__find(p9_pdu__get32(&req->t));
+	if (!f || f->fd < 0)
+		return EINVAL;
+
+	if (fsync(f->fd) < 0)
+		return errno;
+
+	return 0;
+}
+
+static int p9_flush(struct p9_request *req)
+{
+	/* Requests are served in order, so there is never anything to abort */
+	return 0;
+}
+
+static int (*p9_handlers[])(struct p9_request *req) = {
+	[P9_TSTATFS]	= p9_statfs,
+	[P9_TLOPEN]	= p9_lopen,
+	[P9_TLCREATE]	= p9_lcreate,
+	[P9_TREADLINK]	= p9_readlink,
+	[P9_TGETATTR]	= p9_getattr,
+	[P9_TSETATTR]	= p9_setattr,
+	[P9_TREADDIR]	= p9_readdir,
+	[P9_TFSYNC]	= p9_fsync,
+	[P9_TMKDIR]	= p9_mkdir,
+	[P9_TRENAMEAT]	= p9_renameat,
+	[P9_TUNLINKAT]	= p9_unlinkat,
+	[P9_TVERSION]	= p9_version,
+	[P9_TATTACH]	= p9_attach,
+	[P9_TFLUSH]	= p9_flush,
+	[P9_TWALK]	= p9_walk,
+	[P9_TREAD]	= p9_read,
+	[P9_TWRITE]	= p9_write,
+	[P9_TCLUNK]	= p9_clunk,
+};
+
+/*
+ * Runs one request and returns the length of the R-message written to the
+ * guest.
+ */
+static uint32_t p9_handle(struct p9_request *req)
+{
+	uint8_t hdr[P9_HDR_SIZE];
+	uint32_t size, ecode;
+	uint16_t tag;
+	uint8_t type;
+	int err;
+
+	if (iov_copy_from(req->tiov, req->nr_tiov, hdr, P9_HDR_SIZE) < P9_HDR_SIZE)
+		return 0;
+
+	type	= hdr[4];
+	memcpy(&tag, hdr + 5, sizeof(tag));
+
+	/* Only the header of a Twrite is copied, the payload stays in place */
+	req->t	= (struct p9_pdu) {
+		.buf	= p9_dev->tbuf,
+		.size	= iov_copy_from(req->tiov, req->nr_tiov, p9_dev->tbuf,
+					type == P9_TWRITE ? P9_WRITE_HDR_SIZE : sizeof(p9_dev->tbuf)),
+		.pos	= P9_HDR_SIZE,
+	};
+	req->r	= (struct p9_pdu) {
+		.buf	= p9_dev->rbuf,
+		.size	= MIN(req->rlen, p9_dev->msize),
+		.pos	= P9_HDR_SIZE,
+	};
+	req->rdata	= 0;
+
+	if (type < ARRAY_SIZE(p9_handlers) && p9_handlers[type])
+		err	= p9_handlers[type](req);
+	else
+		err	= EOPNOTSUPP;
+
+	if (!err && req->r.error)
+		err	= EIO;
+
+	if (err) {
+		type		= P9_TLERROR;
+		ecode		= err;
+		req->r.pos	= P9_HDR_SIZE;
+		req->r.error	= false;
+		req->rdata	= 0;
+		p9_pdu__put32(&req->r, ecode);
+	}
+
+	size	= req->r.pos + req->rdata;
+
+	memcpy(req->r.buf, &size, sizeof(size));
+	req->r.buf[4]	= type + 1;
+	memcpy(req->r.buf + 5, &tag, sizeof(tag));
+
+	iov_copy_to(req->riov, req->nr_riov, req->r.buf, req->r.pos);
+
+	return size;
+}
+
+static bool p9_virtio_parse(struct kvm *self, uint16_t head, struct p9_request *req)
+{
+	struct vring_desc *desc;
+	uint16_t idx = head;
+	int nr = 0;
+
+	req->head	= head;
+	req->nr_tiov	= req->nr_riov	= 0;
+	req->tlen	= req->rlen	= 0;
+
+	for (;;) {
+		if (idx >= p9_dev->queue.vring.num || nr++ == VIRTIO_9P_QUEUE_SIZE)
+			return false;
+
+		desc	= &p9_dev->queue.vring.desc[idx];
+
+		if (desc->flags & VRING_DESC_F_WRITE) {
+			req->riov[req->nr_riov++]	= (struct iovec) {
+				.iov_base	= guest_flat_to_host(self, desc->addr),
+				.iov_len	= desc->len,
+			};
+			req->rlen	+= desc->len;
+		} else {
+			/* Device-readable descriptors all come first */
+			if (req->nr_riov)
+				return false;
+
+			req->tiov[req->nr_tiov++]	= (struct iovec) {
+				.iov_base	= guest_flat_to_host(self, desc->addr),
+				.iov_len	= desc->len,
+			};
+			req->tlen	+= desc->len;
+		}
+
+		if (!(desc->flags & VRING_DESC_F_NEXT))
+			return true;
+
+		idx	= desc->next;
+	}
+}
+
+static int p9_virtio_request_queue(struct kvm *self)
+{
+	struct virt_queue *queue = &p9_dev->queue;
+	struct p9_request *req = &p9_dev->req;
+	int head, nr;
+
+	for (nr = 0; (head = virt_queue__pop(queue)) >= 0; nr++) {
+		if (!p9_virtio_parse(self, head, req)) {
+			warning("virtio-9p: malformed request");
+			return -1;
+		}
+
+		virt_queue__set_used(queue, nr, head, p9_handle(req));
+	}
+
+	virt_queue__publish_used(queue, nr);
+
+	return nr;
+}
+
+static void *p9_virtio__io_thread(void *arg)
+{
+	struct kvm *self = arg;
+	eventfd_t kicks;
+
+	prctl(PR_SET_NAME, "kvm-9p");
+
+	for (;;) {
+		if (eventfd_read(p9_dev->io_efd, &kicks) < 0) {
+			if (errno == EINTR)
+				continue;
+			die_perror("eventfd_read");
+		}
+
+		if (!p9_dev->queue.pfn)
+			continue;
+
+		if (p9_virtio_request_queue(self) > 0)
+			kvm__irq_line(self, VIRTIO_9P_IRQ, 1);
+	}
+
+	return NULL;
+}
+
+static bool p9_virtio_in(struct kvm *self, uint16_t port, void *data, int size, uint32_t count)
+{
+	unsigned long offset = port - IOPORT_VIRTIO_9P;
+
+	switch (offset) {
+	case VIRTIO_PCI_HOST_FEATURES:
+		ioport__write32(data, p9_dev->host_features);
+		break;
+	case VIRTIO_PCI_GUEST_FEATURES:
+		return false;
+	case VIRTIO_PCI_QUEUE_PFN:
+		ioport__write32(data, p9_dev->queue.pfn);
+		break;
+	case VIRTIO_PCI_QUEUE_NUM:
+		ioport__write16(data, VIRTIO_9P_QUEUE_SIZE);
+		break;
+	case VIRTIO_PCI_QUEUE_SEL:
+	case VIRTIO_PCI_QUEUE_NOTIFY:
+		return false;
+	case VIRTIO_PCI_STATUS:
+		ioport__write8(data, p9_dev->status);
+		break;
+	case VIRTIO_PCI_ISR:
+		virtio_pci__isr_in(self, data, VIRTIO_9P_IRQ);
+		break;
+	default:
+		return virtio_pci__config_in(data, offset, size, count, p9_dev->config, p9_dev->config_size);
+	};
+
+	return true;
+}
+
+static bool p9_virtio_out(struct kvm *self, uint16_t port, void *data, int size, uint32_t count)
+{
+	unsigned long offset = port - IOPORT_VIRTIO_9P;
+
+	switch (offset) {
+	case VIRTIO_PCI_GUEST_FEATURES:
+		p9_dev->guest_features	= ioport__read32(data);
+		break;
+	case VIRTIO_PCI_QUEUE_PFN:
+		virt_queue__init(self, &p9_dev->queue, ioport__read32(data), VIRTIO_9P_QUEUE_SIZE);
+		break;
+	case VIRTIO_PCI_QUEUE_SEL:
+		if (ioport__read16(data) != 0)
+			return false;
+		break;
+	case VIRTIO_PCI_QUEUE_NOTIFY:
+		if (ioport__read16(data) != 0)
+			return false;
+
+		if (eventfd_write(p9_dev->io_efd, 1) < 0)
+			die_perror("eventfd_write");
+		break;
+	case VIRTIO_PCI_STATUS:
+		p9_dev->status		= ioport__read8(data);
+		break;
+	default:
+		return false;
+	};
+
+	return true;
+}
+
+static struct ioport_operations p9_virtio_io_ops = {
+	.io_in		= p9_virtio_in,
+	.io_out		= p9_virtio_out,
+};
+
+static struct pci_device_header p9_virtio_pci_template = {
+	.vendor_id		= PCI_VENDOR_ID_REDHAT_QUMRANET,
+	.device_id		= PCI_DEVICE_ID_VIRTIO_9P,
+	.header_type		= PCI_HEADER_TYPE_NORMAL,
+	.revision_id		= 0,
+	.class			= 0xff0000,
+	.subsys_vendor_id	= PCI_SUBSYSTEM_VENDOR_ID_REDHAT_QUMRANET,
+	.subsys_id		= PCI_SUBSYSTEM_ID_VIRTIO_9P,
+	.bar[0]			= IOPORT_VIRTIO_9P | PCI_BASE_ADDRESS_SPACE_IO,
+	.irq_pin		= 1,
+	.irq_line		= VIRTIO_9P_IRQ,
+};
+
+void p9_virtio__init(struct kvm *self, const char *root, const char *tag)
+{
+	struct virtio_9p_config *config;
+	size_t tag_len = strlen(tag);
+
+	if (!tag_len || tag_len > NAME_MAX)
+		die("Invalid 9p mount tag: %s", tag);
+
+	p9_dev		= calloc(1, sizeof *p9_dev);
+	if (!p9_dev)
+		die("out of memory");
+
+	p9_dev->root_fd	= open(root, O_RDONLY | O_DIRECTORY);
+	if (p9_dev->root_fd < 0)
+		die("unable to open directory %s", root);
+
+	p9_dev->kvm		= self;
+	p9_dev->msize		= P9_MAX_MSIZE;
+	p9_dev->host_features	= 1 << VIRTIO_9P_MOUNT_TAG;
+	p9_dev->pci_header	= p9_virtio_pci_template;
+
+	config			= (struct virtio_9p_config *) p9_dev->config;
+	config->tag_len		= tag_len;
+	memcpy(config->tag, tag, tag_len);
+	p9_dev->config_size	= sizeof(*config) + tag_len;
+
+	p9_dev->io_efd	= eventfd(0, 0);
+	if (p9_dev->io_efd < 0)
+		die_perror("eventfd");
+
+	if (pthread_create(&p9_dev->io_thread, NULL, p9_virtio__io_thread, self) != 0)
+		die("unable to create virtio-9p I/O thread");
+
+	pci__register(&p9_dev->pci_header, VIRTIO_9P_PCI_SLOT);
+
+	ioport__register(IOPORT_VIRTIO_9P, &p9_virtio_io_ops, IOPORT_VIRTIO_9P_SIZE);
+}
@@ -0,0 +1,183 @@
+#include "kvm/blk-trace.h"
+
+#include "kvm/util.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <stdio.h>
+
+/* Refuse to load anything bigger; a trace is meant to fit in memory */
+#define BLK_TRACE_MAX_RECORDS	(64 << 20)
+
+struct blk_trace {
+	char			*path;
+	FILE			*file;
+	uint64_t		start_ns;
+	uint64_t		nr_records;
+	bool			failed;
+	pthread_mutex_t		mutex;
+};
+
+/* There is only ever one trace per VMM, flushed when it exits */
+static struct blk_trace		*active_trace;
+
+static void blk_trace__exit(void)
+{
+	struct blk_trace *self = active_trace;
+
+	pthread_mutex_lock(&self->mutex);
+
+	if (fclose(self->file) != 0 || self->failed)
+		warning("Unable to write block trace %s", self->path);
+	else
+		info("Recorded %llu block requests to %s", (unsigned long long) self->nr_records, self->path);
+
+	self->file	= NULL;
+
+	pthread_mutex_unlock(&self->mutex);
+}
+
+struct blk_trace *blk_trace__create(const char *filename)
+{
+	struct blk_trace_header header;
+	struct blk_trace *self;
+
+	if (active_trace)
+		die("Only one block trace can be recorded at a time");
+
+	self		= calloc(1, sizeof *self);
+	if (!self)
+		die("out of memory");
+
+	self->path	= strdup(filename);
+	self->file	= fopen(filename, "w");
+	if (!self->path || !self->file)
+		die("Unable to create block trace %s", filename);
+
+	pthread_mutex_init(&self->mutex, NULL);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, BLK_TRACE_MAGIC, sizeof(BLK_TRACE_MAGIC));
+	header.version		= htole32(BLK_TRACE_VERSION);
+	header.record_size	= htole32(sizeof(struct blk_trace_record));
+
+	if (fwrite(&header, sizeof(header), 1, self->file) != 1)
+		die("Unable to write block trace %s", filename);
+
+	self->start_ns	= clock_ns();
+
+	active_trace	= self;
+	atexit(blk_trace__exit);
+
+	return self;
+}
+
+/* Converts a CLOCK_MONOTONIC timestamp to trace time */
+uint64_t blk_trace__time(struct blk_trace *self, uint64_t now_ns)
+{
+	return now_ns - self->start_ns;
+}
+
+/*
+ * Records go through stdio, so most calls only copy into its buffer. The
+ * file is in submission order of the disks' I/O threads, not time order.
+ */
+void blk_trace__record(struct blk_trace *self, struct blk_trace_record *rec)
+{
+	struct blk_trace_record le = {
+		.time_ns	= htole64(rec->time_ns),
+		.sector		= htole64(rec->sector),
+		.len		= htole32(rec->len),
+		.type		= htole32(rec->type),
+		.latency_ns	= htole32(rec->latency_ns),
+		.disk		= rec->disk,
+		.error		= rec->error,
+	};
+
+	pthread_mutex_lock(&self->mutex);
+
+	if (self->file && !self->failed) {
+		if (fwrite(&le, sizeof(le), 1, self->file) == 1)
+			self->nr_records++;
+		else
+			self->failed	= true;
+	}
+
+	pthread_mutex_unlock(&self->mutex);
+}
+
+static int blk_trace__cmp(const void *a, const void *b)
+{
+	const struct blk_trace_record *x = a, *y = b;
+
+	if (x->time_ns != y->time_ns)
+		return x->time_ns < y->time_ns ? -1 : 1;
+
+	return 0;
+}
+
+/*
+ * Returns the records of a trace sorted by pickup time, or NULL if the
+ * file isn't a trace this version understands.
+ */
+struct blk_trace_record *blk_trace__load(const char *filename, uint64_t *nr_records)
+{
+	struct blk_trace_record *records = NULL, *rec;
+	struct blk_trace_header header;
+	uint64_t nr = 0, max = 0;
+	FILE *f;
+
+	f	= fopen(filename, "r");
+	if (!f)
+		return NULL;
+
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+	    memcmp(header.magic, BLK_TRACE_MAGIC, sizeof(header.magic)) ||
+	    le32toh(header.version) != BLK_TRACE_VERSION ||
+	    le32toh(header.record_size) != sizeof(struct blk_trace_record))
+		goto out_err;
+
+	for (;;) {
+		if (nr == max) {
+			if (max == BLK_TRACE_MAX_RECORDS)
+				goto out_err;
+
+			max	= max ? max * 2 : 4096;
+			rec	= realloc(records, max * sizeof(*records));
+			if (!rec)
+				goto out_err;
+			records	= rec;
+		}
+
+		rec	= &records[nr];
+		if (fread(rec, sizeof(*rec), 1, f) != 1)
+			break;
+
+		rec->time_ns	= le64toh(rec->time_ns);
+		rec->sector	= le64toh(rec->sector);
+		rec->len	= le32toh(rec->len);
+		rec->type	= le32toh(rec->type);
+		rec->latency_ns	= le32toh(rec->latency_ns);
+		nr++;
+	}
+
+	if (ferror(f))
+		goto out_err;
+
+	fclose(f);
+
+	qsort(records, nr, sizeof(*records), blk_trace__cmp);
+
+	*nr_records	= nr;
+
+	return records;
+
+out_err:
+	fclose(f);
+	free(records);
+
+	return NULL;
+}
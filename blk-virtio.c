@@ -1,32 +1,113 @@
 #include "kvm/blk-virtio.h"
 
-#include "kvm/virtio_ring.h"
+#include "kvm/virtio-pci-dev.h"
 #include "kvm/virtio_blk.h"
 #include "kvm/virtio_pci.h"
+#include "kvm/virtio.h"
 #include "kvm/disk-image.h"
+#include "kvm/event-loop.h"
+#include "kvm/blk-trace.h"
+#include "kvm/throttle.h"
+#include "kvm/barrier.h"
+#include "kvm/control.h"
 #include "kvm/ioport.h"
 #include "kvm/util.h"
 #include "kvm/kvm.h"
 #include "kvm/pci.h"
 
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
 #include <inttypes.h>
+#include <sys/uio.h>
+#include <pthread.h>
 #include <assert.h>
+#include <stdlib.h>
 
-#define VIRTIO_BLK_IRQ		14
+#define VIRTIO_BLK_MAX_DEV	MAX_DISK_IMAGES
 
 #define NUM_VIRT_QUEUES		1
 
 #define VIRTIO_BLK_QUEUE_SIZE	16
 
-struct virt_queue {
-	struct vring			vring;
-	uint32_t			pfn;
-	/* The last_avail_idx field is an index to ->ring of struct vring_avail.
-	   It's where we assume the next request index is at.  */
-	uint16_t			last_avail_idx;
+/* Upper bound on the segments of a merged request */
+#define VIRTIO_BLK_MAX_IOV	(VIRTIO_BLK_QUEUE_SIZE * VIRTIO_BLK_QUEUE_SIZE)
+
+/* Latency buckets are powers of two in nanoseconds, the last one catches the rest */
+#define BLK_STATS_LAT_BUCKETS	32
+
+/*
+ * A request as parsed from a descriptor chain: header, any number of data
+ * descriptors and a trailing status byte.
+ */
+struct blk_virtio_request {
+	uint16_t			head;
+	uint32_t			type;
+	uint64_t			sector;
+	uint32_t			len;
+	uint8_t				*status;
+	bool				failed;
+	int				iovcount;
+	struct iovec			iov[VIRTIO_BLK_QUEUE_SIZE];
+};
+
+enum {
+	BLK_STATS_READ,
+	BLK_STATS_WRITE,
+	BLK_STATS_OTHER,
+	BLK_STATS_NR_TYPES,
+};
+
+/*
+ * Per-queue counters. They are only updated by whoever holds the queue's
+ * ->mutex, so no atomic read-modify-write is needed; readers don't take the
+ * lock and just see values that are a few requests stale.
+ */
+struct blk_stats {
+	uint64_t			reqs[BLK_STATS_NR_TYPES];
+	uint64_t			bytes[BLK_STATS_NR_TYPES];
+	uint64_t			errors;
+
+	/* Requests waiting on the avail ring when the queue was serviced */
+	uint64_t			depth[VIRTIO_BLK_QUEUE_SIZE + 1];
+
+	/* Time from avail ring pickup to used ring publish */
+	uint64_t			latency[BLK_STATS_NR_TYPES][BLK_STATS_LAT_BUCKETS];
+};
+
+struct blk_device;
+
+struct blk_queue {
+	struct blk_device		*bdev;
+	struct virt_queue		vq;
+
+	/* Serializes request processing between the vCPU and host threads */
+	pthread_mutex_t			mutex;
+	struct blk_virtio_request	reqs[VIRTIO_BLK_QUEUE_SIZE];
+
+	/* Armed while requests are held back by the disk's I/O limits */
+	struct event_handler		throttle_timer;
+	bool				throttled;
+
+	/*
+	 * Interrupt moderation: the interrupt is raised once irq_max_pending
+	 * completions have accumulated or irq_max_delay_us after the first of
+	 * them, whichever comes first. Zero in either disables moderation.
+	 */
+	pthread_mutex_t			irq_mutex;
+	uint32_t			irq_max_pending;
+	uint32_t			irq_max_delay_us;
+	uint32_t			irq_pending;
+	struct event_handler		irq_timer;
+	bool				irq_timer_armed;
+
+	struct blk_stats		stats;
 };
 
-struct device {
+struct blk_device {
+	struct kvm			*kvm;
+	struct disk_image		*disk;
+	int				idx;
+
 	struct virtio_blk_config	blk_config;
 	uint32_t			host_features;
 	uint32_t			guest_features;
@@ -36,59 +117,73 @@ struct device {
 	/* virtio queue */
 	uint16_t			queue_selector;
 
-	struct virt_queue		virt_queues[NUM_VIRT_QUEUES];
+	struct blk_queue		queues[NUM_VIRT_QUEUES];
+
+	struct pci_device_header	pci_header;
+	uint16_t			base_addr;
+	uint8_t				irq;
+
+	struct throttle			throttle;
+
+	/* Where completed requests are recorded, if anywhere */
+	struct blk_trace		*trace;
+
+	/*
+	 * Requests are serviced by a per-disk I/O thread that is woken up
+	 * through io_efd on VIRTIO_PCI_QUEUE_NOTIFY. In polling mode it
+	 * keeps spinning on the avail rings until idle for poll_idle_ns.
+	 */
+	pthread_t			io_thread;
+	int				io_efd;
+	uint64_t			poll_idle_ns;
 };
 
 #define DISK_CYLINDERS	1024
 #define DISK_HEADS	64
 #define DISK_SECTORS	32
 
-static struct device device = {
-	.blk_config		= (struct virtio_blk_config) {
-		.capacity		= DISK_CYLINDERS * DISK_HEADS * DISK_SECTORS,
-		/* VIRTIO_BLK_F_GEOMETRY */
-		.geometry		= {
-			.cylinders		= DISK_CYLINDERS,
-			.heads			= DISK_HEADS,
-			.sectors		= DISK_SECTORS,
-		},
-		/* VIRTIO_BLK_SIZE */
-		.blk_size		= 4096,
+static const struct virtio_blk_config blk_config_template = {
+	.capacity		= DISK_CYLINDERS * DISK_HEADS * DISK_SECTORS,
+	/* VIRTIO_BLK_F_GEOMETRY */
+	.geometry		= {
+		.cylinders		= DISK_CYLINDERS,
+		.heads			= DISK_HEADS,
+		.sectors		= DISK_SECTORS,
 	},
-	/*
-	 * Note we don't set VIRTIO_BLK_F_GEOMETRY here so the
-	 * node kernel will compute disk geometry by own, the
-	 * same applies to VIRTIO_BLK_F_BLK_SIZE
-	 */
-	.host_features		= 0,
+	/* VIRTIO_BLK_SIZE */
+	.blk_size		= 4096,
 };
 
-static bool virtio_blk_config_in(void *data, unsigned long offset, int size, uint32_t count)
-{
-	uint8_t *config_space = (uint8_t *) &device.blk_config;
+/*
+ * Each disk gets its own PCI slot, I/O port range and interrupt line. The
+ * lines are not shared because the ISR register can't tell disks apart.
+ */
+static const uint8_t blk_device_irqs[VIRTIO_BLK_MAX_DEV] = { 14, 15, 10, 11 };
 
-	if (size != 1 || count != 1)
-		return false;
+static struct blk_device	*blk_devices[VIRTIO_BLK_MAX_DEV];
+static int			nr_blk_devices;
 
-	ioport__write8(data, config_space[offset - VIRTIO_PCI_CONFIG_NOMSI]);
-
-	return true;
+static struct blk_device *blk_device__from_port(uint16_t port)
+{
+	return blk_devices[(port - IOPORT_VIRTIO_BLK) / IOPORT_VIRTIO_BLK_SIZE];
 }
 
 static bool blk_virtio_in(struct kvm *self, uint16_t port, void *data, int size, uint32_t count)
 {
+	struct blk_device *bdev;
 	unsigned long offset;
 
-	offset		= port - IOPORT_VIRTIO;
+	bdev		= blk_device__from_port(port);
+	offset		= port - bdev->base_addr;
 
 	switch (offset) {
 	case VIRTIO_PCI_HOST_FEATURES:
-		ioport__write32(data, device.host_features);
+		ioport__write32(data, bdev->host_features);
 		break;
 	case VIRTIO_PCI_GUEST_FEATURES:
 		return false;
 	case VIRTIO_PCI_QUEUE_PFN:
-		ioport__write32(data, device.virt_queues[device.queue_selector].pfn);
+		ioport__write32(data, bdev->queues[bdev->queue_selector].vq.pfn);
 		break;
 	case VIRTIO_PCI_QUEUE_NUM:
 		ioport__write16(data, VIRTIO_BLK_QUEUE_SIZE);
@@ -97,141 +192,564 @@ static bool blk_virtio_in(struct kvm *self, uint16_t port, void *data, int size,
 	case VIRTIO_PCI_QUEUE_NOTIFY:
 		return false;
 	case VIRTIO_PCI_STATUS:
-		ioport__write8(data, device.status);
+		ioport__write8(data, bdev->status);
 		break;
 	case VIRTIO_PCI_ISR:
-		ioport__write8(data, 0x1);
-		kvm__irq_line(self, VIRTIO_BLK_IRQ, 0);
+		virtio_pci__isr_in(self, data, bdev->irq);
 		break;
 	case VIRTIO_MSI_CONFIG_VECTOR:
-		ioport__write16(data, device.config_vector);
+		ioport__write16(data, bdev->config_vector);
 		break;
 	default:
-		return virtio_blk_config_in(data, offset, size, count);
+		return virtio_pci__config_in(data, offset, size, count, &bdev->blk_config, sizeof(bdev->blk_config));
 	};
 
 	return true;
 }
 
-static bool blk_virtio_read(struct kvm *self, struct virt_queue *queue)
+static bool blk_virtio_parse(struct kvm *self, struct blk_queue *queue, struct blk_virtio_request *req)
 {
-	struct vring_used_elem *used_elem;
-	struct virtio_blk_outhdr *req;
+	struct virtio_blk_outhdr *hdr;
 	struct vring_desc *desc;
 	uint16_t desc_ndx;
-	uint32_t block_len;
-	uint8_t *status;
-	void *block;
 
-	desc_ndx		= queue->vring.avail->ring[queue->last_avail_idx++ % queue->vring.num];
+	desc_ndx		= queue->vq.vring.avail->ring[queue->vq.last_avail_idx++ % queue->vq.vring.num];
 
-	if (desc_ndx >= queue->vring.num) {
-		warning("fatal I/O error");
+	if (desc_ndx >= queue->vq.vring.num)
 		return false;
-	}
+
+	req->head		= desc_ndx;
+	req->len		= 0;
+	req->iovcount		= 0;
 
 	/* header */
-	desc			= &queue->vring.desc[desc_ndx];
+	desc			= &queue->vq.vring.desc[desc_ndx];
 	assert(!(desc->flags & VRING_DESC_F_INDIRECT));
 
-	req			= guest_flat_to_host(self, desc->addr);
+	hdr			= guest_flat_to_host(self, desc->addr);
+	req->type		= hdr->type;
+	req->sector		= hdr->sector;
 
-	/* block */
-	desc			= &queue->vring.desc[desc->next];
-	assert(!(desc->flags & VRING_DESC_F_INDIRECT));
+	/* blocks */
+	for (;;) {
+		if (!(desc->flags & VRING_DESC_F_NEXT) || desc->next >= queue->vq.vring.num)
+			return false;
+
+		desc			= &queue->vq.vring.desc[desc->next];
+		assert(!(desc->flags & VRING_DESC_F_INDIRECT));
+
+		if (!(desc->flags & VRING_DESC_F_NEXT))
+			break;
 
-	block			= guest_flat_to_host(self, desc->addr);
-	block_len		= desc->len;
+		if (req->iovcount == ARRAY_SIZE(req->iov))
+			return false;
+
+		req->iov[req->iovcount++] = (struct iovec) {
+			.iov_base		= guest_flat_to_host(self, desc->addr),
+			.iov_len		= desc->len,
+		};
+		req->len		+= desc->len;
+	}
 
 	/* status */
-	desc			= &queue->vring.desc[desc->next];
-	assert(!(desc->flags & VRING_DESC_F_INDIRECT));
+	req->status		= guest_flat_to_host(self, desc->addr);
 
-	status			= guest_flat_to_host(self, desc->addr);
+	return true;
+}
 
-	switch (req->type) {
-	case VIRTIO_BLK_T_IN: {
-		int err;
+static int blk_virtio_request_cmp(const void *a, const void *b)
+{
+	const struct blk_virtio_request *x = *(const struct blk_virtio_request **) a;
+	const struct blk_virtio_request *y = *(const struct blk_virtio_request **) b;
 
-		err		= disk_image__read_sector(self->disk_image, req->sector, block, block_len);
-		if (err)
-			*status			= VIRTIO_BLK_S_IOERR;
-		else
-			*status			= VIRTIO_BLK_S_OK;
-		break;
+	if (x->sector != y->sector)
+		return x->sector < y->sector ? -1 : 1;
+
+	/* Keep submission order for requests to the same sector */
+	return x < y ? -1 : (x > y);
+}
+
+static bool blk_virtio_can_merge(struct blk_virtio_request *prev, struct blk_virtio_request *next, int iovcount)
+{
+	if (prev->type != next->type)
+		return false;
+
+	if (prev->type != VIRTIO_BLK_T_IN && prev->type != VIRTIO_BLK_T_OUT)
+		return false;
+
+	if (prev->len & (SECTOR_SIZE - 1))
+		return false;
+
+	if (prev->sector + (prev->len >> SECTOR_SHIFT) != next->sector)
+		return false;
+
+	return iovcount + next->iovcount <= VIRTIO_BLK_MAX_IOV;
+}
+
+static int blk_virtio_do_io(struct blk_device *bdev, uint32_t type, uint64_t sector, struct iovec *iov, int iovcount)
+{
+	switch (type) {
+	case VIRTIO_BLK_T_IN:
+		return disk_image__read_sector_iov(bdev->disk, sector, iov, iovcount);
+	case VIRTIO_BLK_T_OUT:
+		return disk_image__write_sector_iov(bdev->disk, sector, iov, iovcount);
+	default:
+		warning("request type %d", type);
+		return -1;
 	}
-	case VIRTIO_BLK_T_OUT: {
+}
+
+static void blk_virtio_complete(struct blk_virtio_request *req, int err)
+{
+	req->failed		= err != 0;
+
+	if (err)
+		*req->status		= VIRTIO_BLK_S_IOERR;
+	else
+		*req->status		= VIRTIO_BLK_S_OK;
+}
+
+/*
+ * Submit a run of requests that are sorted by sector. Requests of the same
+ * type that are contiguous on disk are issued as one vectored I/O. If the
+ * merged I/O fails, fall back to the individual requests so that only the
+ * offending ones report an error.
+ */
+static void blk_virtio_submit(struct blk_device *bdev, struct blk_virtio_request **reqs, int nr)
+{
+	struct iovec iov[VIRTIO_BLK_MAX_IOV];
+	int i, j, k;
+
+	for (i = 0; i < nr; i = j) {
+		int merged_err;
+		int iovcount;
 		int err;
 
-		err		= disk_image__write_sector(self->disk_image, req->sector, block, block_len);
-		if (err)
-			*status			= VIRTIO_BLK_S_IOERR;
-		else
-			*status			= VIRTIO_BLK_S_OK;
-		break;
+		iovcount		= reqs[i]->iovcount;
+
+		for (j = i + 1; j < nr; j++) {
+			if (!blk_virtio_can_merge(reqs[j - 1], reqs[j], iovcount))
+				break;
+			iovcount		+= reqs[j]->iovcount;
+		}
+
+		if (j - i == 1) {
+			err		= blk_virtio_do_io(bdev, reqs[i]->type, reqs[i]->sector,
+							reqs[i]->iov, reqs[i]->iovcount);
+			blk_virtio_complete(reqs[i], err);
+			continue;
+		}
+
+		for (k = i, iovcount = 0; k < j; k++) {
+			memcpy(&iov[iovcount], reqs[k]->iov, reqs[k]->iovcount * sizeof(struct iovec));
+			iovcount		+= reqs[k]->iovcount;
+		}
+
+		merged_err	= blk_virtio_do_io(bdev, reqs[i]->type, reqs[i]->sector, iov, iovcount);
+
+		for (k = i; k < j; k++) {
+			err		= merged_err;
+			if (err)
+				err	= blk_virtio_do_io(bdev, reqs[k]->type, reqs[k]->sector,
+							reqs[k]->iov, reqs[k]->iovcount);
+			blk_virtio_complete(reqs[k], err);
+		}
 	}
-	default:
-		warning("request type %d", req->type);
-		*status			= VIRTIO_BLK_S_IOERR;
+}
+
+/*
+ * Returns true if the disk's I/O limits don't allow @req to be issued yet,
+ * in which case the throttle timer is armed to retry the queue later.
+ */
+static bool blk_virtio_throttle(struct blk_queue *queue, struct blk_virtio_request *req)
+{
+	uint64_t wait_ns;
+
+	switch (req->type) {
+	case VIRTIO_BLK_T_IN:
+		wait_ns		= throttle__account(&queue->bdev->throttle, THROTTLE_READ, req->len);
 		break;
+	case VIRTIO_BLK_T_OUT:
+		wait_ns		= throttle__account(&queue->bdev->throttle, THROTTLE_WRITE, req->len);
+		break;
+	default:
+		return false;
 	}
 
-	used_elem		= &queue->vring.used->ring[queue->vring.used->idx++ % queue->vring.num];
+	if (!wait_ns)
+		return false;
 
-	used_elem->id		= desc_ndx;
-	used_elem->len		= 3;
+	if (!queue->throttled) {
+		event_loop__set_timer(&queue->throttle_timer, wait_ns);
+		queue->throttled	= true;
+	}
 
 	return true;
 }
 
+static inline void blk_stats__add(uint64_t *counter, uint64_t val)
+{
+	__atomic_store_n(counter, *counter + val, __ATOMIC_RELAXED);
+}
+
+static int blk_stats__type(uint32_t type)
+{
+	switch (type) {
+	case VIRTIO_BLK_T_IN:
+		return BLK_STATS_READ;
+	case VIRTIO_BLK_T_OUT:
+		return BLK_STATS_WRITE;
+	default:
+		return BLK_STATS_OTHER;
+	}
+}
+
+static int blk_stats__latency_bucket(uint64_t ns)
+{
+	int bucket = 63 - __builtin_clzll(ns | 1);
+
+	return MIN(bucket, BLK_STATS_LAT_BUCKETS - 1);
+}
+
+/*
+ * All requests of a pass are picked up together and published together, so
+ * they share one latency sample.
+ */
+static void blk_stats__account(struct blk_stats *stats, struct blk_virtio_request *reqs, int nr, uint64_t latency_ns)
+{
+	int bucket = blk_stats__latency_bucket(latency_ns);
+	int i, type;
+
+	for (i = 0; i < nr; i++) {
+		type		= blk_stats__type(reqs[i].type);
+
+		blk_stats__add(&stats->reqs[type], 1);
+		blk_stats__add(&stats->bytes[type], reqs[i].len);
+		blk_stats__add(&stats->latency[type][bucket], 1);
+
+		if (reqs[i].failed)
+			blk_stats__add(&stats->errors, 1);
+	}
+}
+
+static void blk_device__trace(struct blk_device *bdev, struct blk_virtio_request *reqs, int nr,
+			      uint64_t pickup_ns, uint64_t latency_ns)
+{
+	struct blk_trace_record rec;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		rec	= (struct blk_trace_record) {
+			.time_ns	= blk_trace__time(bdev->trace, pickup_ns),
+			.sector		= reqs[i].sector,
+			.len		= reqs[i].len,
+			.type		= reqs[i].type,
+			.latency_ns	= MIN(latency_ns, UINT32_MAX),
+			.disk		= bdev->idx,
+			.error		= reqs[i].failed,
+		};
+
+		blk_trace__record(bdev->trace, &rec);
+	}
+}
+
+static int blk_virtio_request_queue(struct kvm *self, struct blk_queue *queue)
+{
+	struct blk_virtio_request *sorted[VIRTIO_BLK_QUEUE_SIZE];
+	uint64_t pickup_ns, latency_ns;
+	uint16_t avail_idx;
+	int nr, i;
+
+	avail_idx		= queue->vq.vring.avail->idx;
+
+	/* Read the ring entries only after the index that covers them */
+	rmb();
+
+	if (avail_idx == queue->vq.last_avail_idx)
+		return 0;
+
+	pickup_ns		= clock_ns();
+
+	blk_stats__add(&queue->stats.depth[MIN((uint16_t) (avail_idx - queue->vq.last_avail_idx),
+					       VIRTIO_BLK_QUEUE_SIZE)], 1);
+
+	for (nr = 0; queue->vq.last_avail_idx != avail_idx; nr++) {
+		if (nr == VIRTIO_BLK_QUEUE_SIZE || !blk_virtio_parse(self, queue, &queue->reqs[nr])) {
+			warning("fatal I/O error");
+			return -1;
+		}
+
+		if (blk_virtio_throttle(queue, &queue->reqs[nr])) {
+			/* Leave it on the avail ring until the timer fires */
+			queue->vq.last_avail_idx--;
+			break;
+		}
+
+		sorted[nr]		= &queue->reqs[nr];
+	}
+
+	if (!nr)
+		return 0;
+
+	qsort(sorted, nr, sizeof(sorted[0]), blk_virtio_request_cmp);
+
+	blk_virtio_submit(queue->bdev, sorted, nr);
+
+	/* Publish completions in the order the guest made them available */
+	for (i = 0; i < nr; i++)
+		virt_queue__set_used(&queue->vq, i, queue->reqs[i].head, 3);
+
+	virt_queue__publish_used(&queue->vq, nr);
+
+	latency_ns		= clock_ns() - pickup_ns;
+
+	blk_stats__account(&queue->stats, queue->reqs, nr, latency_ns);
+
+	if (queue->bdev->trace)
+		blk_device__trace(queue->bdev, queue->reqs, nr, pickup_ns, latency_ns);
+
+	return nr;
+}
+
+static void blk_queue__irq_timer_set(struct blk_queue *queue, uint64_t ns)
+{
+	event_loop__set_timer(&queue->irq_timer, ns);
+
+	queue->irq_timer_armed	= ns != 0;
+}
+
+/* Called with ->irq_mutex held */
+static void blk_queue__irq_fire(struct blk_queue *queue)
+{
+	if (queue->irq_timer_armed)
+		blk_queue__irq_timer_set(queue, 0);
+
+	queue->irq_pending	= 0;
+
+	kvm__irq_line(queue->bdev->kvm, queue->bdev->irq, 1);
+}
+
+static void blk_queue__irq_timeout(struct event_handler *handler, uint32_t events)
+{
+	struct blk_queue *queue = handler->ptr;
+
+	pthread_mutex_lock(&queue->irq_mutex);
+
+	/* The interrupt went out before the timer could be disarmed */
+	if (!event_loop__timer_expired(handler))
+		goto out_unlock;
+
+	queue->irq_timer_armed	= false;
+
+	if (queue->irq_pending)
+		blk_queue__irq_fire(queue);
+
+out_unlock:
+	pthread_mutex_unlock(&queue->irq_mutex);
+}
+
+static void blk_queue__signal(struct blk_queue *queue, uint32_t nr)
+{
+	pthread_mutex_lock(&queue->irq_mutex);
+
+	queue->irq_pending	+= nr;
+
+	if (!queue->irq_max_pending || !queue->irq_max_delay_us ||
+			queue->irq_pending >= queue->irq_max_pending)
+		blk_queue__irq_fire(queue);
+	else if (!queue->irq_timer_armed)
+		blk_queue__irq_timer_set(queue, (uint64_t) queue->irq_max_delay_us * 1000);
+
+	pthread_mutex_unlock(&queue->irq_mutex);
+}
+
+static void blk_queue__set_irq_moderation(struct blk_queue *queue, uint32_t max_pending, uint32_t max_delay_us)
+{
+	pthread_mutex_lock(&queue->irq_mutex);
+
+	queue->irq_max_pending	= max_pending;
+	queue->irq_max_delay_us	= max_delay_us;
+
+	/* Don't leave completions waiting on a timer that may never come */
+	if (queue->irq_pending)
+		blk_queue__irq_fire(queue);
+
+	pthread_mutex_unlock(&queue->irq_mutex);
+}
+
+static int blk_virtio_process_queue(struct blk_queue *queue)
+{
+	int nr;
+
+	/* Not set up by the guest yet */
+	if (!queue->vq.pfn)
+		return 0;
+
+	pthread_mutex_lock(&queue->mutex);
+	nr	= blk_virtio_request_queue(queue->bdev->kvm, queue);
+	pthread_mutex_unlock(&queue->mutex);
+
+	if (nr > 0)
+		blk_queue__signal(queue, nr);
+
+	return nr;
+}
+
+/* The I/O thread does the work, the event loop must not block on the disk */
+static void blk_queue__throttle_timeout(struct event_handler *handler, uint32_t events)
+{
+	struct blk_queue *queue = handler->ptr;
+
+	if (!event_loop__timer_expired(handler))
+		return;
+
+	pthread_mutex_lock(&queue->mutex);
+	queue->throttled	= false;
+	pthread_mutex_unlock(&queue->mutex);
+
+	if (eventfd_write(queue->bdev->io_efd, 1) < 0)
+		die_perror("eventfd_write");
+}
+
+static bool blk_device__available(struct blk_device *bdev)
+{
+	unsigned int i;
+
+	for (i = 0; i < NUM_VIRT_QUEUES; i++) {
+		struct blk_queue *queue = &bdev->queues[i];
+
+		if (queue->vq.pfn && !queue->throttled && virt_queue__available(&queue->vq))
+			return true;
+	}
+
+	return false;
+}
+
+static void blk_device__process_queues(struct blk_device *bdev)
+{
+	unsigned int i;
+
+	for (i = 0; i < NUM_VIRT_QUEUES; i++) {
+		if (blk_virtio_process_queue(&bdev->queues[i]) < 0)
+			die("virtio-blk: unable to process request queue");
+	}
+}
+
+static void blk_device__set_notify(struct blk_device *bdev, bool enable)
+{
+	unsigned int i;
+
+	for (i = 0; i < NUM_VIRT_QUEUES; i++) {
+		struct blk_queue *queue = &bdev->queues[i];
+
+		if (!queue->vq.pfn)
+			continue;
+
+		if (enable)
+			queue->vq.vring.used->flags	&= ~VRING_USED_F_NO_NOTIFY;
+		else
+			queue->vq.vring.used->flags	|= VRING_USED_F_NO_NOTIFY;
+	}
+
+	mb();
+}
+
+/*
+ * In polling mode we spin on the avail rings with VRING_USED_F_NO_NOTIFY
+ * set, so the guest doesn't exit to kick us. Once the queues have been idle
+ * for poll_idle_ns we clear the flag and go back to waiting for the next
+ * VIRTIO_PCI_QUEUE_NOTIFY.
+ */
+static void blk_device__poll(struct blk_device *bdev)
+{
+	uint64_t idle_since;
+
+	do {
+		blk_device__set_notify(bdev, false);
+
+		idle_since	= clock_ns();
+
+		while (clock_ns() - idle_since < bdev->poll_idle_ns) {
+			if (!blk_device__available(bdev)) {
+				cpu_relax();
+				continue;
+			}
+
+			blk_device__process_queues(bdev);
+
+			idle_since	= clock_ns();
+		}
+
+		blk_device__set_notify(bdev, true);
+
+		/* Recheck so that we don't miss a request made before the flag was cleared */
+	} while (blk_device__available(bdev));
+}
+
+static void *blk_device__io_thread(void *arg)
+{
+	struct blk_device *bdev = arg;
+	char name[16];
+	eventfd_t kicks;
+
+	snprintf(name, sizeof(name), "kvm-blk%d", bdev->idx);
+	prctl(PR_SET_NAME, name);
+
+	for (;;) {
+		if (eventfd_read(bdev->io_efd, &kicks) < 0) {
+			if (errno == EINTR)
+				continue;
+			die_perror("eventfd_read");
+		}
+
+		if (bdev->poll_idle_ns)
+			blk_device__poll(bdev);
+		else
+			blk_device__process_queues(bdev);
+	}
+
+	return NULL;
+}
+
 static bool blk_virtio_out(struct kvm *self, uint16_t port, void *data, int size, uint32_t count)
 {
+	struct blk_device *bdev;
 	unsigned long offset;
 
-	offset		= port - IOPORT_VIRTIO;
+	bdev		= blk_device__from_port(port);
+	offset		= port - bdev->base_addr;
 
 	switch (offset) {
 	case VIRTIO_PCI_GUEST_FEATURES:
-		device.guest_features	= ioport__read32(data);
+		bdev->guest_features	= ioport__read32(data);
 		break;
-	case VIRTIO_PCI_QUEUE_PFN: {
-		struct virt_queue *queue;
-		void *p;
-
-		queue			= &device.virt_queues[device.queue_selector];
-
-		queue->pfn		= ioport__read32(data);
-
-		p			= guest_flat_to_host(self, queue->pfn << 12);
-
-		vring_init(&queue->vring, VIRTIO_BLK_QUEUE_SIZE, p, 4096);
+	case VIRTIO_PCI_QUEUE_PFN:
+		if (bdev->queue_selector >= NUM_VIRT_QUEUES)
+			return false;
 
+		virt_queue__init(self, &bdev->queues[bdev->queue_selector].vq, ioport__read32(data),
+				 VIRTIO_BLK_QUEUE_SIZE);
 		break;
-	}
 	case VIRTIO_PCI_QUEUE_SEL:
-		device.queue_selector	= ioport__read16(data);
+		bdev->queue_selector	= ioport__read16(data);
 		break;
 	case VIRTIO_PCI_QUEUE_NOTIFY: {
-		struct virt_queue *queue;
 		uint16_t queue_index;
 
 		queue_index		= ioport__read16(data);
+		if (queue_index >= NUM_VIRT_QUEUES)
+			return false;
 
-		queue			= &device.virt_queues[queue_index];
-
-		while (queue->vring.avail->idx != queue->last_avail_idx) {
-			if (!blk_virtio_read(self, queue))
-				return false;
-		}
-		kvm__irq_line(self, VIRTIO_BLK_IRQ, 1);
+		if (eventfd_write(bdev->io_efd, 1) < 0)
+			die_perror("eventfd_write");
 
 		break;
 	}
 	case VIRTIO_PCI_STATUS:
-		device.status		= ioport__read8(data);
+		bdev->status		= ioport__read8(data);
 		break;
 	case VIRTIO_MSI_CONFIG_VECTOR:
-		device.config_vector	= VIRTIO_MSI_NO_VECTOR;
+		bdev->config_vector	= VIRTIO_MSI_NO_VECTOR;
 		break;
 	case VIRTIO_MSI_QUEUE_VECTOR:
 		break;
@@ -247,12 +765,7 @@ static struct ioport_operations blk_virtio_io_ops = {
 	.io_out		= blk_virtio_out,
 };
 
-#define PCI_VENDOR_ID_REDHAT_QUMRANET		0x1af4
-#define PCI_DEVICE_ID_VIRTIO_BLK		0x1001
-#define PCI_SUBSYSTEM_VENDOR_ID_REDHAT_QUMRANET	0x1af4
-#define PCI_SUBSYSTEM_ID_VIRTIO_BLK		0x0002
-
-static struct pci_device_header blk_virtio_pci_device = {
+static struct pci_device_header blk_virtio_pci_template = {
 	.vendor_id		= PCI_VENDOR_ID_REDHAT_QUMRANET,
 	.device_id		= PCI_DEVICE_ID_VIRTIO_BLK,
 	.header_type		= PCI_HEADER_TYPE_NORMAL,
@@ -260,19 +773,322 @@ static struct pci_device_header blk_virtio_pci_device = {
 	.class			= 0x010000,
 	.subsys_vendor_id	= PCI_SUBSYSTEM_VENDOR_ID_REDHAT_QUMRANET,
 	.subsys_id		= PCI_SUBSYSTEM_ID_VIRTIO_BLK,
-	.bar[0]			= IOPORT_VIRTIO | PCI_BASE_ADDRESS_SPACE_IO,
 	.irq_pin		= 1,
-	.irq_line		= VIRTIO_BLK_IRQ,
 };
 
-void blk_virtio__init(struct kvm *self)
+/*
+ * Returns the disk named by @arg, or NULL after printing an error to @fd.
+ */
+static struct blk_device *blk_device__from_arg(const char *arg, int fd)
+{
+	char *end;
+	long idx;
+
+	idx	= strtol(arg, &end, 10);
+	if (*end || end == arg || idx < 0 || idx >= nr_blk_devices) {
+		dprintf(fd, "error: no such disk '%s'\n", arg);
+		return NULL;
+	}
+
+	return blk_devices[idx];
+}
+
+static void blk_device__show_irq(struct blk_device *bdev, int fd)
+{
+	struct blk_queue *queue;
+	unsigned int i;
+
+	for (i = 0; i < NUM_VIRT_QUEUES; i++) {
+		queue		= &bdev->queues[i];
+
+		dprintf(fd, "disk %d queue %u: max-completions %" PRIu32 " max-delay-usecs %" PRIu32 "\n",
+			bdev->idx, i, queue->irq_max_pending, queue->irq_max_delay_us);
+	}
+}
+
+static bool blk_virtio_irq_command(struct kvm *self, int argc, char *argv[], int fd)
+{
+	struct blk_device *bdev;
+	unsigned int i;
+	int j;
+
+	switch (argc) {
+	case 1:
+		for (j = 0; j < nr_blk_devices; j++)
+			blk_device__show_irq(blk_devices[j], fd);
+		return true;
+	case 2:
+	case 4:
+		bdev	= blk_device__from_arg(argv[1], fd);
+		if (!bdev)
+			return true;
+
+		if (argc == 4) {
+			for (i = 0; i < NUM_VIRT_QUEUES; i++)
+				blk_queue__set_irq_moderation(&bdev->queues[i], atoi(argv[2]), atoi(argv[3]));
+		}
+
+		blk_device__show_irq(bdev, fd);
+		return true;
+	default:
+		return false;
+	}
+}
+
+static struct control_command blk_virtio_irq_cmd = {
+	.name		= "blk-irq",
+	.usage		= "[<disk> [<max-completions> <max-delay-usecs>]]",
+	.handler	= blk_virtio_irq_command,
+};
+
+static void blk_device__show_throttle(struct blk_device *bdev, int fd)
 {
-	if (!self->disk_image)
+	struct throttle_limits limits;
+	char buf[256];
+
+	throttle__get_limits(&bdev->throttle, &limits);
+	throttle__format_limits(&limits, buf, sizeof(buf));
+
+	dprintf(fd, "disk %d: %s\n", bdev->idx, buf);
+}
+
+static bool blk_virtio_throttle_command(struct kvm *self, int argc, char *argv[], int fd)
+{
+	struct throttle_limits limits;
+	struct blk_device *bdev;
+	int j;
+
+	switch (argc) {
+	case 1:
+		for (j = 0; j < nr_blk_devices; j++)
+			blk_device__show_throttle(blk_devices[j], fd);
+		return true;
+	case 2:
+	case 3:
+		bdev	= blk_device__from_arg(argv[1], fd);
+		if (!bdev)
+			return true;
+
+		if (argc == 3) {
+			throttle__get_limits(&bdev->throttle, &limits);
+			if (!throttle__parse_limits(&limits, argv[2]))
+				return false;
+
+			throttle__set_limits(&bdev->throttle, &limits);
+		}
+
+		blk_device__show_throttle(bdev, fd);
+		return true;
+	default:
+		return false;
+	}
+}
+
+static struct control_command blk_virtio_throttle_cmd = {
+	.name		= "blk-throttle",
+	.usage		= "[<disk> [<key>=<rate>[:<burst>][,...]]] (keys: riops, wiops, rbps, wbps)",
+	.handler	= blk_virtio_throttle_command,
+};
+
+static const char *blk_stats_type_names[BLK_STATS_NR_TYPES] = {
+	[BLK_STATS_READ]	= "read",
+	[BLK_STATS_WRITE]	= "write",
+	[BLK_STATS_OTHER]	= "other",
+};
+
+static inline uint64_t blk_stats__get(const uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void blk_stats__format_ns(char *buf, size_t size, uint64_t ns)
+{
+	if (ns < 1000)
+		snprintf(buf, size, "%" PRIu64 "ns", ns);
+	else if (ns < 1000000)
+		snprintf(buf, size, "%" PRIu64 "us", ns / 1000);
+	else
+		snprintf(buf, size, "%" PRIu64 "ms", ns / 1000000);
+}
+
+static void blk_stats__show_latency(struct blk_stats *stats, int type, int fd)
+{
+	char lo[16], hi[16];
+	uint64_t count;
+	int i;
+
+	for (i = 0; i < BLK_STATS_LAT_BUCKETS; i++) {
+		count	= blk_stats__get(&stats->latency[type][i]);
+		if (!count)
+			continue;
+
+		blk_stats__format_ns(lo, sizeof(lo), i ? 1ULL << i : 0);
+		if (i == BLK_STATS_LAT_BUCKETS - 1)
+			strcpy(hi, "");
+		else
+			blk_stats__format_ns(hi, sizeof(hi), 1ULL << (i + 1));
+
+		dprintf(fd, "    %6s - %-6s %" PRIu64 "\n", lo, hi, count);
+	}
+}
+
+static void blk_device__show_stats(struct blk_device *bdev, int fd)
+{
+	struct blk_stats *stats;
+	uint64_t count;
+	unsigned int i;
+	int type, j;
+
+	for (i = 0; i < NUM_VIRT_QUEUES; i++) {
+		stats		= &bdev->queues[i].stats;
+
+		dprintf(fd, "disk %d queue %u: errors %" PRIu64 "\n",
+			bdev->idx, i, blk_stats__get(&stats->errors));
+
+		for (type = 0; type < BLK_STATS_NR_TYPES; type++) {
+			dprintf(fd, "  %s: %" PRIu64 " requests, %" PRIu64 " bytes\n",
+				blk_stats_type_names[type],
+				blk_stats__get(&stats->reqs[type]),
+				blk_stats__get(&stats->bytes[type]));
+
+			blk_stats__show_latency(stats, type, fd);
+		}
+
+		dprintf(fd, "  queue depth:");
+		for (j = 0; j <= VIRTIO_BLK_QUEUE_SIZE; j++) {
+			count	= blk_stats__get(&stats->depth[j]);
+			if (count)
+				dprintf(fd, " %d:%" PRIu64, j, count);
+		}
+		dprintf(fd, "\n");
+	}
+}
+
+static bool blk_virtio_stats_command(struct kvm *self, int argc, char *argv[], int fd)
+{
+	struct blk_device *bdev;
+	int j;
+
+	switch (argc) {
+	case 1:
+		for (j = 0; j < nr_blk_devices; j++)
+			blk_device__show_stats(blk_devices[j], fd);
+		return true;
+	case 2:
+		bdev	= blk_device__from_arg(argv[1], fd);
+		if (bdev)
+			blk_device__show_stats(bdev, fd);
+		return true;
+	default:
+		return false;
+	}
+}
+
+static struct control_command blk_virtio_stats_cmd = {
+	.name		= "blk-stats",
+	.usage		= "[<disk>]",
+	.handler	= blk_virtio_stats_command,
+};
+
+static void blk_virtio__dump_stats(void)
+{
+	int j;
+
+	for (j = 0; j < nr_blk_devices; j++)
+		blk_device__show_stats(blk_devices[j], STDERR_FILENO);
+}
+
+static void blk_queue__timer_create(struct event_handler *timer,
+		void (*fn)(struct event_handler *, uint32_t), struct blk_queue *queue)
+{
+	timer->callback	= fn;
+	timer->ptr	= queue;
+
+	event_loop__add_timer(timer);
+}
+
+static void blk_queue__init(struct blk_queue *queue, struct blk_device *bdev, struct blk_virtio_params *params)
+{
+	queue->bdev			= bdev;
+
+	pthread_mutex_init(&queue->mutex, NULL);
+	pthread_mutex_init(&queue->irq_mutex, NULL);
+
+	queue->irq_max_pending		= params->irq_max_pending;
+	queue->irq_max_delay_us		= params->irq_max_delay_us;
+
+	blk_queue__timer_create(&queue->irq_timer, blk_queue__irq_timeout, queue);
+	blk_queue__timer_create(&queue->throttle_timer, blk_queue__throttle_timeout, queue);
+}
+
+static void blk_device__init(struct kvm *self, struct disk_image *disk, struct blk_virtio_params *params)
+{
+	struct blk_device *bdev;
+	unsigned int i;
+
+	if (nr_blk_devices == VIRTIO_BLK_MAX_DEV)
+		die("too many virtio-blk devices (max %d)", VIRTIO_BLK_MAX_DEV);
+
+	bdev		= calloc(1, sizeof *bdev);
+	if (!bdev)
+		die("out of memory");
+
+	*bdev		= (struct blk_device) {
+		.kvm			= self,
+		.disk			= disk,
+		.idx			= nr_blk_devices,
+		.blk_config		= blk_config_template,
+		/*
+		 * Note we don't set VIRTIO_BLK_F_GEOMETRY here so the
+		 * node kernel will compute disk geometry by own, the
+		 * same applies to VIRTIO_BLK_F_BLK_SIZE
+		 */
+		.host_features		= 0,
+		.pci_header		= blk_virtio_pci_template,
+		.base_addr		= IOPORT_VIRTIO_BLK + nr_blk_devices * IOPORT_VIRTIO_BLK_SIZE,
+		.irq			= blk_device_irqs[nr_blk_devices],
+		.poll_idle_ns		= params->poll_idle_us * 1000,
+		.trace			= params->trace,
+	};
+
+	bdev->blk_config.capacity	= disk->size / SECTOR_SIZE;
+
+	bdev->pci_header.bar[0]		= bdev->base_addr | PCI_BASE_ADDRESS_SPACE_IO;
+	bdev->pci_header.irq_line	= bdev->irq;
+
+	throttle__init(&bdev->throttle, &params->throttle);
+
+	for (i = 0; i < NUM_VIRT_QUEUES; i++)
+		blk_queue__init(&bdev->queues[i], bdev, params);
+
+	bdev->io_efd	= eventfd(0, 0);
+	if (bdev->io_efd < 0)
+		die_perror("eventfd");
+
+	if (pthread_create(&bdev->io_thread, NULL, blk_device__io_thread, bdev) != 0)
+		die("unable to create virtio-blk I/O thread");
+
+	blk_devices[nr_blk_devices++]	= bdev;
+
+	pci__register(&bdev->pci_header, VIRTIO_BLK_PCI_SLOT + bdev->idx);
+
+	ioport__register(bdev->base_addr, &blk_virtio_io_ops, IOPORT_VIRTIO_BLK_SIZE);
+}
+
+void blk_virtio__init(struct kvm *self, struct blk_virtio_params *params)
+{
+	int i;
+
+	if (!self->nr_disks)
 		return;
 
-	device.blk_config.capacity = self->disk_image->size / SECTOR_SIZE;
+	for (i = 0; i < self->nr_disks; i++)
+		blk_device__init(self, self->disks[i], params);
 
-	pci__register(&blk_virtio_pci_device, 1);
+	control__register(&blk_virtio_irq_cmd);
+	control__register(&blk_virtio_throttle_cmd);
+	control__register(&blk_virtio_stats_cmd);
 
-	ioport__register(IOPORT_VIRTIO, &blk_virtio_io_ops, 256);
+	if (params->dump_stats)
+		atexit(blk_virtio__dump_stats);
 }
@@ -0,0 +1,283 @@
+/*
+ * Replays a block request trace recorded with --blk-trace against a disk
+ * image, so that image backends can be compared on a real workload without
+ * /dev/kvm or a guest.
+ */
+#include "kvm/shared-cache.h"
+#include "kvm/disk-image.h"
+#include "kvm/virtio_blk.h"
+#include "kvm/blk-trace.h"
+#include "kvm/util.h"
+
+#include <inttypes.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+
+#define BLKREPLAY_MAX_JOBS	256
+
+/* Buffers are aligned for cache=none images */
+#define BLKREPLAY_BUF_ALIGN	4096
+
+struct blkreplay {
+	struct disk_image	*disk;
+	struct blk_trace_record	*records;
+	uint64_t		nr_records;
+	uint32_t		max_len;
+
+	bool			timed;
+	bool			writes;
+	uint64_t		start_ns;
+
+	/* Next record to issue, shared by all jobs */
+	uint64_t		next;
+
+	/* Replay latency of each record, ~0 if it was skipped */
+	uint64_t		*latency_ns;
+	uint64_t		errors;
+};
+
+static void usage(char *argv[])
+{
+	fprintf(stderr, "  usage: %s [--jobs=<n>] [--timed] [--no-writes] [--disk=<n>] "
+		"[--cache=none] [--shared-cache=<name>[,<size-in-MiB>]] <disk-image> <trace>\n",
+		argv[0]);
+	fprintf(stderr, "  Writes go to the image file with --cache=none; replay a copy.\n");
+	exit(1);
+}
+
+static void sleep_until(uint64_t deadline_ns)
+{
+	struct timespec ts = {
+		.tv_sec		= deadline_ns / NSEC_PER_SEC,
+		.tv_nsec	= deadline_ns % NSEC_PER_SEC,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+static bool blkreplay__issue(struct blkreplay *self, struct blk_trace_record *rec, void *buf)
+{
+	struct iovec iov = {
+		.iov_base	= buf,
+		.iov_len	= rec->len,
+	};
+
+	switch (rec->type) {
+	case VIRTIO_BLK_T_IN:
+		return disk_image__read_sector_iov(self->disk, rec->sector, &iov, 1) == 0;
+	case VIRTIO_BLK_T_OUT:
+		return disk_image__write_sector_iov(self->disk, rec->sector, &iov, 1) == 0;
+	default:
+		return true;
+	}
+}
+
+static bool blkreplay__skip(struct blkreplay *self, struct blk_trace_record *rec)
+{
+	if (rec->type != VIRTIO_BLK_T_IN && rec->type != VIRTIO_BLK_T_OUT)
+		return true;
+
+	if (rec->type == VIRTIO_BLK_T_OUT && !self->writes)
+		return true;
+
+	return rec->sector + (rec->len >> SECTOR_SHIFT) > self->disk->size >> SECTOR_SHIFT;
+}
+
+static void *blkreplay__job(void *arg)
+{
+	struct blkreplay *self = arg;
+	struct blk_trace_record *rec;
+	uint64_t i, start;
+	void *buf;
+
+	if (posix_memalign(&buf, BLKREPLAY_BUF_ALIGN, self->max_len ? self->max_len : SECTOR_SIZE))
+		die("out of memory");
+
+	memset(buf, 0xa5, self->max_len);
+
+	for (;;) {
+		i	= __sync_fetch_and_add(&self->next, 1);
+		if (i >= self->nr_records)
+			break;
+
+		rec	= &self->records[i];
+
+		if (blkreplay__skip(self, rec)) {
+			self->latency_ns[i]	= ~0ULL;
+			continue;
+		}
+
+		if (self->timed)
+			sleep_until(self->start_ns + rec->time_ns);
+
+		start	= clock_ns();
+
+		if (!blkreplay__issue(self, rec, buf))
+			__sync_fetch_and_add(&self->errors, 1);
+
+		self->latency_ns[i]	= clock_ns() - start;
+	}
+
+	free(buf);
+
+	return NULL;
+}
+
+static int u64_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Sorts @v in place, skipped entries (~0) end up at the end */
+static void show_latency(const char *what, uint64_t *v, uint64_t nr)
+{
+	qsort(v, nr, sizeof(*v), u64_cmp);
+
+	while (nr && v[nr - 1] == ~0ULL)
+		nr--;
+
+	if (!nr)
+		return;
+
+	printf("  %s latency: p50 %" PRIu64 "us p90 %" PRIu64 "us p99 %" PRIu64 "us max %" PRIu64 "us\n",
+		what, v[nr / 2] / 1000, v[nr * 9 / 10] / 1000, v[nr * 99 / 100] / 1000, v[nr - 1] / 1000);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *image_filename = NULL, *trace_filename = NULL;
+	const char *shared_cache_name = NULL;
+	unsigned long shared_cache_mb = SHARED_CACHE_DEFAULT_MB;
+	struct blkreplay self = { .writes = true };
+	pthread_t jobs[BLKREPLAY_MAX_JOBS];
+	uint64_t nr_reads = 0, nr_writes = 0, bytes = 0;
+	uint64_t *recorded_ns, i, nr;
+	struct blk_trace_record *all;
+	unsigned int nr_jobs = 1;
+	bool direct = false;
+	double elapsed;
+	int disk_idx = 0;
+	unsigned int j;
+
+	for (j = 1; j < (unsigned int) argc; j++) {
+		if (!strncmp(argv[j], "--jobs=", 7))
+			nr_jobs		= atoi(&argv[j][7]);
+		else if (!strcmp(argv[j], "--timed"))
+			self.timed	= true;
+		else if (!strcmp(argv[j], "--no-writes"))
+			self.writes	= false;
+		else if (!strncmp(argv[j], "--disk=", 7))
+			disk_idx	= atoi(&argv[j][7]);
+		else if (!strcmp(argv[j], "--cache=none"))
+			direct		= true;
+		else if (!strncmp(argv[j], "--shared-cache=", 15)) {
+			char *size = strchr(&argv[j][15], ',');
+
+			shared_cache_name	= &argv[j][15];
+			if (size) {
+				*size++			= '\0';
+				shared_cache_mb		= atol(size);
+			}
+		} else if (argv[j][0] == '-')
+			usage(argv);
+		else if (!image_filename)
+			image_filename	= argv[j];
+		else if (!trace_filename)
+			trace_filename	= argv[j];
+		else
+			usage(argv);
+	}
+
+	if (!image_filename || !trace_filename || !nr_jobs || nr_jobs > BLKREPLAY_MAX_JOBS)
+		usage(argv);
+
+	all		= blk_trace__load(trace_filename, &nr);
+	if (!all)
+		die("Unable to load block trace %s", trace_filename);
+
+	/* Keep the requests of one disk, in pickup order */
+	self.records	= all;
+	for (i = 0; i < nr; i++) {
+		if (all[i].disk != disk_idx)
+			continue;
+
+		self.records[self.nr_records++]	= all[i];
+		self.max_len			= MAX(self.max_len, all[i].len);
+	}
+
+	if (!self.nr_records)
+		die("No requests for disk %d in %s", disk_idx, trace_filename);
+
+	self.disk	= disk_image__open(image_filename, direct);
+	if (!self.disk)
+		die("Unable to open disk image %s", image_filename);
+
+	if (shared_cache_name && !direct) {
+		struct shared_cache *cache = shared_cache__attach(shared_cache_name, shared_cache_mb);
+
+		if (cache)
+			shared_cache__add_image(cache, self.disk);
+	}
+
+	self.latency_ns	= calloc(self.nr_records, sizeof(*self.latency_ns));
+	recorded_ns	= calloc(self.nr_records, sizeof(*recorded_ns));
+	if (!self.latency_ns || !recorded_ns)
+		die("out of memory");
+
+	self.start_ns	= clock_ns();
+
+	for (j = 0; j < nr_jobs; j++) {
+		if (pthread_create(&jobs[j], NULL, blkreplay__job, &self) != 0)
+			die("unable to create replay thread");
+	}
+
+	for (j = 0; j < nr_jobs; j++)
+		pthread_join(jobs[j], NULL);
+
+	elapsed		= (double) (clock_ns() - self.start_ns) / NSEC_PER_SEC;
+
+	for (i = 0; i < self.nr_records; i++) {
+		struct blk_trace_record *rec = &self.records[i];
+
+		recorded_ns[i]	= ~0ULL;
+
+		if (self.latency_ns[i] == ~0ULL)
+			continue;
+
+		if (rec->type == VIRTIO_BLK_T_IN)
+			nr_reads++;
+		else
+			nr_writes++;
+
+		bytes		+= rec->len;
+		recorded_ns[i]	= rec->latency_ns;
+	}
+
+	printf("%s: %" PRIu64 " reads, %" PRIu64 " writes, %" PRIu64 " skipped, %" PRIu64 " errors "
+		"with %u job(s) in %.3fs\n",
+		image_filename, nr_reads, nr_writes, self.nr_records - nr_reads - nr_writes,
+		self.errors, nr_jobs, elapsed);
+	printf("  %.0f IOPS, %.1f MiB/s\n",
+		(nr_reads + nr_writes) / elapsed, bytes / elapsed / (1 << 20));
+
+	show_latency("replay", self.latency_ns, self.nr_records);
+	show_latency("recorded", recorded_ns, self.nr_records);
+
+	disk_image__close(self.disk);
+
+	free(recorded_ns);
+	free(self.latency_ns);
+	free(all);
+
+	return self.errors ? 1 : 0;
+}
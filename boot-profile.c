@@ -0,0 +1,174 @@
+#include "kvm/boot-profile.h"
+
+#include "kvm/util.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define BOOT_PROFILE_MAX_PHASES	32
+#define BOOT_PROFILE_MAX_DEPTH	8
+
+struct boot_profile_phase {
+	const char		*name;
+	unsigned int		depth;
+	uint64_t		start_ns;
+	uint64_t		end_ns;
+};
+
+static const char *boot_profile_event_names[BOOT_PROFILE_NR_EVENTS] = {
+	[BOOT_PROFILE_FIRST_RUN]	= "first KVM_RUN",
+	[BOOT_PROFILE_FIRST_SERIAL]	= "first serial byte",
+	[BOOT_PROFILE_FIRST_MARKER]	= "first guest marker",
+};
+
+/* Phases are only opened and closed by the main thread */
+static struct {
+	bool				enabled;
+	const char			*json_path;
+	uint64_t			start_ns;
+
+	struct boot_profile_phase	phases[BOOT_PROFILE_MAX_PHASES];
+	unsigned int			nr_phases;
+	unsigned int			open[BOOT_PROFILE_MAX_DEPTH];
+	unsigned int			depth;
+
+	/* 0 until the event happens */
+	uint64_t			events[BOOT_PROFILE_NR_EVENTS];
+} profile;
+
+/* As close to process start as we get: before main(), after the loader */
+static void __attribute__((constructor)) boot_profile__start(void)
+{
+	profile.start_ns	= clock_ns();
+}
+
+void boot_profile__begin(const char *name)
+{
+	struct boot_profile_phase *phase;
+
+	if (!profile.enabled || profile.nr_phases == BOOT_PROFILE_MAX_PHASES ||
+	    profile.depth == BOOT_PROFILE_MAX_DEPTH)
+		return;
+
+	phase		= &profile.phases[profile.nr_phases];
+	*phase		= (struct boot_profile_phase) {
+		.name		= name,
+		.depth		= profile.depth,
+		.start_ns	= clock_ns() - profile.start_ns,
+	};
+
+	profile.open[profile.depth++]	= profile.nr_phases++;
+}
+
+/* Closes the innermost open phase */
+void boot_profile__end(void)
+{
+	if (!profile.enabled || !profile.depth)
+		return;
+
+	profile.phases[profile.open[--profile.depth]].end_ns	= clock_ns() - profile.start_ns;
+}
+
+void boot_profile__event(enum boot_profile_event event)
+{
+	uint64_t now;
+
+	if (!profile.enabled || profile.events[event])
+		return;
+
+	now	= clock_ns() - profile.start_ns;
+
+	/* A different thread may have got there first */
+	__sync_bool_compare_and_swap(&profile.events[event], 0, now ? now : 1);
+}
+
+static void boot_profile__show_table(void)
+{
+	struct boot_profile_phase *phase;
+	unsigned int i;
+
+	fprintf(stderr, "  Boot profile, in ms since process start:\n");
+	fprintf(stderr, "  %10s %10s  %s\n", "start", "duration", "phase");
+
+	for (i = 0; i < profile.nr_phases; i++) {
+		phase	= &profile.phases[i];
+
+		fprintf(stderr, "  %10.3f %10.3f  %*s%s\n",
+			phase->start_ns / 1e6, (phase->end_ns - phase->start_ns) / 1e6,
+			phase->depth * 2, "", phase->name);
+	}
+
+	for (i = 0; i < BOOT_PROFILE_NR_EVENTS; i++) {
+		if (profile.events[i])
+			fprintf(stderr, "  %10.3f %10s  %s\n", profile.events[i] / 1e6, "", boot_profile_event_names[i]);
+		else
+			fprintf(stderr, "  %10s %10s  %s\n", "-", "", boot_profile_event_names[i]);
+	}
+}
+
+/* Trace Event Format: complete events for phases, instant events for the rest */
+static void boot_profile__write_json(void)
+{
+	struct boot_profile_phase *phase;
+	const char *sep = "";
+	unsigned int i;
+	FILE *f;
+
+	f	= fopen(profile.json_path, "w");
+	if (!f) {
+		warning("Unable to write boot profile %s", profile.json_path);
+		return;
+	}
+
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+	for (i = 0; i < profile.nr_phases; i++) {
+		phase	= &profile.phases[i];
+
+		fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+			"\"ts\":%.3f,\"dur\":%.3f}",
+			sep, phase->name, phase->start_ns / 1e3, (phase->end_ns - phase->start_ns) / 1e3);
+		sep	= ",";
+	}
+
+	for (i = 0; i < BOOT_PROFILE_NR_EVENTS; i++) {
+		if (!profile.events[i])
+			continue;
+
+		fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"g\",\"pid\":1,\"tid\":1,"
+			"\"ts\":%.3f}",
+			sep, boot_profile_event_names[i], profile.events[i] / 1e3);
+		sep	= ",";
+	}
+
+	fprintf(f, "\n]}\n");
+
+	if (fclose(f) != 0)
+		warning("Unable to write boot profile %s", profile.json_path);
+	else
+		info("Wrote boot profile to %s", profile.json_path);
+}
+
+static void boot_profile__exit(void)
+{
+	/* Whatever is still open ends with the VMM */
+	while (profile.depth)
+		boot_profile__end();
+
+	if (profile.json_path)
+		boot_profile__write_json();
+	else
+		boot_profile__show_table();
+}
+
+/* Without a file name the profile is printed as a table */
+void boot_profile__init(const char *json_path)
+{
+	profile.enabled		= true;
+	profile.json_path	= json_path;
+
+	atexit(boot_profile__exit);
+}
@@ -0,0 +1,328 @@
+#include "kvm/boot-trace.h"
+
+#include "kvm/disk-image.h"
+#include "kvm/util.h"
+
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#define BOOT_TRACE_MAGIC	"KVMBTRC"
+#define BOOT_TRACE_MAX_EXTENTS	(1 << 20)
+
+/* Largest range handed to the prefetch operation at once */
+#define BOOT_TRACE_MAX_PREFETCH	(1 << 20)
+
+struct boot_trace_header {
+	char			magic[8];
+	uint64_t		image_size;
+	uint64_t		image_mtime_ns;
+	uint64_t		nr_extents;
+};
+
+struct boot_trace_extent {
+	uint64_t		sector;
+	uint64_t		nr_sectors;
+};
+
+struct boot_trace {
+	struct disk_image	*disk;
+	char			*path;
+	uint64_t		image_mtime_ns;
+
+	pthread_mutex_t		mutex;
+	/* Read without the mutex, so that reads after the boot don't take it */
+	bool			recording;
+	uint64_t		deadline_ns;
+
+	struct boot_trace_extent *extents;
+	uint64_t		nr_extents;
+	uint64_t		max_extents;
+
+	struct boot_trace	*next;
+};
+
+static struct boot_trace	*recording_traces;
+static pthread_mutex_t		recording_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void boot_trace__save(struct boot_trace *self)
+{
+	struct boot_trace_header header;
+	char tmp[PATH_MAX];
+	uint64_t i;
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", self->path);
+
+	f	= fopen(tmp, "w");
+	if (!f) {
+		warning("Unable to create boot trace %s", tmp);
+		return;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, BOOT_TRACE_MAGIC, sizeof(BOOT_TRACE_MAGIC));
+	header.image_size	= htole64(self->disk->size);
+	header.image_mtime_ns	= htole64(self->image_mtime_ns);
+	header.nr_extents	= htole64(self->nr_extents);
+
+	for (i = 0; i < self->nr_extents; i++) {
+		self->extents[i].sector		= htole64(self->extents[i].sector);
+		self->extents[i].nr_sectors	= htole64(self->extents[i].nr_sectors);
+	}
+
+	if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+	    fwrite(self->extents, sizeof(*self->extents), self->nr_extents, f) != self->nr_extents) {
+		warning("Unable to write boot trace %s", tmp);
+		fclose(f);
+		unlink(tmp);
+		return;
+	}
+
+	if (fclose(f) != 0 || rename(tmp, self->path) < 0) {
+		warning("Unable to write boot trace %s", self->path);
+		unlink(tmp);
+		return;
+	}
+
+	info("Recorded %" PRIu64 " boot trace extents to %s", self->nr_extents, self->path);
+}
+
+/* Called with self->mutex held */
+static void boot_trace__stop(struct boot_trace *self)
+{
+	if (!self->recording)
+		return;
+
+	__atomic_store_n(&self->recording, false, __ATOMIC_RELAXED);
+
+	boot_trace__save(self);
+
+	free(self->extents);
+	self->extents	= NULL;
+}
+
+static void boot_trace__exit(void)
+{
+	struct boot_trace *self;
+
+	pthread_mutex_lock(&recording_mutex);
+
+	for (self = recording_traces; self; self = self->next) {
+		pthread_mutex_lock(&self->mutex);
+		boot_trace__stop(self);
+		pthread_mutex_unlock(&self->mutex);
+	}
+
+	pthread_mutex_unlock(&recording_mutex);
+}
+
+void boot_trace__record(struct boot_trace *self, uint64_t sector, uint64_t nr_sectors)
+{
+	struct boot_trace_extent *last;
+
+	if (!__atomic_load_n(&self->recording, __ATOMIC_RELAXED))
+		return;
+
+	pthread_mutex_lock(&self->mutex);
+
+	if (!self->recording)
+		goto out_unlock;
+
+	if (clock_ns() > self->deadline_ns || self->nr_extents == BOOT_TRACE_MAX_EXTENTS) {
+		boot_trace__stop(self);
+		goto out_unlock;
+	}
+
+	last	= self->nr_extents ? &self->extents[self->nr_extents - 1] : NULL;
+	if (last && last->sector + last->nr_sectors == sector) {
+		last->nr_sectors	+= nr_sectors;
+		goto out_unlock;
+	}
+
+	if (self->nr_extents == self->max_extents) {
+		struct boot_trace_extent *extents;
+		uint64_t max = self->max_extents ? self->max_extents * 2 : 1024;
+
+		extents	= realloc(self->extents, max * sizeof(*extents));
+		if (!extents) {
+			boot_trace__stop(self);
+			goto out_unlock;
+		}
+
+		self->extents		= extents;
+		self->max_extents	= max;
+	}
+
+	self->extents[self->nr_extents++]	= (struct boot_trace_extent) {
+		.sector		= sector,
+		.nr_sectors	= nr_sectors,
+	};
+
+out_unlock:
+	pthread_mutex_unlock(&self->mutex);
+}
+
+static void boot_trace__prefetch_range(struct boot_trace *self, uint64_t sector, uint64_t nr_sectors, void *buf)
+{
+	struct disk_image *disk = self->disk;
+	struct iovec iov;
+
+	if (disk->ops->prefetch) {
+		disk->ops->prefetch(disk, sector, nr_sectors);
+		return;
+	}
+
+	/* Reading the range is enough to warm up whatever the backend caches */
+	iov	= (struct iovec) {
+		.iov_base	= buf,
+		.iov_len	= nr_sectors << SECTOR_SHIFT,
+	};
+	disk->ops->read_sector_iov(disk, sector, &iov, 1);
+}
+
+static void *boot_trace__prefetch_thread(void *arg)
+{
+	struct boot_trace *self = arg;
+	uint64_t i, sector, end, nr;
+	void *buf;
+
+	prctl(PR_SET_NAME, "kvm-prefetch");
+
+	buf	= malloc(BOOT_TRACE_MAX_PREFETCH);
+	if (!buf)
+		goto out;
+
+	for (i = 0; i < self->nr_extents; i++) {
+		sector	= self->extents[i].sector;
+		end	= sector + self->extents[i].nr_sectors;
+
+		for (; sector < end; sector += nr) {
+			nr	= MIN(end - sector, BOOT_TRACE_MAX_PREFETCH >> SECTOR_SHIFT);
+			boot_trace__prefetch_range(self, sector, nr, buf);
+		}
+	}
+
+	free(buf);
+out:
+	free(self->extents);
+	free(self->path);
+	free(self);
+
+	return NULL;
+}
+
+/*
+ * Loads the trace of the image, if there is one recorded for the same
+ * image contents. Extents that don't fit the image are dropped.
+ */
+static bool boot_trace__load(struct boot_trace *self)
+{
+	struct boot_trace_header header;
+	uint64_t i, nr;
+	bool ret = false;
+	FILE *f;
+
+	f	= fopen(self->path, "r");
+	if (!f)
+		return false;
+
+	if (fread(&header, sizeof(header), 1, f) != 1)
+		goto out_close;
+
+	if (memcmp(header.magic, BOOT_TRACE_MAGIC, sizeof(header.magic)) ||
+	    le64toh(header.image_size) != self->disk->size ||
+	    le64toh(header.image_mtime_ns) != self->image_mtime_ns) {
+		info("Boot trace %s is stale, recording a new one", self->path);
+		goto out_close;
+	}
+
+	nr	= le64toh(header.nr_extents);
+	if (nr > BOOT_TRACE_MAX_EXTENTS)
+		goto out_close;
+
+	self->extents	= calloc(nr, sizeof(*self->extents));
+	if (!self->extents)
+		goto out_close;
+
+	if (fread(self->extents, sizeof(*self->extents), nr, f) != nr)
+		goto out_close;
+
+	for (i = 0; i < nr; i++) {
+		struct boot_trace_extent *e = &self->extents[i];
+
+		e->sector	= le64toh(e->sector);
+		e->nr_sectors	= le64toh(e->nr_sectors);
+
+		if (e->sector + e->nr_sectors > self->disk->size >> SECTOR_SHIFT)
+			continue;
+
+		self->extents[self->nr_extents++]	= *e;
+	}
+
+	ret	= true;
+
+out_close:
+	fclose(f);
+
+	if (!ret) {
+		free(self->extents);
+		self->extents		= NULL;
+		self->nr_extents	= 0;
+	}
+
+	return ret;
+}
+
+void boot_trace__start(struct disk_image *disk, const char *image_filename, unsigned int record_secs)
+{
+	struct boot_trace *self;
+	pthread_t thread;
+	struct stat st;
+
+	if (fstat(disk->fd, &st) < 0)
+		die_perror("fstat");
+
+	self	= calloc(1, sizeof *self);
+	if (!self)
+		die("out of memory");
+
+	self->path	= malloc(strlen(image_filename) + sizeof(BOOT_TRACE_SUFFIX));
+	if (!self->path)
+		die("out of memory");
+
+	sprintf(self->path, "%s%s", image_filename, BOOT_TRACE_SUFFIX);
+
+	self->disk		= disk;
+	self->image_mtime_ns	= (uint64_t) st.st_mtim.tv_sec * NSEC_PER_SEC + st.st_mtim.tv_nsec;
+
+	if (boot_trace__load(self)) {
+		if (pthread_create(&thread, NULL, boot_trace__prefetch_thread, self) != 0)
+			die("unable to create prefetch thread");
+		pthread_detach(thread);
+		return;
+	}
+
+	pthread_mutex_init(&self->mutex, NULL);
+
+	self->recording		= true;
+	self->deadline_ns	= clock_ns() + record_secs * NSEC_PER_SEC;
+
+	pthread_mutex_lock(&recording_mutex);
+	if (!recording_traces)
+		atexit(boot_trace__exit);
+	self->next		= recording_traces;
+	recording_traces	= self;
+	pthread_mutex_unlock(&recording_mutex);
+
+	disk->trace	= self;
+}
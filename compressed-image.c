@@ -0,0 +1,900 @@
+#include "kvm/compressed-image.h"
+
+#include "kvm/disk-image.h"
+#include "kvm/util.h"
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <endian.h>
+#include <zlib.h>
+
+#ifdef CONFIG_HAS_ZSTD
+#include <zstd.h>
+#endif
+
+#define CIMG_MIN_CHUNK_SHIFT	SECTOR_SHIFT
+#define CIMG_MAX_CHUNK_SHIFT	24
+
+#define CIMG_NR_SHARDS		16
+
+/* Reads that miss at least this many chunks are decompressed in parallel */
+#define CIMG_PARALLEL_CHUNKS	2
+#define CIMG_MAX_WORKERS	8
+
+unsigned long compressed_image_cache_mb = 64;
+
+struct cimg_chunk {
+	uint64_t		idx;
+	void			*data;
+	unsigned int		ref;
+	struct cimg_chunk	*hnext;
+	struct cimg_chunk	*prev, *next;
+};
+
+/*
+ * The cache is split into shards, each with its own lock, hash table and
+ * LRU list, so that the I/O thread and the decompression workers rarely
+ * contend. Chunk i lives in shard i % CIMG_NR_SHARDS which spreads
+ * sequential reads evenly.
+ */
+struct cimg_shard {
+	pthread_mutex_t		mutex;
+	struct cimg_chunk	**buckets;
+	unsigned int		nr_buckets;
+	struct cimg_chunk	lru;		/* lru.next is the most recently used */
+	unsigned int		nr_chunks;
+	unsigned int		max_chunks;
+};
+
+struct cimg {
+	int			fd;
+	uint32_t		codec;
+	uint32_t		chunk_shift;
+	uint64_t		chunk_size;
+	uint64_t		nr_chunks;
+	uint64_t		*index;
+
+	struct cimg_shard	shards[CIMG_NR_SHARDS];
+
+	/* Writable overlay: one bit per sector that has been written to */
+	void			*overlay;
+	unsigned long		*overlay_map;
+};
+
+struct cimg_batch {
+	struct disk_image	*disk;
+	uint64_t		*chunks;
+	int			nr;
+	int			next;
+	int			users;
+};
+
+/*
+ * Decompression workers are shared by all compressed images. A reader posts
+ * a batch of missing chunks, and idle workers join it. There is only one
+ * batch slot: a reader that finds it busy decompresses its batch alone.
+ */
+static struct {
+	pthread_mutex_t		mutex;
+	pthread_cond_t		work_cond;
+	pthread_cond_t		done_cond;
+	struct cimg_batch	*batch;
+	int			nr_workers;
+} cimg_pool = {
+	.mutex			= PTHREAD_MUTEX_INITIALIZER,
+	.work_cond		= PTHREAD_COND_INITIALIZER,
+	.done_cond		= PTHREAD_COND_INITIALIZER,
+};
+
+struct iov_cursor {
+	const struct iovec	*iov;
+	int			iovcount;
+	size_t			off;
+};
+
+static void iov_cursor__copy(struct iov_cursor *self, void *buf, size_t len, bool to_iov)
+{
+	while (len) {
+		const struct iovec *iov = self->iov;
+		size_t n = MIN(len, iov->iov_len - self->off);
+
+		if (to_iov)
+			memcpy(iov->iov_base + self->off, buf, n);
+		else
+			memcpy(buf, iov->iov_base + self->off, n);
+
+		buf		+= n;
+		len		-= n;
+		self->off	+= n;
+
+		if (self->off == iov->iov_len) {
+			self->iov++;
+			self->iovcount--;
+			self->off	= 0;
+		}
+	}
+}
+
+static uint64_t chunk_len(struct cimg *self, struct disk_image *disk, uint64_t idx)
+{
+	uint64_t start = idx << self->chunk_shift;
+
+	return MIN(self->chunk_size, disk->size - start);
+}
+
+static int cimg__inflate(struct cimg *self, void *dst, uint64_t dst_len, void *src, uint64_t src_len)
+{
+	switch (self->codec) {
+	case COMPRESSED_IMAGE_ZLIB: {
+		uLongf len = dst_len;
+
+		if (uncompress(dst, &len, src, src_len) != Z_OK || len != dst_len)
+			return -1;
+
+		return 0;
+	}
+#ifdef CONFIG_HAS_ZSTD
+	case COMPRESSED_IMAGE_ZSTD: {
+		size_t len = ZSTD_decompress(dst, dst_len, src, src_len);
+
+		if (ZSTD_isError(len) || len != dst_len)
+			return -1;
+
+		return 0;
+	}
+#endif
+	default:
+		return -1;
+	}
+}
+
+static void *cimg__decompress(struct disk_image *disk, uint64_t idx)
+{
+	struct cimg *self = disk->priv;
+	uint64_t clen, len;
+	void *src, *dst;
+
+	clen	= self->index[idx + 1] - self->index[idx];
+	len	= chunk_len(self, disk, idx);
+
+	dst	= malloc(self->chunk_size);
+	if (!dst)
+		return NULL;
+
+	if (clen == len) {
+		if (pread(self->fd, dst, len, self->index[idx]) != (ssize_t)len)
+			goto failed_free_dst;
+
+		return dst;
+	}
+
+	src	= malloc(clen);
+	if (!src)
+		goto failed_free_dst;
+
+	if (pread(self->fd, src, clen, self->index[idx]) != (ssize_t)clen)
+		goto failed_free_src;
+
+	if (cimg__inflate(self, dst, len, src, clen) < 0)
+		goto failed_free_src;
+
+	free(src);
+
+	return dst;
+
+failed_free_src:
+	free(src);
+failed_free_dst:
+	free(dst);
+
+	return NULL;
+}
+
+static struct cimg_shard *cimg__shard(struct cimg *self, uint64_t idx)
+{
+	return &self->shards[idx % CIMG_NR_SHARDS];
+}
+
+static struct cimg_chunk **cimg_shard__bucket(struct cimg_shard *self, uint64_t idx)
+{
+	return &self->buckets[(idx / CIMG_NR_SHARDS) & (self->nr_buckets - 1)];
+}
+
+static void cimg_shard__lru_del(struct cimg_chunk *chunk)
+{
+	chunk->prev->next	= chunk->next;
+	chunk->next->prev	= chunk->prev;
+}
+
+static void cimg_shard__lru_add(struct cimg_shard *self, struct cimg_chunk *chunk)
+{
+	chunk->prev		= &self->lru;
+	chunk->next		= self->lru.next;
+	self->lru.next->prev	= chunk;
+	self->lru.next		= chunk;
+}
+
+static struct cimg_chunk *cimg_shard__find(struct cimg_shard *self, uint64_t idx)
+{
+	struct cimg_chunk *chunk;
+
+	for (chunk = *cimg_shard__bucket(self, idx); chunk; chunk = chunk->hnext) {
+		if (chunk->idx == idx)
+			return chunk;
+	}
+
+	return NULL;
+}
+
+static void cimg_shard__evict(struct cimg_shard *self)
+{
+	struct cimg_chunk *chunk, *prev, **p;
+
+	for (chunk = self->lru.prev; chunk != &self->lru && self->nr_chunks > self->max_chunks; chunk = prev) {
+		prev	= chunk->prev;
+
+		if (chunk->ref)
+			continue;
+
+		for (p = cimg_shard__bucket(self, chunk->idx); *p != chunk; p = &(*p)->hnext)
+			;
+		*p	= chunk->hnext;
+
+		cimg_shard__lru_del(chunk);
+		self->nr_chunks--;
+
+		free(chunk->data);
+		free(chunk);
+	}
+}
+
+static struct cimg_chunk *cimg__cache_get(struct cimg *self, uint64_t idx)
+{
+	struct cimg_shard *shard = cimg__shard(self, idx);
+	struct cimg_chunk *chunk;
+
+	pthread_mutex_lock(&shard->mutex);
+
+	chunk	= cimg_shard__find(shard, idx);
+	if (chunk) {
+		chunk->ref++;
+		cimg_shard__lru_del(chunk);
+		cimg_shard__lru_add(shard, chunk);
+	}
+
+	pthread_mutex_unlock(&shard->mutex);
+
+	return chunk;
+}
+
+static bool cimg__cache_contains(struct cimg *self, uint64_t idx)
+{
+	struct cimg_shard *shard = cimg__shard(self, idx);
+	bool ret;
+
+	pthread_mutex_lock(&shard->mutex);
+	ret	= cimg_shard__find(shard, idx) != NULL;
+	pthread_mutex_unlock(&shard->mutex);
+
+	return ret;
+}
+
+static struct cimg_chunk *cimg__cache_insert(struct cimg *self, uint64_t idx, void *data)
+{
+	struct cimg_shard *shard = cimg__shard(self, idx);
+	struct cimg_chunk *chunk, **bucket;
+
+	pthread_mutex_lock(&shard->mutex);
+
+	/* Somebody else decompressed the same chunk meanwhile */
+	chunk	= cimg_shard__find(shard, idx);
+	if (chunk) {
+		chunk->ref++;
+		pthread_mutex_unlock(&shard->mutex);
+		free(data);
+		return chunk;
+	}
+
+	chunk	= malloc(sizeof *chunk);
+	if (!chunk) {
+		pthread_mutex_unlock(&shard->mutex);
+		free(data);
+		return NULL;
+	}
+
+	bucket		= cimg_shard__bucket(shard, idx);
+
+	chunk->idx	= idx;
+	chunk->data	= data;
+	chunk->ref	= 1;
+	chunk->hnext	= *bucket;
+	*bucket		= chunk;
+
+	cimg_shard__lru_add(shard, chunk);
+	shard->nr_chunks++;
+
+	cimg_shard__evict(shard);
+
+	pthread_mutex_unlock(&shard->mutex);
+
+	return chunk;
+}
+
+static void cimg__cache_put(struct cimg *self, struct cimg_chunk *chunk)
+{
+	struct cimg_shard *shard = cimg__shard(self, chunk->idx);
+
+	pthread_mutex_lock(&shard->mutex);
+	chunk->ref--;
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+static struct cimg_chunk *cimg__get_chunk(struct disk_image *disk, uint64_t idx)
+{
+	struct cimg *self = disk->priv;
+	struct cimg_chunk *chunk;
+	void *data;
+
+	chunk	= cimg__cache_get(self, idx);
+	if (chunk)
+		return chunk;
+
+	data	= cimg__decompress(disk, idx);
+	if (!data)
+		return NULL;
+
+	return cimg__cache_insert(self, idx, data);
+}
+
+static void cimg_batch__run(struct disk_image *disk, struct cimg_batch *batch)
+{
+	struct cimg_chunk *chunk;
+	int i;
+
+	for (;;) {
+		i	= __sync_fetch_and_add(&batch->next, 1);
+		if (i >= batch->nr)
+			break;
+
+		/* Failures are reported again when the reader gets to the chunk */
+		chunk	= cimg__get_chunk(disk, batch->chunks[i]);
+		if (chunk)
+			cimg__cache_put(disk->priv, chunk);
+	}
+}
+
+static void *cimg_pool__worker(void *arg)
+{
+	struct cimg_batch *batch;
+
+	for (;;) {
+		pthread_mutex_lock(&cimg_pool.mutex);
+		while (!cimg_pool.batch)
+			pthread_cond_wait(&cimg_pool.work_cond, &cimg_pool.mutex);
+		batch	= cimg_pool.batch;
+		batch->users++;
+		pthread_mutex_unlock(&cimg_pool.mutex);
+
+		cimg_batch__run(batch->disk, batch);
+
+		pthread_mutex_lock(&cimg_pool.mutex);
+		if (cimg_pool.batch == batch)
+			cimg_pool.batch	= NULL;
+		batch->users--;
+		pthread_cond_broadcast(&cimg_pool.done_cond);
+		pthread_mutex_unlock(&cimg_pool.mutex);
+	}
+
+	return NULL;
+}
+
+static void cimg_pool__start(void)
+{
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t thread;
+	int i;
+
+	for (i = 0; i < MIN(nr_cpus - 1, CIMG_MAX_WORKERS); i++) {
+		if (pthread_create(&thread, NULL, cimg_pool__worker, NULL) != 0)
+			break;
+		cimg_pool.nr_workers++;
+	}
+}
+
+static void cimg_pool__init(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once(&once, cimg_pool__start);
+}
+
+/*
+ * Decompresses the chunks of a large read that are not cached yet, using
+ * the worker pool, so that the copy loop afterwards only hits the cache.
+ */
+static void cimg__prefetch(struct disk_image *disk, uint64_t offset, uint64_t len)
+{
+	struct cimg *self = disk->priv;
+	uint64_t chunks[64];
+	struct cimg_batch batch;
+	uint64_t idx, last;
+	int nr = 0;
+
+	if (!cimg_pool.nr_workers || !len)
+		return;
+
+	last	= (offset + len - 1) >> self->chunk_shift;
+
+	for (idx = offset >> self->chunk_shift; idx <= last && nr < (int)ARRAY_SIZE(chunks); idx++) {
+		if (!cimg__cache_contains(self, idx))
+			chunks[nr++]	= idx;
+	}
+
+	if (nr < CIMG_PARALLEL_CHUNKS)
+		return;
+
+	batch	= (struct cimg_batch) {
+		.disk		= disk,
+		.chunks		= chunks,
+		.nr		= nr,
+	};
+
+	pthread_mutex_lock(&cimg_pool.mutex);
+	if (!cimg_pool.batch) {
+		cimg_pool.batch	= &batch;
+		pthread_cond_broadcast(&cimg_pool.work_cond);
+	}
+	pthread_mutex_unlock(&cimg_pool.mutex);
+
+	cimg_batch__run(disk, &batch);
+
+	pthread_mutex_lock(&cimg_pool.mutex);
+	if (cimg_pool.batch == &batch)
+		cimg_pool.batch	= NULL;
+	while (batch.users)
+		pthread_cond_wait(&cimg_pool.done_cond, &cimg_pool.mutex);
+	pthread_mutex_unlock(&cimg_pool.mutex);
+}
+
+static bool cimg__overlay_test(struct cimg *self, uint64_t sector)
+{
+	unsigned long word = __atomic_load_n(&self->overlay_map[sector / BITS_PER_LONG], __ATOMIC_ACQUIRE);
+
+	return word & (1UL << (sector % BITS_PER_LONG));
+}
+
+static void cimg__overlay_set(struct cimg *self, uint64_t sector)
+{
+	__atomic_fetch_or(&self->overlay_map[sector / BITS_PER_LONG], 1UL << (sector % BITS_PER_LONG), __ATOMIC_RELEASE);
+}
+
+static int compressed_image__read_sector_iov(struct disk_image *disk, uint64_t sector, const struct iovec *iov, int iovcount)
+{
+	struct cimg *self = disk->priv;
+	struct cimg_chunk *chunk = NULL;
+	struct iov_cursor cur = { .iov = iov, .iovcount = iovcount };
+	uint64_t offset = sector << SECTOR_SHIFT;
+	uint64_t len = 0;
+	int i;
+
+	for (i = 0; i < iovcount; i++)
+		len	+= iov[i].iov_len;
+
+	if (offset + len > disk->size)
+		return -1;
+
+	cimg__prefetch(disk, offset, len);
+
+	while (len) {
+		bool overlay = cimg__overlay_test(self, offset >> SECTOR_SHIFT);
+		uint64_t n = MIN(len, SECTOR_SIZE - (offset & (SECTOR_SIZE - 1)));
+		uint64_t idx = offset >> self->chunk_shift;
+		uint64_t chunk_end = (idx + 1) << self->chunk_shift;
+
+		/* Extend the run over sectors coming from the same place */
+		while (n < len && offset + n < chunk_end &&
+		       cimg__overlay_test(self, (offset + n) >> SECTOR_SHIFT) == overlay)
+			n	= MIN(len, n + SECTOR_SIZE);
+
+		if (overlay) {
+			iov_cursor__copy(&cur, self->overlay + offset, n, true);
+		} else {
+			if (chunk && chunk->idx != idx) {
+				cimg__cache_put(self, chunk);
+				chunk	= NULL;
+			}
+			if (!chunk) {
+				chunk	= cimg__get_chunk(disk, idx);
+				if (!chunk)
+					return -1;
+			}
+			iov_cursor__copy(&cur, chunk->data + (offset & (self->chunk_size - 1)), n, true);
+		}
+
+		offset	+= n;
+		len	-= n;
+	}
+
+	if (chunk)
+		cimg__cache_put(self, chunk);
+
+	return 0;
+}
+
+/* Brings a sector into the overlay before a write covers only part of it */
+static int cimg__overlay_fill(struct disk_image *disk, uint64_t sector)
+{
+	struct cimg *self = disk->priv;
+	uint64_t offset = sector << SECTOR_SHIFT;
+	struct iovec iov;
+
+	if (cimg__overlay_test(self, sector))
+		return 0;
+
+	iov	= (struct iovec) {
+		.iov_base	= self->overlay + offset,
+		.iov_len	= MIN(SECTOR_SIZE, disk->size - offset),
+	};
+
+	return compressed_image__read_sector_iov(disk, sector, &iov, 1);
+}
+
+static int compressed_image__write_sector_iov(struct disk_image *disk, uint64_t sector, const struct iovec *iov, int iovcount)
+{
+	struct cimg *self = disk->priv;
+	struct iov_cursor cur = { .iov = iov, .iovcount = iovcount };
+	uint64_t offset = sector << SECTOR_SHIFT;
+	uint64_t len = 0, end;
+	int i;
+
+	for (i = 0; i < iovcount; i++)
+		len	+= iov[i].iov_len;
+
+	if (offset + len > disk->size)
+		return -1;
+
+	if (!len)
+		return 0;
+
+	end	= offset + len;
+
+	/*
+	 * A sector the write ends in the middle of keeps the rest of its image
+	 * contents. The last sector of an image that isn't a whole number of
+	 * sectors long is covered once the write reaches the end of the image.
+	 */
+	if ((end & (SECTOR_SIZE - 1)) && end != disk->size &&
+	    cimg__overlay_fill(disk, end >> SECTOR_SHIFT) < 0)
+		return -1;
+
+	iov_cursor__copy(&cur, self->overlay + offset, len, false);
+
+	for (end = (end - 1) >> SECTOR_SHIFT; sector <= end; sector++)
+		cimg__overlay_set(self, sector);
+
+	return 0;
+}
+
+static void compressed_image__prefetch(struct disk_image *disk, uint64_t sector, uint64_t nr_sectors)
+{
+	struct cimg *self = disk->priv;
+	uint64_t offset = sector << SECTOR_SHIFT;
+	uint64_t len = nr_sectors << SECTOR_SHIFT;
+	struct cimg_chunk *chunk;
+	uint64_t idx;
+
+	if (offset >= disk->size)
+		return;
+
+	len	= MIN(len, disk->size - offset);
+
+	cimg__prefetch(disk, offset, len);
+
+	for (idx = offset >> self->chunk_shift; idx <= (offset + len - 1) >> self->chunk_shift; idx++) {
+		chunk	= cimg__get_chunk(disk, idx);
+		if (chunk)
+			cimg__cache_put(self, chunk);
+	}
+}
+
+static void compressed_image__close(struct disk_image *disk)
+{
+	struct cimg *self = disk->priv;
+	struct cimg_chunk *chunk, *next;
+	int i;
+
+	for (i = 0; i < CIMG_NR_SHARDS; i++) {
+		struct cimg_shard *shard = &self->shards[i];
+
+		for (chunk = shard->lru.next; chunk != &shard->lru; chunk = next) {
+			next	= chunk->next;
+			free(chunk->data);
+			free(chunk);
+		}
+		free(shard->buckets);
+	}
+
+	if (self->overlay && munmap(self->overlay, disk->size) < 0)
+		warning("munmap() failed");
+
+	free(self->overlay_map);
+	free(self->index);
+	free(self);
+}
+
+static struct disk_image_operations compressed_image_ops = {
+	.read_sector_iov	= compressed_image__read_sector_iov,
+	.write_sector_iov	= compressed_image__write_sector_iov,
+	.prefetch		= compressed_image__prefetch,
+	.close			= compressed_image__close,
+};
+
+bool compressed_image__codec_supported(uint32_t codec)
+{
+	switch (codec) {
+	case COMPRESSED_IMAGE_ZLIB:
+		return true;
+#ifdef CONFIG_HAS_ZSTD
+	case COMPRESSED_IMAGE_ZSTD:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+static int cimg__init_cache(struct cimg *self)
+{
+	uint64_t max_chunks;
+	unsigned int nr_buckets;
+	int i;
+
+	max_chunks	= ((uint64_t)compressed_image_cache_mb << 20) / self->chunk_size / CIMG_NR_SHARDS;
+	if (!max_chunks)
+		max_chunks	= 1;
+
+	for (nr_buckets = 1; nr_buckets < max_chunks * 2; nr_buckets <<= 1)
+		;
+
+	for (i = 0; i < CIMG_NR_SHARDS; i++) {
+		struct cimg_shard *shard = &self->shards[i];
+
+		pthread_mutex_init(&shard->mutex, NULL);
+
+		shard->buckets		= calloc(nr_buckets, sizeof *shard->buckets);
+		if (!shard->buckets)
+			return -1;
+
+		shard->nr_buckets	= nr_buckets;
+		shard->max_chunks	= max_chunks;
+		shard->lru.prev		= &shard->lru;
+		shard->lru.next		= &shard->lru;
+	}
+
+	return 0;
+}
+
+struct disk_image *compressed_image__probe(int fd, uint64_t file_size)
+{
+	struct compressed_image_header header;
+	struct disk_image *disk;
+	struct cimg *self;
+	uint64_t i, nr_sectors;
+	size_t index_size;
+
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header))
+		return NULL;
+
+	if (memcmp(header.magic, COMPRESSED_IMAGE_MAGIC, sizeof(header.magic)))
+		return NULL;
+
+	if (le32toh(header.version) != COMPRESSED_IMAGE_VERSION)
+		die("Unsupported compressed image version %u", le32toh(header.version));
+
+	if (!compressed_image__codec_supported(le32toh(header.codec)))
+		die("Compressed image codec %u is not supported", le32toh(header.codec));
+
+	self	= calloc(1, sizeof *self);
+	if (!self)
+		return NULL;
+
+	self->fd		= fd;
+	self->codec		= le32toh(header.codec);
+	self->chunk_shift	= le32toh(header.chunk_shift);
+	self->chunk_size	= 1ULL << self->chunk_shift;
+	self->nr_chunks		= le64toh(header.nr_chunks);
+
+	if (self->chunk_shift < CIMG_MIN_CHUNK_SHIFT || self->chunk_shift > CIMG_MAX_CHUNK_SHIFT)
+		die("Invalid compressed image chunk size");
+
+	if (self->nr_chunks != (le64toh(header.size) + self->chunk_size - 1) >> self->chunk_shift)
+		die("Invalid compressed image chunk count");
+
+	index_size	= (self->nr_chunks + 1) * sizeof(uint64_t);
+
+	self->index	= malloc(index_size);
+	if (!self->index)
+		goto failed_free;
+
+	if (pread(fd, self->index, index_size, le64toh(header.index_offset)) != (ssize_t)index_size)
+		die("Unable to read compressed image index");
+
+	for (i = 0; i <= self->nr_chunks; i++) {
+		self->index[i]	= le64toh(self->index[i]);
+
+		if (self->index[i] > file_size || (i && self->index[i] < self->index[i - 1]))
+			die("Corrupted compressed image index");
+	}
+
+	disk	= disk_image__new(fd, le64toh(header.size), &compressed_image_ops);
+	if (!disk)
+		goto failed_free;
+
+	disk->priv	= self;
+
+	nr_sectors		= (disk->size + SECTOR_SIZE - 1) >> SECTOR_SHIFT;
+
+	self->overlay		= mmap(NULL, disk->size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (self->overlay == MAP_FAILED) {
+		self->overlay	= NULL;
+		goto failed_free_disk;
+	}
+
+	self->overlay_map	= calloc((nr_sectors + BITS_PER_LONG - 1) / BITS_PER_LONG, sizeof(unsigned long));
+	if (!self->overlay_map)
+		goto failed_free_disk;
+
+	if (cimg__init_cache(self) < 0)
+		goto failed_free_disk;
+
+	cimg_pool__init();
+
+	return disk;
+
+failed_free_disk:
+	compressed_image__close(disk);
+	free(disk);
+
+	return NULL;
+
+failed_free:
+	free(self->index);
+	free(self);
+
+	return NULL;
+}
+
+static int cimg__deflate(uint32_t codec, void *dst, uint64_t *dst_len, void *src, uint64_t src_len)
+{
+	switch (codec) {
+	case COMPRESSED_IMAGE_ZLIB: {
+		uLongf len = *dst_len;
+
+		if (compress2(dst, &len, src, src_len, Z_BEST_COMPRESSION) != Z_OK)
+			return -1;
+
+		*dst_len	= len;
+
+		return 0;
+	}
+#ifdef CONFIG_HAS_ZSTD
+	case COMPRESSED_IMAGE_ZSTD: {
+		size_t len = ZSTD_compress(dst, *dst_len, src, src_len, 19);
+
+		if (ZSTD_isError(len))
+			return -1;
+
+		*dst_len	= len;
+
+		return 0;
+	}
+#endif
+	default:
+		return -1;
+	}
+}
+
+static uint64_t cimg__deflate_bound(uint32_t codec, uint64_t len)
+{
+#ifdef CONFIG_HAS_ZSTD
+	if (codec == COMPRESSED_IMAGE_ZSTD)
+		return ZSTD_compressBound(len);
+#endif
+	return compressBound(len);
+}
+
+int compressed_image__create(int src_fd, int dst_fd, uint32_t codec, uint32_t chunk_shift)
+{
+	struct compressed_image_header header;
+	uint64_t size, nr_chunks, chunk_size, offset, i;
+	uint64_t *index = NULL;
+	void *src = NULL, *dst = NULL;
+	size_t index_size;
+	off_t end;
+	ssize_t n;
+	int ret = -1;
+
+	if (!compressed_image__codec_supported(codec) ||
+	    chunk_shift < CIMG_MIN_CHUNK_SHIFT || chunk_shift > CIMG_MAX_CHUNK_SHIFT) {
+		errno	= EINVAL;
+		return -1;
+	}
+
+	end		= lseek(src_fd, 0, SEEK_END);
+	if (end < 0)
+		return -1;
+
+	size		= end;
+	chunk_size	= 1ULL << chunk_shift;
+	nr_chunks	= (size + chunk_size - 1) >> chunk_shift;
+	index_size	= (nr_chunks + 1) * sizeof(uint64_t);
+
+	index		= malloc(index_size);
+	src		= malloc(chunk_size);
+	dst		= malloc(cimg__deflate_bound(codec, chunk_size));
+	if (!index || !src || !dst)
+		goto out;
+
+	offset		= sizeof(header) + index_size;
+
+	for (i = 0; i < nr_chunks; i++) {
+		uint64_t len = MIN(chunk_size, size - (i << chunk_shift));
+		uint64_t clen = cimg__deflate_bound(codec, chunk_size);
+		void *buf = dst;
+
+		n		= pread(src_fd, src, len, i << chunk_shift);
+		if (n != (ssize_t)len) {
+			/* The source shrank under us */
+			if (n >= 0)
+				errno	= EIO;
+			goto out;
+		}
+
+		if (cimg__deflate(codec, dst, &clen, src, len) < 0) {
+			errno	= EIO;
+			goto out;
+		}
+
+		/* Incompressible chunks are stored as is */
+		if (clen >= len) {
+			buf	= src;
+			clen	= len;
+		}
+
+		if (pwrite(dst_fd, buf, clen, offset) != (ssize_t)clen)
+			goto out;
+
+		index[i]	= htole64(offset);
+		offset		+= clen;
+	}
+	index[nr_chunks]	= htole64(offset);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, COMPRESSED_IMAGE_MAGIC, sizeof(COMPRESSED_IMAGE_MAGIC));
+	header.version		= htole32(COMPRESSED_IMAGE_VERSION);
+	header.codec		= htole32(codec);
+	header.chunk_shift	= htole32(chunk_shift);
+	header.size		= htole64(size);
+	header.nr_chunks	= htole64(nr_chunks);
+	header.index_offset	= htole64(sizeof(header));
+
+	if (pwrite(dst_fd, index, index_size, sizeof(header)) != (ssize_t)index_size)
+		goto out;
+
+	if (pwrite(dst_fd, &header, sizeof(header), 0) != sizeof(header))
+		goto out;
+
+	ret	= 0;
+out:
+	free(dst);
+	free(src);
+	free(index);
+
+	return ret;
+}
@@ -0,0 +1,623 @@
+#include "kvm/console-virtio.h"
+
+#include "kvm/virtio-pci-dev.h"
+#include "kvm/virtio_console.h"
+#include "kvm/virtio_pci.h"
+#include "kvm/event-loop.h"
+#include "kvm/virtio.h"
+#include "kvm/console.h"
+#include "kvm/ioport.h"
+#include "kvm/util.h"
+#include "kvm/kvm.h"
+#include "kvm/pci.h"
+
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#define VIRTIO_CONSOLE_QUEUE_SIZE	64
+#define VIRTIO_CONSOLE_IRQ		12
+
+#define VIRTIO_CONSOLE_MAX_PORTS	8
+
+/* Port 0 queues, control queues, then two per additional port */
+#define VIRTIO_CONSOLE_MAX_QUEUES	(2 * VIRTIO_CONSOLE_MAX_PORTS + 2)
+#define VIRTIO_CONSOLE_CTRL_RX		2
+#define VIRTIO_CONSOLE_CTRL_TX		3
+
+/* Transmit buffers are collected into one writev() of at most this many segments */
+#define VIRTIO_CONSOLE_MAX_IOV		256
+
+/* Control messages the device may have queued: a few per port */
+#define VIRTIO_CONSOLE_MAX_CTRL		(4 * VIRTIO_CONSOLE_MAX_PORTS)
+
+struct console_port {
+	unsigned int			id;
+	const char			*name;
+
+	/* -1 if the backend has no input or output */
+	int				in_fd;
+	int				out_fd;
+	/* Output goes through the console ring, in order with the 8250's */
+	bool				stdio;
+
+	struct virt_queue		*rxq;
+	struct virt_queue		*txq;
+
+	/* Guest input comes from the event loop, one buffer per event */
+	pthread_mutex_t			mutex;
+	struct event_handler		input;
+	bool				input_open;
+	bool				input_armed;
+};
+
+struct console_ctrl_msg {
+	struct virtio_console_control	ctrl;
+	const char			*name;
+};
+
+struct console_device {
+	struct kvm			*kvm;
+
+	struct virtio_console_config	console_config;
+	uint32_t			host_features;
+	uint32_t			guest_features;
+	uint8_t				status;
+
+	struct virt_queue		queues[VIRTIO_CONSOLE_MAX_QUEUES];
+	uint16_t			queue_selector;
+	unsigned int			nr_queues;
+
+	struct console_port		ports[VIRTIO_CONSOLE_MAX_PORTS];
+	unsigned int			nr_ports;
+
+	struct pci_device_header	pci_header;
+
+	/*
+	 * Transmit and control queues are only ever touched by this thread,
+	 * the receive queues only by the event loop.
+	 */
+	pthread_t			io_thread;
+	int				io_efd;
+
+	struct console_ctrl_msg		ctrl_pending[VIRTIO_CONSOLE_MAX_CTRL];
+	unsigned int			nr_ctrl_pending;
+
+	struct iovec			iov[VIRTIO_CONSOLE_MAX_IOV];
+	uint16_t			heads[VIRTIO_CONSOLE_MAX_IOV];
+};
+
+static struct console_device console_device;
+
+/*
+ * Port 0 is the console. With more than one port the device offers
+ * VIRTIO_CONSOLE_F_MULTIPORT and names the others for /dev/virtio-ports.
+ */
+void console_virtio__add_port(const char *spec)
+{
+	struct console_port *port;
+	const char *backend;
+	char *name;
+
+	if (console_device.nr_ports == VIRTIO_CONSOLE_MAX_PORTS)
+		die("too many virtio-console ports (max %d)", VIRTIO_CONSOLE_MAX_PORTS);
+
+	port		= &console_device.ports[console_device.nr_ports];
+
+	name		= NULL;
+	backend		= strchr(spec, ':');
+	if (backend) {
+		name		= strndup(spec, backend - spec);
+		if (!name)
+			die("out of memory");
+		backend++;
+	} else
+		backend		= spec;
+
+	if (console_device.nr_ports && !name)
+		die("virtio-console port %u needs a name: <name>:<backend>", console_device.nr_ports);
+
+	if (!strcmp(backend, "stdio")) {
+		/* Claimed before the 8250 is set up, so the input comes here */
+		port->in_fd	= console__claim_stdin() ? STDIN_FILENO : -1;
+		port->out_fd	= STDOUT_FILENO;
+		port->stdio	= true;
+	} else {
+		port->in_fd	= -1;
+		port->out_fd	= open(backend, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (port->out_fd < 0)
+			die("unable to open %s", backend);
+	}
+
+	port->id	= console_device.nr_ports++;
+	port->name	= name;
+}
+
+static struct console_port *console_virtio__ctrl_port(uint32_t id)
+{
+	if (id >= console_device.nr_ports)
+		return NULL;
+
+	return &console_device.ports[id];
+}
+
+static void console_virtio__signal(struct kvm *self)
+{
+	kvm__irq_line(self, VIRTIO_CONSOLE_IRQ, 1);
+}
+
+/*
+ * Transmit
+ */
+static void writev_all(int fd, struct iovec *iov, int nr)
+{
+	ssize_t n;
+
+	while (nr) {
+		n	= writev(fd, iov, nr);
+		if (n < 0 && errno == EINTR)
+			continue;
+		/* Nowhere to put it, drop it rather than stall the guest */
+		if (n <= 0)
+			return;
+
+		while (nr && (size_t) n >= iov->iov_len) {
+			n	-= iov->iov_len;
+			iov++;
+			nr--;
+		}
+
+		if (nr) {
+			iov->iov_base	+= n;
+			iov->iov_len	-= n;
+		}
+	}
+}
+
+/* Writes out every pending buffer of @port with as few writev() calls as possible */
+static int console_port__transmit(struct kvm *self, struct console_port *port)
+{
+	struct console_device *cdev = &console_device;
+	int nr_iov = 0, nr_heads = 0, total = 0;
+	int head, n;
+
+	for (;;) {
+		head	= virt_queue__pop(port->txq);
+		if (head >= 0) {
+			n	= virt_queue__chain(self, port->txq, head, false,
+						&cdev->iov[nr_iov], VIRTIO_CONSOLE_MAX_IOV - nr_iov);
+
+			/* Doesn't fit behind what's batched so far, write that out first */
+			if (n < 0 && nr_iov) {
+				port->txq->last_avail_idx--;
+				head	= -1;
+			} else if (n < 0) {
+				warning("virtio-console: malformed transmit buffer");
+				n	= 0;
+			}
+		}
+
+		if (head < 0) {
+			if (!nr_heads)
+				break;
+
+			if (port->stdio) {
+				for (n = 0; n < nr_iov; n++)
+					console__write(cdev->iov[n].iov_base, cdev->iov[n].iov_len);
+			} else if (port->out_fd >= 0)
+				writev_all(port->out_fd, cdev->iov, nr_iov);
+
+			for (n = 0; n < nr_heads; n++)
+				virt_queue__push(port->txq, cdev->heads[n], 0);
+
+			total	+= nr_heads;
+			nr_iov	= nr_heads	= 0;
+			continue;
+		}
+
+		cdev->heads[nr_heads++]	= head;
+		nr_iov			+= n;
+	}
+
+	return total;
+}
+
+/*
+ * Control queues
+ */
+static void console_virtio__queue_ctrl(uint32_t id, uint16_t event, uint16_t value, const char *name)
+{
+	struct console_device *cdev = &console_device;
+
+	if (cdev->nr_ctrl_pending == VIRTIO_CONSOLE_MAX_CTRL) {
+		warning("virtio-console: control queue overflow");
+		return;
+	}
+
+	cdev->ctrl_pending[cdev->nr_ctrl_pending++]	= (struct console_ctrl_msg) {
+		.ctrl		= {
+			.id		= id,
+			.event		= event,
+			.value		= value,
+		},
+		.name		= name,
+	};
+}
+
+/* Delivers queued control messages for as long as the guest has buffers for them */
+static int console_virtio__flush_ctrl(struct kvm *self)
+{
+	struct console_device *cdev = &console_device;
+	struct virt_queue *queue = &cdev->queues[VIRTIO_CONSOLE_CTRL_RX];
+	struct iovec iov[VIRTIO_CONSOLE_QUEUE_SIZE];
+	struct console_ctrl_msg *msg;
+	unsigned int i, done = 0;
+	size_t name_len;
+	int head, n;
+
+	while (done < cdev->nr_ctrl_pending) {
+		head	= virt_queue__pop(queue);
+		if (head < 0)
+			break;
+
+		msg	= &cdev->ctrl_pending[done++];
+		n	= virt_queue__chain(self, queue, head, true, iov, VIRTIO_CONSOLE_QUEUE_SIZE);
+
+		/* Linux posts single buffers, large enough for any name */
+		name_len	= msg->name ? strlen(msg->name) : 0;
+		if (n < 1 || iov[0].iov_len < sizeof(msg->ctrl) + name_len) {
+			warning("virtio-console: control buffer too small");
+			virt_queue__push(queue, head, 0);
+			continue;
+		}
+
+		memcpy(iov[0].iov_base, &msg->ctrl, sizeof(msg->ctrl));
+		if (name_len)
+			memcpy(iov[0].iov_base + sizeof(msg->ctrl), msg->name, name_len);
+
+		virt_queue__push(queue, head, sizeof(msg->ctrl) + name_len);
+	}
+
+	for (i = done; i < cdev->nr_ctrl_pending; i++)
+		cdev->ctrl_pending[i - done]	= cdev->ctrl_pending[i];
+	cdev->nr_ctrl_pending	-= done;
+
+	return done;
+}
+
+static void console_virtio__handle_ctrl(struct virtio_console_control *ctrl)
+{
+	struct console_device *cdev = &console_device;
+	struct console_port *port;
+	unsigned int i;
+
+	switch (ctrl->event) {
+	case VIRTIO_CONSOLE_DEVICE_READY:
+		if (!ctrl->value)
+			break;
+
+		for (i = 0; i < cdev->nr_ports; i++)
+			console_virtio__queue_ctrl(i, VIRTIO_CONSOLE_PORT_ADD, 0, NULL);
+		break;
+	case VIRTIO_CONSOLE_PORT_READY:
+		port	= console_virtio__ctrl_port(ctrl->id);
+		if (!port || !ctrl->value)
+			break;
+
+		if (port->id == 0)
+			console_virtio__queue_ctrl(port->id, VIRTIO_CONSOLE_CONSOLE_PORT, 1, NULL);
+		else
+			console_virtio__queue_ctrl(port->id, VIRTIO_CONSOLE_PORT_NAME, 0, port->name);
+
+		/* The host end of every port is always connected */
+		console_virtio__queue_ctrl(port->id, VIRTIO_CONSOLE_PORT_OPEN, 1, NULL);
+		break;
+	default:
+		/* The guest opening and closing ports doesn't matter to us */
+		break;
+	}
+}
+
+static int console_virtio__ctrl_queue(struct kvm *self)
+{
+	struct virt_queue *queue = &console_device.queues[VIRTIO_CONSOLE_CTRL_TX];
+	struct virtio_console_control ctrl;
+	struct iovec iov[VIRTIO_CONSOLE_QUEUE_SIZE];
+	int head, n, nr = 0;
+
+	while ((head = virt_queue__pop(queue)) >= 0) {
+		n	= virt_queue__chain(self, queue, head, false, iov, VIRTIO_CONSOLE_QUEUE_SIZE);
+		if (n >= 1 && iov[0].iov_len >= sizeof(ctrl)) {
+			memcpy(&ctrl, iov[0].iov_base, sizeof(ctrl));
+			console_virtio__handle_ctrl(&ctrl);
+		} else
+			warning("virtio-console: malformed control message");
+
+		virt_queue__push(queue, head, 0);
+		nr++;
+	}
+
+	return nr + console_virtio__flush_ctrl(self);
+}
+
+static void *console_virtio__io_thread(void *arg)
+{
+	struct console_device *cdev = &console_device;
+	struct kvm *self = arg;
+	eventfd_t kicks;
+	unsigned int i;
+	int nr;
+
+	prctl(PR_SET_NAME, "kvm-vcon");
+
+	for (;;) {
+		if (eventfd_read(cdev->io_efd, &kicks) < 0) {
+			if (errno == EINTR)
+				continue;
+			die_perror("eventfd_read");
+		}
+
+		nr	= 0;
+
+		if (cdev->guest_features & (1 << VIRTIO_CONSOLE_F_MULTIPORT))
+			nr	+= console_virtio__ctrl_queue(self);
+
+		for (i = 0; i < cdev->nr_ports; i++)
+			nr	+= console_port__transmit(self, &cdev->ports[i]);
+
+		if (nr)
+			console_virtio__signal(self);
+	}
+
+	return NULL;
+}
+
+/*
+ * Receive
+ */
+
+/* Called with ->mutex held */
+static void console_port__rearm_input(struct console_port *port)
+{
+	if (!port->input_open || port->input_armed)
+		return;
+
+	event_loop__modify(&port->input, EPOLLIN | EPOLLONESHOT);
+	port->input_armed	= true;
+}
+
+/*
+ * Fills one receive buffer per event. The fd stays disarmed while the guest
+ * has no buffers posted, until it kicks the receive queue.
+ */
+static void console_port__input(struct event_handler *handler, uint32_t events)
+{
+	struct console_port *port = handler->ptr;
+	struct iovec iov[VIRTIO_CONSOLE_QUEUE_SIZE];
+	struct kvm *self = console_device.kvm;
+	ssize_t len;
+	int head, n;
+
+	pthread_mutex_lock(&port->mutex);
+
+	port->input_armed	= false;
+
+	head	= virt_queue__pop(port->rxq);
+	if (head < 0)
+		goto out_unlock;
+
+	n	= virt_queue__chain(self, port->rxq, head, true, iov, VIRTIO_CONSOLE_QUEUE_SIZE);
+	if (n < 0) {
+		warning("virtio-console: malformed receive buffer");
+		n	= 0;
+	}
+
+	len	= readv(handler->fd, iov, n);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+		/* Nothing after all, keep the buffer for next time */
+		port->rxq->last_avail_idx--;
+	} else if (len <= 0 && n) {
+		/* EOF or hangup, the guest gets no more input */
+		event_loop__del(handler);
+		port->input_open	= false;
+		port->rxq->last_avail_idx--;
+		goto out_unlock;
+	} else {
+		virt_queue__push(port->rxq, head, len > 0 ? len : 0);
+		console_virtio__signal(self);
+	}
+
+	console_port__rearm_input(port);
+
+out_unlock:
+	pthread_mutex_unlock(&port->mutex);
+}
+
+static void console_port__rx_kick(struct console_port *port)
+{
+	pthread_mutex_lock(&port->mutex);
+	console_port__rearm_input(port);
+	pthread_mutex_unlock(&port->mutex);
+}
+
+/*
+ * PCI
+ */
+static void console_virtio__queue_init(struct kvm *self, uint16_t index, uint32_t pfn)
+{
+	struct virt_queue *queue = &console_device.queues[index];
+	struct console_port *port;
+
+	virt_queue__init(self, queue, pfn, VIRTIO_CONSOLE_QUEUE_SIZE);
+
+	/* A receive queue that comes up may have buffers for pending input */
+	if (index == 0) {
+		console_port__rx_kick(&console_device.ports[0]);
+	} else if (index >= 4 && index % 2 == 0) {
+		port	= &console_device.ports[(index - 2) / 2];
+		console_port__rx_kick(port);
+	}
+}
+
+static bool console_virtio_in(struct kvm *self, uint16_t port, void *data, int size, uint32_t count)
+{
+	unsigned long offset = port - IOPORT_VIRTIO_CONSOLE;
+
+	switch (offset) {
+	case VIRTIO_PCI_HOST_FEATURES:
+		ioport__write32(data, console_device.host_features);
+		break;
+	case VIRTIO_PCI_GUEST_FEATURES:
+		return false;
+	case VIRTIO_PCI_QUEUE_PFN:
+		if (console_device.queue_selector >= console_device.nr_queues)
+			return false;
+		ioport__write32(data, console_device.queues[console_device.queue_selector].pfn);
+		break;
+	case VIRTIO_PCI_QUEUE_NUM:
+		/* Zero tells the guest that a queue doesn't exist */
+		if (console_device.queue_selector >= console_device.nr_queues)
+			ioport__write16(data, 0);
+		else
+			ioport__write16(data, VIRTIO_CONSOLE_QUEUE_SIZE);
+		break;
+	case VIRTIO_PCI_QUEUE_SEL:
+	case VIRTIO_PCI_QUEUE_NOTIFY:
+		return false;
+	case VIRTIO_PCI_STATUS:
+		ioport__write8(data, console_device.status);
+		break;
+	case VIRTIO_PCI_ISR:
+		virtio_pci__isr_in(self, data, VIRTIO_CONSOLE_IRQ);
+		break;
+	default:
+		return virtio_pci__config_in(data, offset, size, count, &console_device.console_config,
+					     sizeof(console_device.console_config));
+	};
+
+	return true;
+}
+
+static bool console_virtio_out(struct kvm *self, uint16_t port, void *data, int size, uint32_t count)
+{
+	unsigned long offset = port - IOPORT_VIRTIO_CONSOLE;
+	uint16_t index;
+
+	switch (offset) {
+	case VIRTIO_PCI_GUEST_FEATURES:
+		console_device.guest_features	= ioport__read32(data);
+		break;
+	case VIRTIO_PCI_QUEUE_PFN:
+		if (console_device.queue_selector >= console_device.nr_queues)
+			return false;
+
+		console_virtio__queue_init(self, console_device.queue_selector, ioport__read32(data));
+		break;
+	case VIRTIO_PCI_QUEUE_SEL:
+		console_device.queue_selector	= ioport__read16(data);
+		break;
+	case VIRTIO_PCI_QUEUE_NOTIFY:
+		index		= ioport__read16(data);
+		if (index >= console_device.nr_queues)
+			return false;
+
+		/* Receive queues: port 0 is queue 0, port n is queue 2n + 2 */
+		if (index == 0)
+			console_port__rx_kick(&console_device.ports[0]);
+		else if (index >= 4 && index % 2 == 0)
+			console_port__rx_kick(&console_device.ports[(index - 2) / 2]);
+		else if (eventfd_write(console_device.io_efd, 1) < 0)
+			die_perror("eventfd_write");
+		break;
+	case VIRTIO_PCI_STATUS:
+		console_device.status		= ioport__read8(data);
+		break;
+	default:
+		return false;
+	};
+
+	return true;
+}
+
+static struct ioport_operations console_virtio_io_ops = {
+	.io_in		= console_virtio_in,
+	.io_out		= console_virtio_out,
+};
+
+static struct pci_device_header console_virtio_pci_template = {
+	.vendor_id		= PCI_VENDOR_ID_REDHAT_QUMRANET,
+	.device_id		= PCI_DEVICE_ID_VIRTIO_CONSOLE,
+	.header_type		= PCI_HEADER_TYPE_NORMAL,
+	.revision_id		= 0,
+	.class			= 0x078000,
+	.subsys_vendor_id	= PCI_SUBSYSTEM_VENDOR_ID_REDHAT_QUMRANET,
+	.subsys_id		= PCI_SUBSYSTEM_ID_VIRTIO_CONSOLE,
+	.bar[0]			= IOPORT_VIRTIO_CONSOLE | PCI_BASE_ADDRESS_SPACE_IO,
+	.irq_pin		= 1,
+	.irq_line		= VIRTIO_CONSOLE_IRQ,
+};
+
+static void console_port__init(struct console_port *port)
+{
+	struct console_device *cdev = &console_device;
+
+	port->rxq	= &cdev->queues[port->id ? 2 * port->id + 2 : 0];
+	port->txq	= &cdev->queues[port->id ? 2 * port->id + 3 : 1];
+
+	pthread_mutex_init(&port->mutex, NULL);
+
+	if (port->in_fd < 0)
+		return;
+
+	port->input.fd		= port->in_fd;
+	port->input.callback	= console_port__input;
+	port->input.ptr		= port;
+
+	/* Armed once the guest posts receive buffers */
+	port->input_open	= event_loop__add(&port->input, EPOLLONESHOT);
+	if (!port->input_open)
+		warning("virtio-console: input of port %u can't be polled", port->id);
+}
+
+void console_virtio__init(struct kvm *self)
+{
+	struct console_device *cdev = &console_device;
+	unsigned int i;
+
+	if (!cdev->nr_ports)
+		return;
+
+	cdev->kvm		= self;
+	cdev->pci_header	= console_virtio_pci_template;
+	cdev->console_config	= (struct virtio_console_config) {
+		.max_nr_ports		= cdev->nr_ports,
+	};
+
+	if (cdev->nr_ports > 1) {
+		cdev->host_features	= 1 << VIRTIO_CONSOLE_F_MULTIPORT;
+		cdev->nr_queues		= 2 * cdev->nr_ports + 2;
+	} else
+		cdev->nr_queues		= 2;
+
+	for (i = 0; i < cdev->nr_ports; i++)
+		console_port__init(&cdev->ports[i]);
+
+	cdev->io_efd	= eventfd(0, 0);
+	if (cdev->io_efd < 0)
+		die_perror("eventfd");
+
+	if (pthread_create(&cdev->io_thread, NULL, console_virtio__io_thread, self) != 0)
+		die("unable to create virtio-console I/O thread");
+
+	pci__register(&cdev->pci_header, VIRTIO_CONSOLE_PCI_SLOT);
+
+	ioport__register(IOPORT_VIRTIO_CONSOLE, &console_virtio_io_ops, IOPORT_VIRTIO_CONSOLE_SIZE);
+}
@@ -0,0 +1,246 @@
+#include "kvm/console.h"
+
+#include "kvm/util.h"
+
+#include <sys/prctl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#define CONSOLE_RING_SIZE	(64 << 10)
+#define CONSOLE_FLUSH_SIZE	(4 << 10)
+#define CONSOLE_FLUSH_DELAY_MS	10
+
+struct console {
+	int			fd;
+
+	pthread_mutex_t		mutex;
+	/* Wakes the writer thread */
+	pthread_cond_t		data;
+	/* Wakes whoever waits for room or for a write to finish */
+	pthread_cond_t		space;
+
+	char			ring[CONSOLE_RING_SIZE];
+	/* Free running, the writer thread owns tail */
+	uint64_t		head;
+	uint64_t		tail;
+	bool			writing;
+
+	/* Write out without waiting for the deadline */
+	bool			flush;
+	struct timespec		deadline;
+};
+
+static struct console		console = {
+	.fd		= STDOUT_FILENO,
+	.mutex		= PTHREAD_MUTEX_INITIALIZER,
+	.space		= PTHREAD_COND_INITIALIZER,
+};
+
+static bool console_started;
+static bool stdin_claimed;
+
+static void console__write_fd(const char *buf, size_t len)
+{
+	ssize_t nr;
+
+	while (len) {
+		nr	= write(console.fd, buf, len);
+		if (nr < 0 && errno == EINTR)
+			continue;
+		/* Nowhere to put it, drop it rather than stall the guest */
+		if (nr <= 0)
+			return;
+
+		buf	+= nr;
+		len	-= nr;
+	}
+}
+
+static bool console__expired(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (now.tv_sec != console.deadline.tv_sec)
+		return now.tv_sec > console.deadline.tv_sec;
+
+	return now.tv_nsec >= console.deadline.tv_nsec;
+}
+
+/* Called with ->mutex held, writes out one contiguous part of the ring */
+static void console__drain(void)
+{
+	uint64_t off = console.tail % CONSOLE_RING_SIZE;
+	uint64_t len = MIN(console.head - console.tail, CONSOLE_RING_SIZE - off);
+
+	console.writing	= true;
+	pthread_mutex_unlock(&console.mutex);
+
+	console__write_fd(&console.ring[off], len);
+
+	pthread_mutex_lock(&console.mutex);
+	console.writing	= false;
+
+	console.tail	+= len;
+	if (console.tail == console.head)
+		console.flush	= false;
+
+	pthread_cond_broadcast(&console.space);
+}
+
+static void *console__thread(void *arg)
+{
+	prctl(PR_SET_NAME, "kvm-console");
+
+	pthread_mutex_lock(&console.mutex);
+
+	for (;;) {
+		/* console__flush() got there first */
+		if (console.writing) {
+			pthread_cond_wait(&console.space, &console.mutex);
+			continue;
+		}
+
+		if (console.head == console.tail) {
+			pthread_cond_wait(&console.data, &console.mutex);
+			continue;
+		}
+
+		if (!console.flush && !console__expired()) {
+			pthread_cond_timedwait(&console.data, &console.mutex, &console.deadline);
+			continue;
+		}
+
+		console__drain();
+	}
+
+	return NULL;
+}
+
+static void console__exit(void)
+{
+	console__flush();
+
+	if (console.fd != STDOUT_FILENO)
+		close(console.fd);
+}
+
+/* Without a log file the output goes to stdout */
+void console__init(const char *log_path)
+{
+	pthread_condattr_t attr;
+	pthread_t thread;
+
+	if (log_path) {
+		console.fd	= open(log_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (console.fd < 0)
+			die("Unable to open console log %s", log_path);
+	}
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&console.data, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (pthread_create(&thread, NULL, console__thread, NULL) != 0)
+		die("unable to create console thread");
+
+	console_started	= true;
+
+	atexit(console__exit);
+}
+
+static void console__set_deadline(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &console.deadline);
+
+	console.deadline.tv_nsec	+= CONSOLE_FLUSH_DELAY_MS * 1000000;
+	if (console.deadline.tv_nsec >= 1000000000) {
+		console.deadline.tv_sec++;
+		console.deadline.tv_nsec	-= 1000000000;
+	}
+}
+
+/*
+ * Only waits if the ring is full, which means the writer can't keep up and
+ * the guest is slowed down to its pace instead of losing output.
+ */
+void console__write(const char *buf, size_t len)
+{
+	uint64_t off, room;
+	size_t nr;
+
+	if (!console_started) {
+		console__write_fd(buf, len);
+		return;
+	}
+
+	pthread_mutex_lock(&console.mutex);
+
+	while (len) {
+		room	= CONSOLE_RING_SIZE - (console.head - console.tail);
+		if (!room) {
+			console.flush	= true;
+			pthread_cond_signal(&console.data);
+			pthread_cond_wait(&console.space, &console.mutex);
+			continue;
+		}
+
+		off	= console.head % CONSOLE_RING_SIZE;
+		nr	= MIN(len, MIN(room, CONSOLE_RING_SIZE - off));
+
+		/* The writer sleeps until it's told there is something to do */
+		if (console.head == console.tail) {
+			console__set_deadline();
+			pthread_cond_signal(&console.data);
+		}
+
+		memcpy(&console.ring[off], buf, nr);
+		console.head	+= nr;
+
+		if (!console.flush && (memchr(buf, '\n', nr) ||
+				console.head - console.tail >= CONSOLE_FLUSH_SIZE)) {
+			console.flush	= true;
+			pthread_cond_signal(&console.data);
+		}
+
+		buf	+= nr;
+		len	-= nr;
+	}
+
+	pthread_mutex_unlock(&console.mutex);
+}
+
+/*
+ * Only one device reads stdin, the first to ask. Devices call this while
+ * the command line is parsed or during init, from the main thread.
+ */
+bool console__claim_stdin(void)
+{
+	if (stdin_claimed)
+		return false;
+
+	stdin_claimed	= true;
+
+	return true;
+}
+
+/* Writes out everything buffered so far before returning */
+void console__flush(void)
+{
+	pthread_mutex_lock(&console.mutex);
+
+	while (console.writing || console.head != console.tail) {
+		if (console.writing)
+			pthread_cond_wait(&console.space, &console.mutex);
+		else
+			console__drain();
+	}
+
+	pthread_mutex_unlock(&console.mutex);
+}
@@ -0,0 +1,153 @@
+#include "kvm/control.h"
+
+#include "kvm/util.h"
+#include "kvm/kvm.h"
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdio.h>
+
+#define CONTROL_MAX_COMMANDS	32
+#define CONTROL_MAX_ARGS	16
+#define CONTROL_LINE_SIZE	256
+
+static struct control_command	*control_commands[CONTROL_MAX_COMMANDS];
+static int			nr_control_commands;
+
+static struct kvm		*control_kvm;
+static int			control_fd;
+static char			control_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+
+void control__register(struct control_command *cmd)
+{
+	if (nr_control_commands == CONTROL_MAX_COMMANDS)
+		die("too many control commands");
+
+	control_commands[nr_control_commands++]	= cmd;
+}
+
+static void control_help(int fd)
+{
+	int i;
+
+	for (i = 0; i < nr_control_commands; i++)
+		dprintf(fd, "%s %s\n", control_commands[i]->name, control_commands[i]->usage);
+}
+
+static void control_execute(char *line, int fd)
+{
+	char *argv[CONTROL_MAX_ARGS];
+	char *saveptr;
+	int argc = 0;
+	int i;
+
+	for (argv[argc] = strtok_r(line, " \t\n", &saveptr); argv[argc]; argv[argc] = strtok_r(NULL, " \t\n", &saveptr)) {
+		if (++argc == CONTROL_MAX_ARGS) {
+			dprintf(fd, "error: too many arguments\n");
+			return;
+		}
+	}
+
+	if (!argc)
+		return;
+
+	if (!strcmp(argv[0], "help")) {
+		control_help(fd);
+		return;
+	}
+
+	for (i = 0; i < nr_control_commands; i++) {
+		if (!strcmp(argv[0], control_commands[i]->name)) {
+			if (!control_commands[i]->handler(control_kvm, argc, argv, fd))
+				dprintf(fd, "usage: %s %s\n", argv[0], control_commands[i]->usage);
+			return;
+		}
+	}
+
+	dprintf(fd, "error: unknown command '%s'\n", argv[0]);
+}
+
+static void *control_thread(void *arg)
+{
+	char line[CONTROL_LINE_SIZE];
+
+	for (;;) {
+		FILE *client;
+		int fd;
+
+		fd		= accept(control_fd, NULL, NULL);
+		if (fd < 0) {
+			/* Out of descriptors or memory: don't spin until some are freed */
+			if (errno != EINTR && errno != ECONNABORTED)
+				sleep(1);
+			continue;
+		}
+
+		client		= fdopen(fd, "r");
+		if (!client) {
+			close(fd);
+			continue;
+		}
+
+		while (fgets(line, sizeof(line), client))
+			control_execute(line, fd);
+
+		fclose(client);
+	}
+
+	return NULL;
+}
+
+static void control_cleanup(void)
+{
+	unlink(control_path);
+}
+
+bool control__init(struct kvm *self, const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX, };
+	pthread_t thread;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return false;
+
+	strcpy(addr.sun_path, path);
+	strcpy(control_path, path);
+
+	control_fd	= socket(AF_UNIX, SOCK_STREAM, 0);
+	if (control_fd < 0)
+		return false;
+
+	unlink(path);
+
+	if (bind(control_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+		goto failed_close;
+
+	if (listen(control_fd, 1) < 0)
+		goto failed_close;
+
+	control_kvm	= self;
+
+	/* A client that goes away before reading its reply must not kill the VM */
+	signal(SIGPIPE, SIG_IGN);
+
+	if (pthread_create(&thread, NULL, control_thread, NULL) != 0)
+		goto failed_close;
+
+	atexit(control_cleanup);
+
+	return true;
+
+failed_close:
+	close(control_fd);
+
+	return false;
+}
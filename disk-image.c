@@ -1,8 +1,16 @@
+#define _GNU_SOURCE
+
 #include "kvm/disk-image.h"
 
+#include "kvm/boot-trace.h"
+#include "kvm/compressed-image.h"
+#include "kvm/shared-cache.h"
 #include "kvm/util.h"
 
 #include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/uio.h>
 #include <inttypes.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -18,52 +26,452 @@ struct qcow_header {
 	uint8_t			magic[5];
 };
 
-static bool disk_image__is_qcow(struct disk_image *self)
+static bool disk_image__is_qcow(int fd)
+{
+	struct qcow_header header;
+
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header))
+		return false;
+
+	return !memcmp(header.magic, QCOW_MAGIC, ARRAY_SIZE(QCOW_MAGIC));
+}
+
+static ssize_t iov_size(const struct iovec *iov, int iovcount)
+{
+	ssize_t size = 0;
+	int i;
+
+	for (i = 0; i < iovcount; i++)
+		size	+= iov[i].iov_len;
+
+	return size;
+}
+
+/*
+ * Raw images are mapped privately: guest writes end up in anonymous COW
+ * pages and never reach the image file.
+ */
+static int raw_image__read_sector_iov(struct disk_image *self, uint64_t sector, const struct iovec *iov, int iovcount)
+{
+	uint64_t offset = sector << SECTOR_SHIFT;
+	int i;
+
+	if (offset + iov_size(iov, iovcount) > self->size)
+		return -1;
+
+	for (i = 0; i < iovcount; i++) {
+		memcpy(iov[i].iov_base, self->priv + offset, iov[i].iov_len);
+		offset	+= iov[i].iov_len;
+	}
+
+	return 0;
+}
+
+static int raw_image__write_sector_iov(struct disk_image *self, uint64_t sector, const struct iovec *iov, int iovcount)
+{
+	uint64_t offset = sector << SECTOR_SHIFT;
+	int i;
+
+	if (offset + iov_size(iov, iovcount) > self->size)
+		return -1;
+
+	for (i = 0; i < iovcount; i++) {
+		memcpy(self->priv + offset, iov[i].iov_base, iov[i].iov_len);
+		offset	+= iov[i].iov_len;
+	}
+
+	return 0;
+}
+
+static void raw_image__prefetch(struct disk_image *self, uint64_t sector, uint64_t nr_sectors)
+{
+	uint64_t offset = sector << SECTOR_SHIFT;
+	uint64_t start = offset & ~(uint64_t)(getpagesize() - 1);
+	uint64_t len = MIN(offset + (nr_sectors << SECTOR_SHIFT), self->size) - start;
+
+	/* Fault the pages in so that guest reads don't even take a page fault */
+	if (!madvise(self->priv + start, len, MADV_POPULATE_READ))
+		return;
+
+	madvise(self->priv + start, len, MADV_WILLNEED);
+}
+
+static void raw_image__close(struct disk_image *self)
+{
+	if (munmap(self->priv, self->size) < 0)
+		warning("munmap() failed");
+}
+
+static struct disk_image_operations raw_image_ops = {
+	.read_sector_iov	= raw_image__read_sector_iov,
+	.write_sector_iov	= raw_image__write_sector_iov,
+	.prefetch		= raw_image__prefetch,
+	.close			= raw_image__close,
+};
+
+static struct disk_image *raw_image__probe(int fd, uint64_t size)
+{
+	struct disk_image *self;
+
+	self		= disk_image__new(fd, size, &raw_image_ops);
+	if (!self)
+		return NULL;
+
+	self->priv	= mmap(NULL, self->size, PROT_READ|PROT_WRITE, MAP_PRIVATE, self->fd, 0);
+	if (self->priv == MAP_FAILED) {
+		free(self);
+		return NULL;
+	}
+
+	return self;
+}
+
+/*
+ * Direct images bypass the host page cache: guest buffers are handed to
+ * preadv()/pwritev() on an O_DIRECT descriptor, and writes go straight to
+ * the image. Only requests that don't meet the O_DIRECT alignment rules
+ * go through a bounce buffer.
+ */
+struct direct_image {
+	unsigned int		align;
+	/* At least a page, in case the probed alignment is too small */
+	unsigned int		bounce_align;
+	/* Without O_DIRECT, for the partial block at the end of the image */
+	int			cached_fd;
+	bool			read_only;
+};
+
+static bool direct_image__aligned(struct direct_image *self, uint64_t offset, const struct iovec *iov, int iovcount)
+{
+	uint64_t mask = self->align - 1;
+	int i;
+
+	if (offset & mask)
+		return false;
+
+	for (i = 0; i < iovcount; i++) {
+		if (((unsigned long) iov[i].iov_base | iov[i].iov_len) & mask)
+			return false;
+	}
+
+	return true;
+}
+
+static int direct_image__do_iov(int fd, uint64_t offset, const struct iovec *iov, int iovcount, bool write)
+{
+	struct iovec local[iovcount];
+	ssize_t n;
+	int i = 0;
+
+	memcpy(local, iov, sizeof(local));
+
+	while (i < iovcount) {
+		if (write)
+			n	= pwritev(fd, &local[i], iovcount - i, offset);
+		else
+			n	= preadv(fd, &local[i], iovcount - i, offset);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (!n)
+				errno	= EIO;
+			return -1;
+		}
+
+		offset	+= n;
+
+		/* Short transfer: skip what has been done and retry the rest */
+		while (i < iovcount && (size_t) n >= local[i].iov_len)
+			n	-= local[i++].iov_len;
+
+		if (i < iovcount) {
+			local[i].iov_base	+= n;
+			local[i].iov_len	-= n;
+		}
+	}
+
+	return 0;
+}
+
+static int direct_image__bounce(struct disk_image *self, uint64_t offset, const struct iovec *iov, int iovcount, bool write)
+{
+	struct direct_image *direct = self->priv;
+	uint64_t len = iov_size(iov, iovcount);
+	uint64_t start = offset & ~(uint64_t)(direct->bounce_align - 1);
+	uint64_t end = (offset + len + direct->bounce_align - 1) & ~(uint64_t)(direct->bounce_align - 1);
+	struct iovec bounce;
+	int fd = self->fd;
+	void *buf, *p;
+	int ret = -1;
+	int i;
+
+	/*
+	 * When the image size isn't a multiple of the alignment, O_DIRECT can
+	 * only reach its last block by going past the end of the image. Stop
+	 * the window at the end and go through the page cache instead: O_DIRECT
+	 * requests flush and invalidate cached pages in their range, so the
+	 * two views stay coherent.
+	 */
+	if (end > self->size) {
+		end	= self->size;
+		fd	= direct->cached_fd;
+	}
+
+	if (posix_memalign(&buf, direct->bounce_align, end - start))
+		return -1;
+
+	bounce	= (struct iovec) {
+		.iov_base	= buf,
+		.iov_len	= end - start,
+	};
+
+	/* Writes that don't cover whole blocks need the rest of the blocks */
+	if ((!write || start != offset || end != offset + len) &&
+	    direct_image__do_iov(fd, start, &bounce, 1, false) < 0)
+		goto out_free;
+
+	p	= buf + (offset - start);
+
+	for (i = 0; i < iovcount; i++) {
+		if (write)
+			memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		else
+			memcpy(iov[i].iov_base, p, iov[i].iov_len);
+		p	+= iov[i].iov_len;
+	}
+
+	if (write && direct_image__do_iov(fd, start, &bounce, 1, true) < 0)
+		goto out_free;
+
+	ret	= 0;
+
+out_free:
+	free(buf);
+
+	return ret;
+}
+
+static int direct_image__rw(struct disk_image *self, uint64_t sector, const struct iovec *iov, int iovcount, bool write)
+{
+	uint64_t offset = sector << SECTOR_SHIFT;
+	int ret;
+
+	if (offset + iov_size(iov, iovcount) > self->size)
+		return -1;
+
+	if (!direct_image__aligned(self->priv, offset, iov, iovcount))
+		return direct_image__bounce(self, offset, iov, iovcount, write);
+
+	ret	= direct_image__do_iov(self->fd, offset, iov, iovcount, write);
+
+	/* The filesystem wants more alignment than it told us about */
+	if (ret < 0 && errno == EINVAL)
+		ret	= direct_image__bounce(self, offset, iov, iovcount, write);
+
+	return ret;
+}
+
+static int direct_image__read_sector_iov(struct disk_image *self, uint64_t sector, const struct iovec *iov, int iovcount)
+{
+	return direct_image__rw(self, sector, iov, iovcount, false);
+}
+
+static int direct_image__write_sector_iov(struct disk_image *self, uint64_t sector, const struct iovec *iov, int iovcount)
+{
+	struct direct_image *direct = self->priv;
+
+	if (direct->read_only) {
+		errno	= EROFS;
+		return -1;
+	}
+
+	return direct_image__rw(self, sector, iov, iovcount, true);
+}
+
+static void direct_image__prefetch(struct disk_image *self, uint64_t sector, uint64_t nr_sectors)
+{
+	/* There is no host cache to warm up */
+}
+
+static void direct_image__close(struct disk_image *self)
+{
+	struct direct_image *direct = self->priv;
+
+	if (close(direct->cached_fd) < 0)
+		warning("close() failed");
+
+	free(direct);
+}
+
+static struct disk_image_operations direct_image_ops = {
+	.read_sector_iov	= direct_image__read_sector_iov,
+	.write_sector_iov	= direct_image__write_sector_iov,
+	.prefetch		= direct_image__prefetch,
+	.close			= direct_image__close,
+};
+
+static bool is_power_of_2(unsigned long n)
 {
-	struct qcow_header *header = self->mmap;
+	return n && !(n & (n - 1));
+}
+
+/*
+ * The O_DIRECT alignment: the logical block size of a block device, or what
+ * the filesystem reports for a regular file. Without STATX_DIOALIGN the
+ * preferred I/O size stands in, which is at least as strict in practice.
+ */
+static unsigned int direct_image__align(int fd, struct stat *st)
+{
+	int block_size;
+#ifdef STATX_DIOALIGN
+	struct statx stx;
+#endif
+
+	if (S_ISBLK(st->st_mode)) {
+		if (!ioctl(fd, BLKSSZGET, &block_size) && block_size > (int) SECTOR_SIZE)
+			return block_size;
 
-	return !memcmp(header->magic, QCOW_MAGIC, ARRAY_SIZE(QCOW_MAGIC));
+		return SECTOR_SIZE;
+	}
+
+#ifdef STATX_DIOALIGN
+	if (!statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) && (stx.stx_mask & STATX_DIOALIGN) &&
+	    is_power_of_2(stx.stx_dio_offset_align) && is_power_of_2(stx.stx_dio_mem_align)) {
+		if (stx.stx_dio_offset_align > stx.stx_dio_mem_align)
+			return stx.stx_dio_offset_align;
+
+		return stx.stx_dio_mem_align;
+	}
+#endif
+
+	if (st->st_blksize > (blksize_t) SECTOR_SIZE && is_power_of_2(st->st_blksize))
+		return st->st_blksize;
+
+	return SECTOR_SIZE;
 }
 
-struct disk_image *disk_image__open(const char *filename)
+static struct disk_image *direct_image__open(const char *filename)
 {
+	struct direct_image *direct;
 	struct disk_image *self;
+	bool read_only = false;
+	int fd, cached_fd;
+	long page_size;
 	struct stat st;
+	off_t size;
+
+	fd		= open(filename, O_RDWR | O_DIRECT);
+	if (fd < 0 && (errno == EACCES || errno == EPERM || errno == EROFS)) {
+		warning("%s: not writable, guest writes will fail", filename);
+		fd		= open(filename, O_RDONLY | O_DIRECT);
+		read_only	= true;
+	}
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0)
+		goto failed_close_fd;
+
+	size		= lseek(fd, 0, SEEK_END);
+	if (size < 0)
+		goto failed_close_fd;
+
+	cached_fd	= open(filename, read_only ? O_RDONLY : O_RDWR);
+	if (cached_fd < 0)
+		goto failed_close_fd;
+
+	direct		= malloc(sizeof *direct);
+	if (!direct)
+		goto failed_close_cached_fd;
+
+	page_size		= sysconf(_SC_PAGESIZE);
+
+	direct->cached_fd	= cached_fd;
+	direct->read_only	= read_only;
+	direct->align		= direct_image__align(fd, &st);
+	direct->bounce_align	= direct->align;
+	if (page_size > (long) direct->bounce_align)
+		direct->bounce_align	= page_size;
+
+	self		= disk_image__new(fd, size, &direct_image_ops);
+	if (!self) {
+		free(direct);
+		goto failed_close_cached_fd;
+	}
+
+	self->priv	= direct;
+
+	return self;
+
+failed_close_cached_fd:
+	close(cached_fd);
+failed_close_fd:
+	close(fd);
+
+	return NULL;
+}
+
+struct disk_image *disk_image__new(int fd, uint64_t size, struct disk_image_operations *ops)
+{
+	struct disk_image *self;
 
 	self		= malloc(sizeof *self);
 	if (!self)
 		return NULL;
 
-	self->fd	= open(filename, O_RDONLY);
-	if (self->fd < 0)
-		goto failed_free;
+	self->fd	= fd;
+	self->size	= size;
+	self->ops	= ops;
+	self->priv	= NULL;
+	self->trace	= NULL;
+	self->cache	= NULL;
 
-	if (fstat(self->fd, &st) < 0)
-		goto failed_close_fd;
+	return self;
+}
 
-	self->size	= st.st_size;
+struct disk_image *disk_image__open(const char *filename, bool direct)
+{
+	struct disk_image *self;
+	struct stat st;
+	int fd;
+
+	fd		= open(filename, O_RDONLY);
+	if (fd < 0)
+		return NULL;
 
-	self->mmap	= mmap(NULL, self->size, PROT_READ|PROT_WRITE, MAP_PRIVATE, self->fd, 0);
-	if (self->mmap == MAP_FAILED)
+	if (fstat(fd, &st) < 0)
 		goto failed_close_fd;
 
-	if (disk_image__is_qcow(self))
+	if (disk_image__is_qcow(fd))
 		die("QCOW disk image format is not supported.");
 
-	return self;
+	self		= compressed_image__probe(fd, st.st_size);
+	if (self) {
+		if (direct)
+			warning("%s: compressed images are always cached", filename);
+		return self;
+	}
+
+	if (direct) {
+		close(fd);
+		return direct_image__open(filename);
+	}
+
+	self		= raw_image__probe(fd, st.st_size);
+	if (self)
+		return self;
 
 failed_close_fd:
-	close(self->fd);
-failed_free:
-	free(self);
+	close(fd);
 
 	return NULL;
 }
 
 void disk_image__close(struct disk_image *self)
 {
-	if (munmap(self->mmap, self->size) < 0)
-		warning("munmap() failed");
+	if (self->ops->close)
+		self->ops->close(self);
 
 	if (close(self->fd) < 0)
 		warning("close() failed");
@@ -73,24 +481,33 @@ void disk_image__close(struct disk_image *self)
 
 int disk_image__read_sector(struct disk_image *self, uint64_t sector, void *dst, uint32_t dst_len)
 {
-	uint64_t offset = sector << SECTOR_SHIFT;
+	struct iovec iov = { .iov_base = dst, .iov_len = dst_len };
 
-	if (offset + dst_len > self->size)
-		return -1;
+	return disk_image__read_sector_iov(self, sector, &iov, 1);
+}
 
-	memcpy(dst, self->mmap + offset, dst_len);
+int disk_image__write_sector(struct disk_image *self, uint64_t sector, void *src, uint32_t src_len)
+{
+	struct iovec iov = { .iov_base = src, .iov_len = src_len };
 
-	return 0;
+	return disk_image__write_sector_iov(self, sector, &iov, 1);
 }
 
-int disk_image__write_sector(struct disk_image *self, uint64_t sector, void *src, uint32_t src_len)
+int disk_image__read_sector_iov(struct disk_image *self, uint64_t sector, const struct iovec *iov, int iovcount)
 {
-	uint64_t offset = sector << SECTOR_SHIFT;
+	if (self->trace)
+		boot_trace__record(self->trace, sector, (iov_size(iov, iovcount) + SECTOR_SIZE - 1) >> SECTOR_SHIFT);
 
-	if (offset + src_len > self->size)
-		return -1;
+	if (self->cache)
+		return shared_cache__read(self->cache, self, sector, iov, iovcount);
 
-	memcpy(self->mmap + offset, src, src_len);
+	return self->ops->read_sector_iov(self, sector, iov, iovcount);
+}
 
-	return 0;
+int disk_image__write_sector_iov(struct disk_image *self, uint64_t sector, const struct iovec *iov, int iovcount)
+{
+	if (self->cache)
+		shared_cache__written(self->cache, sector, iov_size(iov, iovcount));
+
+	return self->ops->write_sector_iov(self, sector, iov, iovcount);
 }
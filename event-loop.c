@@ -0,0 +1,128 @@
+#include "kvm/event-loop.h"
+
+#include "kvm/util.h"
+
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define EVENT_LOOP_MAX_EVENTS	16
+
+static pthread_once_t		event_loop_once = PTHREAD_ONCE_INIT;
+static int			epoll_fd;
+
+static void *event_loop__thread(void *arg)
+{
+	struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+	int nr, i;
+
+	prctl(PR_SET_NAME, "kvm-events");
+
+	for (;;) {
+		nr	= epoll_wait(epoll_fd, events, EVENT_LOOP_MAX_EVENTS, -1);
+		if (nr < 0) {
+			if (errno == EINTR)
+				continue;
+			die_perror("epoll_wait");
+		}
+
+		for (i = 0; i < nr; i++) {
+			struct event_handler *handler = events[i].data.ptr;
+
+			handler->callback(handler, events[i].events);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * The loop is started by the first device that needs it, so it doesn't
+ * matter in which order the devices are set up.
+ */
+static void event_loop__init(void)
+{
+	pthread_t thread;
+
+	epoll_fd	= epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0)
+		die_perror("epoll_create1");
+
+	if (pthread_create(&thread, NULL, event_loop__thread, NULL) != 0)
+		die("unable to create event loop thread");
+}
+
+/*
+ * Returns false if @handler's fd can't be watched, for example because it's
+ * a regular file.
+ */
+bool event_loop__add(struct event_handler *handler, uint32_t events)
+{
+	struct epoll_event ev = {
+		.events		= events,
+		.data.ptr	= handler,
+	};
+
+	pthread_once(&event_loop_once, event_loop__init);
+
+	return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, handler->fd, &ev) == 0;
+}
+
+/* Also rearms an EPOLLONESHOT handler */
+bool event_loop__modify(struct event_handler *handler, uint32_t events)
+{
+	struct epoll_event ev = {
+		.events		= events,
+		.data.ptr	= handler,
+	};
+
+	return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, handler->fd, &ev) == 0;
+}
+
+/*
+ * The callback may still run once more if its event was already picked up
+ * by the loop, unless it's the callback itself that removes the handler.
+ */
+void event_loop__del(struct event_handler *handler)
+{
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, handler->fd, NULL);
+}
+
+void event_loop__add_timer(struct event_handler *handler)
+{
+	handler->fd	= timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (handler->fd < 0)
+		die_perror("timerfd_create");
+
+	if (!event_loop__add(handler, EPOLLIN))
+		die_perror("epoll_ctl");
+}
+
+/* Arms the timer to expire @ns from now, or disarms it if @ns is zero */
+void event_loop__set_timer(struct event_handler *handler, uint64_t ns)
+{
+	struct itimerspec its = {
+		.it_value	= {
+			.tv_sec		= ns / 1000000000,
+			.tv_nsec	= ns % 1000000000,
+		},
+	};
+
+	if (timerfd_settime(handler->fd, 0, &its, NULL) < 0)
+		die_perror("timerfd_settime");
+}
+
+/*
+ * Acknowledges the expiry from a timer callback. Returns false if the timer
+ * was rearmed or disarmed after the loop saw it expire.
+ */
+bool event_loop__timer_expired(struct event_handler *handler)
+{
+	uint64_t expirations;
+
+	return read(handler->fd, &expirations, sizeof(expirations)) == sizeof(expirations);
+}
@@ -1,9 +1,11 @@
 #ifndef KVM__8250_SERIAL_H
 #define KVM__8250_SERIAL_H
 
+#include <stdbool.h>
+
 struct kvm;
 
-void serial8250__init(void);
-void serial8250__interrupt(struct kvm *self);
+bool serial8250__set_backend(const char *arg);
+void serial8250__init(struct kvm *self);
 
 #endif /* KVM__8250_SERIAL_H */
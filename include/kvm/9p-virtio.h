@@ -0,0 +1,11 @@
+#ifndef KVM__9P_VIRTIO_H
+#define KVM__9P_VIRTIO_H
+
+struct kvm;
+
+/* What the guest passes to mount -t 9p unless --9p names a tag */
+#define P9_DEFAULT_TAG		"kvm_9p"
+
+void p9_virtio__init(struct kvm *self, const char *root, const char *tag);
+
+#endif /* KVM__9P_VIRTIO_H */
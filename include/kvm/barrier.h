@@ -0,0 +1,15 @@
+#ifndef KVM__BARRIER_H
+#define KVM__BARRIER_H
+
+/*
+ * Memory barriers for rings shared with the guest. x86 does not reorder
+ * loads with other loads or stores with other stores, but the compiler
+ * might, hence the "memory" clobbers.
+ */
+#define mb()		asm volatile("mfence" ::: "memory")
+#define rmb()		asm volatile("lfence" ::: "memory")
+#define wmb()		asm volatile("sfence" ::: "memory")
+
+#define cpu_relax()	asm volatile("rep; nop" ::: "memory")
+
+#endif /* KVM__BARRIER_H */
@@ -0,0 +1,39 @@
+#ifndef KVM__BLK_TRACE_H
+#define KVM__BLK_TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Block request traces: one record per virtio-blk request as the device
+ * completes it, written little-endian after a small header. blkreplay
+ * runs a trace against the disk image backends without a guest.
+ */
+#define BLK_TRACE_MAGIC		"KVMBLKT"
+#define BLK_TRACE_VERSION	1
+
+struct blk_trace_header {
+	char			magic[8];
+	uint32_t		version;
+	uint32_t		record_size;
+};
+
+struct blk_trace_record {
+	uint64_t		time_ns;	/* avail ring pickup, since the trace started */
+	uint64_t		sector;
+	uint32_t		len;
+	uint32_t		type;		/* VIRTIO_BLK_T_* */
+	uint32_t		latency_ns;	/* pickup to used ring publish, saturated */
+	uint8_t			disk;
+	uint8_t			error;
+	uint8_t			pad[2];
+};
+
+struct blk_trace;
+
+struct blk_trace *blk_trace__create(const char *filename);
+uint64_t blk_trace__time(struct blk_trace *self, uint64_t now_ns);
+void blk_trace__record(struct blk_trace *self, struct blk_trace_record *rec);
+
+struct blk_trace_record *blk_trace__load(const char *filename, uint64_t *nr_records);
+
+#endif /* KVM__BLK_TRACE_H */
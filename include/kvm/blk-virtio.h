@@ -1,8 +1,35 @@
 #ifndef KVM__BLK_VIRTIO_H
 #define KVM__BLK_VIRTIO_H
 
+#include "kvm/throttle.h"
+
 struct kvm;
+struct blk_trace;
+
+struct blk_virtio_params {
+	/*
+	 * If non-zero, a host thread busy-polls the request queue and only
+	 * falls back to guest notifications after being idle for this long.
+	 */
+	unsigned long		poll_idle_us;
+
+	/*
+	 * Interrupt moderation: raise the queue interrupt after this many
+	 * completions or this long after the first one, whichever is first.
+	 */
+	unsigned int		irq_max_pending;
+	unsigned int		irq_max_delay_us;
+
+	/* Per-disk IOPS and bandwidth limits */
+	struct throttle_limits	throttle;
+
+	/* Print the request statistics of each queue on exit */
+	bool			dump_stats;
+
+	/* Record every request of every disk here */
+	struct blk_trace	*trace;
+};
 
-void blk_virtio__init(struct kvm *self);
+void blk_virtio__init(struct kvm *self, struct blk_virtio_params *params);
 
 #endif /* KVM__BLK_VIRTIO_H */
@@ -0,0 +1,23 @@
+#ifndef KVM__BOOT_PROFILE_H
+#define KVM__BOOT_PROFILE_H
+
+/*
+ * Launch profile, enabled with --boot-profile: times the setup phases from
+ * process start and the first signs of life from the guest, and reports
+ * them at exit as a table or as a Chrome trace (chrome://tracing, Perfetto).
+ * Phases nest; each event is only recorded the first time it happens.
+ */
+enum boot_profile_event {
+	BOOT_PROFILE_FIRST_RUN,
+	BOOT_PROFILE_FIRST_SERIAL,
+	BOOT_PROFILE_FIRST_MARKER,
+
+	BOOT_PROFILE_NR_EVENTS,
+};
+
+void boot_profile__init(const char *json_path);
+void boot_profile__begin(const char *name);
+void boot_profile__end(void);
+void boot_profile__event(enum boot_profile_event event);
+
+#endif /* KVM__BOOT_PROFILE_H */
@@ -0,0 +1,19 @@
+#ifndef KVM__BOOT_TRACE_H
+#define KVM__BOOT_TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Boot traces record the sectors a guest reads while booting into a file
+ * next to the disk image. When a valid trace exists for an image, a
+ * background thread prefetches the recorded ranges in order instead.
+ */
+#define BOOT_TRACE_SUFFIX	".boot-trace"
+
+struct disk_image;
+struct boot_trace;
+
+void boot_trace__start(struct disk_image *disk, const char *image_filename, unsigned int record_secs);
+void boot_trace__record(struct boot_trace *self, uint64_t sector, uint64_t nr_sectors);
+
+#endif /* KVM__BOOT_TRACE_H */
@@ -0,0 +1,48 @@
+#ifndef KVM__COMPRESSED_IMAGE_H
+#define KVM__COMPRESSED_IMAGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Read-only compressed disk image. The image is split into fixed-size
+ * chunks that are compressed independently, and an index of chunk offsets
+ * gives random access to them. All fields are little-endian:
+ *
+ *	struct compressed_image_header
+ *	uint64_t index[nr_chunks + 1]		at index_offset
+ *	compressed chunks
+ *
+ * Chunk i occupies [index[i], index[i + 1]) in the file. A chunk whose
+ * compressed length equals its uncompressed length is stored as is.
+ *
+ * Guest writes go to an anonymous overlay, the same way they end up in
+ * private COW pages for raw images.
+ */
+#define COMPRESSED_IMAGE_MAGIC		"KVMCIMG"
+#define COMPRESSED_IMAGE_VERSION	1
+
+#define COMPRESSED_IMAGE_ZLIB		1
+#define COMPRESSED_IMAGE_ZSTD		2
+
+struct compressed_image_header {
+	char			magic[8];
+	uint32_t		version;
+	uint32_t		codec;
+	uint32_t		chunk_shift;
+	uint32_t		reserved;
+	uint64_t		size;
+	uint64_t		nr_chunks;
+	uint64_t		index_offset;
+};
+
+struct disk_image;
+
+/* Size of the decompressed chunk cache of each image */
+extern unsigned long compressed_image_cache_mb;
+
+struct disk_image *compressed_image__probe(int fd, uint64_t size);
+bool compressed_image__codec_supported(uint32_t codec);
+int compressed_image__create(int src_fd, int dst_fd, uint32_t codec, uint32_t chunk_shift);
+
+#endif /* KVM__COMPRESSED_IMAGE_H */
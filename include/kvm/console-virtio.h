@@ -0,0 +1,9 @@
+#ifndef KVM__CONSOLE_VIRTIO_H
+#define KVM__CONSOLE_VIRTIO_H
+
+struct kvm;
+
+void console_virtio__add_port(const char *spec);
+void console_virtio__init(struct kvm *self);
+
+#endif /* KVM__CONSOLE_VIRTIO_H */
@@ -0,0 +1,18 @@
+#ifndef KVM__CONSOLE_H
+#define KVM__CONSOLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Guest console output. Writes are copied into a ring buffer and written
+ * out by a separate thread, so the vCPU doesn't wait on the terminal or
+ * the log file. Output is flushed on newline, once enough has piled up, or
+ * CONSOLE_FLUSH_DELAY_MS after it was written.
+ */
+void console__init(const char *log_path);
+void console__write(const char *buf, size_t len);
+void console__flush(void);
+bool console__claim_stdin(void);
+
+#endif /* KVM__CONSOLE_H */
@@ -0,0 +1,22 @@
+#ifndef KVM__CONTROL_H
+#define KVM__CONTROL_H
+
+#include <stdbool.h>
+
+struct kvm;
+
+/*
+ * Runtime control interface. Clients connect to a UNIX socket and send one
+ * command per line; handlers reply by writing text to @fd and return false
+ * if the arguments don't match the usage string.
+ */
+struct control_command {
+	const char		*name;
+	const char		*usage;
+	bool			(*handler)(struct kvm *self, int argc, char *argv[], int fd);
+};
+
+void control__register(struct control_command *cmd);
+bool control__init(struct kvm *self, const char *path);
+
+#endif /* KVM__CONTROL_H */
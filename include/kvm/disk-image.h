@@ -1,20 +1,42 @@
 #ifndef KVM__DISK_IMAGE_H
 #define KVM__DISK_IMAGE_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #define SECTOR_SHIFT		9
 #define SECTOR_SIZE		(1UL << SECTOR_SHIFT)
 
+#define MAX_DISK_IMAGES		4
+
+struct iovec;
+struct disk_image;
+struct boot_trace;
+struct shared_cache_image;
+
+struct disk_image_operations {
+	int (*read_sector_iov)(struct disk_image *self, uint64_t sector, const struct iovec *iov, int iovcount);
+	int (*write_sector_iov)(struct disk_image *self, uint64_t sector, const struct iovec *iov, int iovcount);
+	/* Optional: start bringing a range in ahead of guest reads */
+	void (*prefetch)(struct disk_image *self, uint64_t sector, uint64_t nr_sectors);
+	void (*close)(struct disk_image *self);
+};
+
 struct disk_image {
-	void		*mmap;
-	int		fd;
-	uint64_t	size;
+	int				fd;
+	uint64_t			size;
+	struct disk_image_operations	*ops;
+	void				*priv;
+	struct boot_trace		*trace;
+	struct shared_cache_image	*cache;
 };
 
-struct disk_image *disk_image__open(const char *filename);
+struct disk_image *disk_image__new(int fd, uint64_t size, struct disk_image_operations *ops);
+struct disk_image *disk_image__open(const char *filename, bool direct);
 void disk_image__close(struct disk_image *self);
 int disk_image__read_sector(struct disk_image *self, uint64_t sector, void *dst, uint32_t dst_len);
 int disk_image__write_sector(struct disk_image *self, uint64_t sector, void *src, uint32_t src_len);
+int disk_image__read_sector_iov(struct disk_image *self, uint64_t sector, const struct iovec *iov, int iovcount);
+int disk_image__write_sector_iov(struct disk_image *self, uint64_t sector, const struct iovec *iov, int iovcount);
 
 #endif /* KVM__DISK_IMAGE_H */
@@ -0,0 +1,27 @@
+#ifndef KVM__EVENT_LOOP_H
+#define KVM__EVENT_LOOP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Host event loop: a single thread that sleeps in epoll_wait() on the file
+ * descriptors devices hand to it, so nothing wakes up unless there is work.
+ * Callbacks run on the loop thread and must not block.
+ */
+struct event_handler {
+	int			fd;
+	void			(*callback)(struct event_handler *self, uint32_t events);
+	void			*ptr;
+};
+
+bool event_loop__add(struct event_handler *handler, uint32_t events);
+bool event_loop__modify(struct event_handler *handler, uint32_t events);
+void event_loop__del(struct event_handler *handler);
+
+/* One-shot CLOCK_MONOTONIC timers backed by a timerfd */
+void event_loop__add_timer(struct event_handler *handler);
+void event_loop__set_timer(struct event_handler *handler, uint64_t ns);
+bool event_loop__timer_expired(struct event_handler *handler);
+
+#endif /* KVM__EVENT_LOOP_H */
@@ -5,8 +5,15 @@
 #include <stdint.h>
 
 /* some ports we reserve for own use */
-#define IOPORT_DBG	0xe0
-#define IOPORT_VIRTIO	0xc200
+#define IOPORT_DBG		0xe0
+#define IOPORT_VIRTIO_BLK	0xc200	/* Virtio block devices */
+#define IOPORT_VIRTIO_BLK_SIZE	256	/* per device */
+#define IOPORT_VIRTIO_PMEM	0xc600	/* Virtio persistent memory device */
+#define IOPORT_VIRTIO_PMEM_SIZE	256
+#define IOPORT_VIRTIO_9P	0xc700	/* Virtio 9P shared directory */
+#define IOPORT_VIRTIO_9P_SIZE	256
+#define IOPORT_VIRTIO_CONSOLE	0xc800	/* Virtio console */
+#define IOPORT_VIRTIO_CONSOLE_SIZE	256
 
 struct kvm;
 
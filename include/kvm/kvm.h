@@ -1,28 +1,52 @@
 #ifndef KVM__KVM_H
 #define KVM__KVM_H
 
+#include "kvm/disk-image.h"
+#include "kvm/event-loop.h"
 #include "kvm/interrupt.h"
 
 #include <linux/kvm.h>	/* for struct kvm_regs */
 
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 
+/* How the vCPU enters the loaded kernel, see kvm__reset_vcpu() */
+enum kvm_boot_mode {
+	KVM_BOOT_REAL_MODE,	/* bzImage setup code or a flat binary */
+	KVM_BOOT_64BIT,		/* bzImage 64-bit entry, boot_info is the zero page */
+	KVM_BOOT_PVH,		/* ELF vmlinux, boot_info is the PVH start info */
+};
+
+/* Interrupts KVM_RUN so that the vCPU thread drains the coalesced ring */
+#define SIGKVMKICK		SIGUSR1
+
 struct kvm {
 	int			sys_fd;		/* For system ioctls(), i.e. /dev/kvm */
 	int			vm_fd;		/* For VM ioctls() */
 	int			vcpu_fd;	/* For VCPU ioctls() */
 	struct kvm_run		*kvm_run;
 
-	struct disk_image	*disk_image;
+	/* Writes KVM queued without exiting, see kvm__drain_coalesced() */
+	struct kvm_coalesced_mmio_ring	*coalesced_ring;
+	uint32_t		coalesced_max;
+	struct event_handler	coalesced_timer;
+	pthread_t		vcpu_thread;	/* Kicked when the ring needs draining */
+
+	struct disk_image	*disks[MAX_DISK_IMAGES];
+	int			nr_disks;
 	uint64_t		ram_size;
 	void			*ram_start;
+	int			nr_mem_slots;
 
 	bool			nmi_disabled;
 
+	enum kvm_boot_mode	boot_mode;
 	uint16_t		boot_selector;
-	uint16_t		boot_ip;
-	uint16_t		boot_sp;
+	uint64_t		boot_ip;
+	uint64_t		boot_sp;
+	uint64_t		boot_info;
 
 	struct kvm_regs		regs;
 	struct kvm_sregs	sregs;
@@ -34,16 +58,19 @@ struct kvm {
 
 struct kvm *kvm__init(const char *kvm_dev, unsigned long ram_size);
 void kvm__delete(struct kvm *self);
+void kvm__register_mem(struct kvm *self, uint64_t guest_phys, uint64_t size, void *userspace_addr);
 void kvm__setup_cpuid(struct kvm *self);
 void kvm__enable_singlestep(struct kvm *self);
 bool kvm__load_kernel(struct kvm *kvm, const char *kernel_filename,
-			const char *initrd_filename, const char *kernel_cmdline);
+			const char *initrd_filename, const char *kernel_cmdline, bool direct);
 void kvm__reset_vcpu(struct kvm *self);
 void kvm__setup_mem(struct kvm *self);
 void kvm__run(struct kvm *self);
 void kvm__irq_line(struct kvm *self, int irq, int level);
 bool kvm__emulate_io(struct kvm *self, uint16_t port, void *data, int direction, int size, uint32_t count);
 bool kvm__emulate_mmio(struct kvm *self, uint64_t phys_addr, uint8_t *data, uint32_t len, uint8_t is_write);
+bool kvm__register_coalesced_pio(struct kvm *self, uint16_t port, uint32_t size);
+int kvm__drain_coalesced(struct kvm *self);
 
 /*
  * Debugging
@@ -0,0 +1,16 @@
+#ifndef KVM__MARKER_H
+#define KVM__MARKER_H
+
+#include <stdint.h>
+
+/*
+ * Guest markers: 16-bit writes to IOPORT_DBG are recorded with the host
+ * time and TSC in a ring that keeps the last MARKER_RING_SIZE of them, and
+ * that is written out when the VMM exits.
+ */
+#define MARKER_RING_SIZE	(64 << 10)
+
+void marker__init(const char *log_path);
+void marker__record(uint16_t id);
+
+#endif /* KVM__MARKER_H */
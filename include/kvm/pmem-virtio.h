@@ -0,0 +1,8 @@
+#ifndef KVM__PMEM_VIRTIO_H
+#define KVM__PMEM_VIRTIO_H
+
+struct kvm;
+
+void pmem_virtio__init(struct kvm *self, const char *filename);
+
+#endif /* KVM__PMEM_VIRTIO_H */
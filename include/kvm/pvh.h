@@ -0,0 +1,42 @@
+#ifndef KVM__PVH_H
+#define KVM__PVH_H
+
+#include <stdint.h>
+
+/*
+ * The PVH boot ABI, see xen/include/public/arch-x86/hvm/start_info.h. An
+ * uncompressed kernel advertises its 32-bit entry point in an ELF note and
+ * is entered in flat protected mode with %ebx pointing to the start info.
+ */
+#define XEN_ELFNOTE_PHYS32_ENTRY	18
+
+#define XEN_HVM_START_MAGIC_VALUE	0x336ec578
+
+struct hvm_start_info {
+	uint32_t	magic;
+	uint32_t	version;	/* 1 if memmap_paddr is valid */
+	uint32_t	flags;
+	uint32_t	nr_modules;
+	uint64_t	modlist_paddr;
+	uint64_t	cmdline_paddr;
+	uint64_t	rsdp_paddr;
+	uint64_t	memmap_paddr;
+	uint32_t	memmap_entries;
+	uint32_t	reserved;
+};
+
+struct hvm_modlist_entry {
+	uint64_t	paddr;
+	uint64_t	size;
+	uint64_t	cmdline_paddr;
+	uint64_t	reserved;
+};
+
+struct hvm_memmap_table_entry {
+	uint64_t	addr;
+	uint64_t	size;
+	uint32_t	type;		/* E820_MEM_* */
+	uint32_t	reserved;
+};
+
+#endif /* KVM__PVH_H */
@@ -0,0 +1,32 @@
+#ifndef KVM__SHARED_CACHE_H
+#define KVM__SHARED_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Block cache in a POSIX shared memory segment that all VMM processes on
+ * the host using the same cache name attach to. Blocks are keyed by an id
+ * derived from the identity of the image file and by block number, so VMs
+ * booting from the same base image share each other's reads.
+ *
+ * Only clean data goes in: blocks a guest has written to are read from its
+ * own image backend from then on.
+ */
+#define SHARED_CACHE_BLOCK_SHIFT	12
+#define SHARED_CACHE_BLOCK_SIZE		(1UL << SHARED_CACHE_BLOCK_SHIFT)
+
+#define SHARED_CACHE_DEFAULT_MB		256
+
+struct iovec;
+struct disk_image;
+struct shared_cache;
+struct shared_cache_image;
+
+struct shared_cache *shared_cache__attach(const char *name, unsigned long size_mb);
+bool shared_cache__add_image(struct shared_cache *self, struct disk_image *disk);
+
+int shared_cache__read(struct shared_cache_image *self, struct disk_image *disk, uint64_t sector, const struct iovec *iov, int iovcount);
+void shared_cache__written(struct shared_cache_image *self, uint64_t sector, uint64_t len);
+
+#endif /* KVM__SHARED_CACHE_H */
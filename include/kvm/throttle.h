@@ -0,0 +1,45 @@
+#ifndef KVM__THROTTLE_H
+#define KVM__THROTTLE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+enum {
+	THROTTLE_READ,
+	THROTTLE_WRITE,
+	THROTTLE_NR_DIRS,
+};
+
+/* A rate of zero means unlimited. A burst of zero defaults to one second worth of rate. */
+struct throttle_limit {
+	uint64_t		rate;
+	uint64_t		burst;
+};
+
+struct throttle_limits {
+	struct throttle_limit	iops[THROTTLE_NR_DIRS];
+	struct throttle_limit	bps[THROTTLE_NR_DIRS];
+};
+
+struct token_bucket {
+	uint64_t		rate;		/* tokens per second */
+	uint64_t		burst;		/* bucket capacity */
+	double			tokens;
+	uint64_t		last_ns;
+};
+
+struct throttle {
+	pthread_mutex_t		mutex;
+	struct token_bucket	iops[THROTTLE_NR_DIRS];
+	struct token_bucket	bps[THROTTLE_NR_DIRS];
+};
+
+void throttle__init(struct throttle *self, struct throttle_limits *limits);
+void throttle__set_limits(struct throttle *self, struct throttle_limits *limits);
+void throttle__get_limits(struct throttle *self, struct throttle_limits *limits);
+uint64_t throttle__account(struct throttle *self, int dir, uint64_t bytes);
+bool throttle__parse_limits(struct throttle_limits *limits, const char *arg);
+int throttle__format_limits(struct throttle_limits *limits, char *buf, size_t size);
+
+#endif /* KVM__THROTTLE_H */
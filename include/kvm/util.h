@@ -3,6 +3,8 @@
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
+#define BITS_PER_LONG	(sizeof(unsigned long) * 8)
+
 /*
  * Some bits are stolen from perf tool :)
  */
@@ -17,6 +19,8 @@
 #include <limits.h>
 #include <sys/param.h>
 #include <sys/types.h>
+#include <stdint.h>
+#include <time.h>
 
 #ifdef __GNUC__
 #define NORETURN __attribute__((__noreturn__))
@@ -46,4 +50,29 @@ do {								\
 
 extern size_t strlcat(char *dest, const char *src, size_t count);
 
+#define NSEC_PER_SEC		1000000000ULL
+
+static inline uint64_t clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* Host TSC, 0 where there is none */
+static inline unsigned long long rdtsc(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	unsigned int lo, hi;
+
+	asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+
+	return (unsigned long long) hi << 32 | lo;
+#else
+	return 0;
+#endif
+}
+
 #endif /* KVM__UTIL_H */
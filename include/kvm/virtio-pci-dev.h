@@ -0,0 +1,30 @@
+#ifndef KVM__VIRTIO_PCI_DEV_H
+#define KVM__VIRTIO_PCI_DEV_H
+
+/*
+ * Virtio PCI device constants
+ */
+#define PCI_VENDOR_ID_REDHAT_QUMRANET		0x1af4
+#define PCI_SUBSYSTEM_VENDOR_ID_REDHAT_QUMRANET	0x1af4
+
+#define PCI_DEVICE_ID_VIRTIO_BLK		0x1001
+#define PCI_SUBSYSTEM_ID_VIRTIO_BLK		0x0002
+
+#define PCI_DEVICE_ID_VIRTIO_CONSOLE		0x1003
+#define PCI_SUBSYSTEM_ID_VIRTIO_CONSOLE		0x0003
+
+#define PCI_DEVICE_ID_VIRTIO_9P			0x1009
+#define PCI_SUBSYSTEM_ID_VIRTIO_9P		0x0009
+
+#define PCI_DEVICE_ID_VIRTIO_PMEM		0x101b
+#define PCI_SUBSYSTEM_ID_VIRTIO_PMEM		0x001b
+
+/*
+ * PCI slot assignments
+ */
+#define VIRTIO_BLK_PCI_SLOT			1	/* one slot per disk */
+#define VIRTIO_PMEM_PCI_SLOT			5
+#define VIRTIO_9P_PCI_SLOT			6
+#define VIRTIO_CONSOLE_PCI_SLOT			7
+
+#endif /* KVM__VIRTIO_PCI_DEV_H */
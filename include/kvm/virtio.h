@@ -0,0 +1,41 @@
+#ifndef KVM__VIRTIO_H
+#define KVM__VIRTIO_H
+
+#include "kvm/virtio_ring.h"
+
+#include <sys/uio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct kvm;
+
+/* Legacy virtio-PCI: the guest hands over page aligned rings by PFN */
+#define VIRTIO_PCI_VRING_ALIGN		4096
+
+struct virt_queue {
+	struct vring			vring;
+	uint32_t			pfn;
+	/* The last_avail_idx field is an index to ->ring of struct vring_avail.
+	   It's where we assume the next request index is at.  */
+	uint16_t			last_avail_idx;
+};
+
+void virt_queue__init(struct kvm *kvm, struct virt_queue *queue, uint32_t pfn, unsigned int num);
+int virt_queue__pop(struct virt_queue *queue);
+void virt_queue__set_used(struct virt_queue *queue, uint16_t nth, uint16_t head, uint32_t len);
+void virt_queue__publish_used(struct virt_queue *queue, uint16_t nr);
+void virt_queue__push(struct virt_queue *queue, uint16_t head, uint32_t len);
+int virt_queue__chain(struct kvm *kvm, struct virt_queue *queue, uint16_t head,
+		      bool write, struct iovec *iov, int max);
+
+static inline bool virt_queue__available(struct virt_queue *queue)
+{
+	return queue->vring.avail->idx != queue->last_avail_idx;
+}
+
+bool virtio_pci__config_in(void *data, unsigned long offset, int size, uint32_t count,
+			   const void *config, size_t config_size);
+void virtio_pci__isr_in(struct kvm *kvm, void *data, int irq);
+
+#endif /* KVM__VIRTIO_H */
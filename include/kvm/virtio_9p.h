@@ -0,0 +1,20 @@
+#ifndef _LINUX_VIRTIO_9P_H
+#define _LINUX_VIRTIO_9P_H
+
+#include <inttypes.h>
+
+#define VIRTIO_ID_9P		9
+
+/* The feature bitmap for virtio 9P */
+
+/* The mount point is specified in a config variable */
+#define VIRTIO_9P_MOUNT_TAG	0
+
+struct virtio_9p_config {
+	/* length of the tag name */
+	uint16_t tag_len;
+	/* non-NULL terminated tag name */
+	uint8_t tag[0];
+} __attribute__((packed));
+
+#endif /* _LINUX_VIRTIO_9P_H */
@@ -0,0 +1,26 @@
+#ifndef _LINUX_VIRTIO_PMEM_H
+#define _LINUX_VIRTIO_PMEM_H
+
+#include <inttypes.h>
+
+#define VIRTIO_ID_PMEM			27
+
+struct virtio_pmem_config {
+	/* Guest physical address and size of the persistent memory region */
+	uint64_t start;
+	uint64_t size;
+};
+
+#define VIRTIO_PMEM_REQ_TYPE_FLUSH	0
+
+struct virtio_pmem_req {
+	/* Device-readable part */
+	uint32_t type;
+};
+
+struct virtio_pmem_resp {
+	/* Host return status corresponding to flush request */
+	uint32_t ret;
+};
+
+#endif /* _LINUX_VIRTIO_PMEM_H */
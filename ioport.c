@@ -1,6 +1,8 @@
 #include "kvm/ioport.h"
 
+#include "kvm/marker.h"
 #include "kvm/kvm.h"
+#include "kvm/util.h"
 
 #include <stdbool.h>
 #include <assert.h>
@@ -32,9 +34,53 @@ static struct ioport_operations cmos_ram_rtc_ops = {
 	.io_out		= cmos_ram_rtc_io_out,
 };
 
+/*
+ * The exit cost guests in tests/exits bracket their loop with 32-bit
+ * writes of the number of exits it makes; we time what's in between.
+ */
+static struct {
+	bool			running;
+	uint64_t		start_tsc;
+	uint64_t		start_ns;
+} exit_bench;
+
+static void exit_bench__mark(uint32_t nr_exits)
+{
+	uint64_t tsc = rdtsc(), ns = clock_ns();
+
+	if (!exit_bench.running) {
+		exit_bench.running	= true;
+		exit_bench.start_tsc	= tsc;
+		exit_bench.start_ns	= ns;
+		return;
+	}
+
+	exit_bench.running	= false;
+
+	if (!nr_exits)
+		return;
+
+	info("%" PRIu32 " exits: %.0f cycles/exit, %.0f ns/exit", nr_exits,
+		(double) (tsc - exit_bench.start_tsc) / nr_exits,
+		(double) (ns - exit_bench.start_ns) / nr_exits);
+}
+
+/*
+ * The debug port takes a command per access size: a byte ends the VM, a
+ * word records a guest marker and a long brackets an exit cost benchmark.
+ */
 static bool debug_io_out(struct kvm *self, uint16_t port, void *data, int size, uint32_t count)
 {
-	exit(EXIT_SUCCESS);
+	switch (size) {
+	case 2:
+		marker__record(ioport__read16(data));
+		return true;
+	case 4:
+		exit_bench__mark(ioport__read32(data));
+		return true;
+	default:
+		exit(EXIT_SUCCESS);
+	}
 }
 
 static struct ioport_operations debug_ops = {
@@ -1,8 +1,12 @@
 #include "kvm/kvm.h"
 
+#include "kvm/boot-profile.h"
+#include "kvm/event-loop.h"
 #include "kvm/interrupt.h"
 #include "kvm/cpufeature.h"
+#include "kvm/barrier.h"
 #include "kvm/e820.h"
+#include "kvm/pvh.h"
 #include "kvm/util.h"
 
 #include <linux/kvm.h>
@@ -12,15 +16,19 @@
 #include <sys/ioctl.h>
 #include <inttypes.h>
 #include <sys/mman.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <assert.h>
 #include <limits.h>
 #include <stdarg.h>
+#include <signal.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <elf.h>
 #include <sys/stat.h>
 
 /*
@@ -30,6 +38,10 @@
 # define KVM_EXIT_INTERNAL_ERROR		17
 #endif
 
+#ifndef KVM_CAP_COALESCED_PIO
+# define KVM_CAP_COALESCED_PIO			162
+#endif
+
 #define DEFINE_KVM_EXIT_REASON(reason) [reason] = #reason
 
 const char *kvm_exit_reasons[] = {
@@ -110,7 +122,7 @@ static struct kvm *kvm__new(void)
 
 void kvm__delete(struct kvm *self)
 {
-	free(self->ram_start);
+	munmap(self->ram_start, self->ram_size);
 	free(self);
 }
 
@@ -156,9 +168,31 @@ static bool kvm__cpu_supports_vm(void)
 	return regs.ecx & (1 << feature);
 }
 
-struct kvm *kvm__init(const char *kvm_dev, unsigned long ram_size)
+/*
+ * Maps @size bytes at @userspace_addr into the guest at @guest_phys using the
+ * next free memory slot. Slot 0 is guest RAM.
+ */
+void kvm__register_mem(struct kvm *self, uint64_t guest_phys, uint64_t size, void *userspace_addr)
 {
 	struct kvm_userspace_memory_region mem;
+	int ret;
+
+	mem = (struct kvm_userspace_memory_region) {
+		.slot			= self->nr_mem_slots,
+		.guest_phys_addr	= guest_phys,
+		.memory_size		= size,
+		.userspace_addr		= (unsigned long) userspace_addr,
+	};
+
+	ret = ioctl(self->vm_fd, KVM_SET_USER_MEMORY_REGION, &mem);
+	if (ret < 0)
+		die_perror("KVM_SET_USER_MEMORY_REGION ioctl");
+
+	self->nr_mem_slots++;
+}
+
+struct kvm *kvm__init(const char *kvm_dev, unsigned long ram_size)
+{
 	struct kvm_pit_config pit_config = { .flags = 0, };
 	struct kvm *self;
 	long page_size;
@@ -170,6 +204,8 @@ struct kvm *kvm__init(const char *kvm_dev, unsigned long ram_size)
 
 	self = kvm__new();
 
+	boot_profile__begin("check extensions");
+
 	self->sys_fd = open(kvm_dev, O_RDWR);
 	if (self->sys_fd < 0) {
 		if (errno == ENOENT)
@@ -189,6 +225,8 @@ struct kvm *kvm__init(const char *kvm_dev, unsigned long ram_size)
 	if (kvm__check_extensions(self))
 		die("A required KVM extention is not supported by OS");
 
+	boot_profile__end();
+
 	ret = ioctl(self->vm_fd, KVM_SET_TSS_ADDR, 0xfffbd000);
 	if (ret < 0)
 		die_perror("KVM_SET_TSS_ADDR ioctl");
@@ -199,20 +237,19 @@ struct kvm *kvm__init(const char *kvm_dev, unsigned long ram_size)
 
 	self->ram_size		= ram_size;
 
+	boot_profile__begin("allocate guest memory");
+
 	page_size	= sysconf(_SC_PAGESIZE);
-	if (posix_memalign(&self->ram_start, page_size, self->ram_size) != 0)
+
+	/* An anonymous mapping, so that file pages can be mapped over it */
+	self->ram_start	= mmap(NULL, self->ram_size, PROT_READ | PROT_WRITE,
+				MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+	if (self->ram_start == MAP_FAILED)
 		die("out of memory");
 
-	mem = (struct kvm_userspace_memory_region) {
-		.slot			= 0,
-		.guest_phys_addr	= 0x0UL,
-		.memory_size		= self->ram_size,
-		.userspace_addr		= (unsigned long) self->ram_start,
-	};
+	kvm__register_mem(self, 0x0UL, self->ram_size, self->ram_start);
 
-	ret = ioctl(self->vm_fd, KVM_SET_USER_MEMORY_REGION, &mem);
-	if (ret < 0)
-		die_perror("KVM_SET_USER_MEMORY_REGION ioctl");
+	boot_profile__end();
 
 	ret = ioctl(self->vm_fd, KVM_CREATE_IRQCHIP);
 	if (ret < 0)
@@ -230,9 +267,127 @@ struct kvm *kvm__init(const char *kvm_dev, unsigned long ram_size)
 	if (self->kvm_run == MAP_FAILED)
 		die("unable to mmap vcpu fd");
 
+	/* The extension returns the page offset of the ring in the vcpu mapping */
+	ret = ioctl(self->sys_fd, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_MMIO);
+	if (ret > 0) {
+		self->coalesced_ring	= (void *) self->kvm_run + ret * page_size;
+		self->coalesced_max	= (page_size - sizeof(struct kvm_coalesced_mmio_ring)) /
+						sizeof(struct kvm_coalesced_mmio);
+	}
+
 	return self;
 }
 
+/* How often the ring is checked while the guest keeps queueing writes */
+#define COALESCED_POLL_NS	10000000	/* 10 msec */
+/* ... and while it doesn't */
+#define COALESCED_IDLE_NS	100000000	/* 100 msec */
+
+/* Only there to make KVM_RUN return with KVM_EXIT_INTR */
+static void kvm__kick_handler(int sig)
+{
+}
+
+/*
+ * Catches writes from a guest that doesn't exit to us for a while, which an
+ * idle guest with the in-kernel irqchip may not do at all. This runs on the
+ * event loop thread, which must not block, so it doesn't replay the writes
+ * itself: device output may wait for the console. It kicks the vCPU out of
+ * KVM_RUN instead, and kvm__drain_coalesced() does the rest. A kick that
+ * arrives while the vCPU is outside of KVM_RUN is lost, but then the vCPU
+ * drains before it goes back in, and the timer checks again anyway.
+ */
+static void kvm__coalesced_timeout(struct event_handler *handler, uint32_t events)
+{
+	struct kvm *self = handler->ptr;
+	struct kvm_coalesced_mmio_ring *ring = self->coalesced_ring;
+
+	if (!event_loop__timer_expired(handler))
+		return;
+
+	if (ring->first == ring->last) {
+		event_loop__set_timer(handler, COALESCED_IDLE_NS);
+		return;
+	}
+
+	pthread_kill(self->vcpu_thread, SIGKVMKICK);
+
+	event_loop__set_timer(handler, COALESCED_POLL_NS);
+}
+
+/*
+ * Lets KVM queue guest writes to @port in the coalesced ring instead of
+ * exiting for each of them. Only suitable for ports whose writes don't need
+ * to be seen by the device before the guest's next exit. Returns false if
+ * the host kernel doesn't support coalesced PIO.
+ */
+bool kvm__register_coalesced_pio(struct kvm *self, uint16_t port, uint32_t size)
+{
+	struct kvm_coalesced_mmio_zone zone = {
+		.addr		= port,
+		.size		= size,
+		.pad		= 1,	/* "pio" in newer headers */
+	};
+	/* KVM_RUN returns EINTR even with SA_RESTART, other syscalls don't */
+	struct sigaction sa = {
+		.sa_handler	= kvm__kick_handler,
+		.sa_flags	= SA_RESTART,
+	};
+
+	if (!self->coalesced_ring || !kvm__supports_extension(self, KVM_CAP_COALESCED_PIO))
+		return false;
+
+	if (ioctl(self->vm_fd, KVM_REGISTER_COALESCED_MMIO, &zone) < 0)
+		return false;
+
+	if (!self->coalesced_timer.callback) {
+		if (sigaction(SIGKVMKICK, &sa, NULL) < 0)
+			die_perror("sigaction");
+
+		self->vcpu_thread		= pthread_self();
+		self->coalesced_timer.callback	= kvm__coalesced_timeout;
+		self->coalesced_timer.ptr	= self;
+
+		event_loop__add_timer(&self->coalesced_timer);
+		event_loop__set_timer(&self->coalesced_timer, COALESCED_IDLE_NS);
+	}
+
+	return true;
+}
+
+/*
+ * Replays the writes queued in the coalesced ring, in order. The vCPU loop
+ * calls this before handling each exit so that devices see the writes
+ * before the access that caused it. Only the vCPU thread calls this, the
+ * timer above kicks it when the guest leaves writes in the ring.
+ */
+int kvm__drain_coalesced(struct kvm *self)
+{
+	struct kvm_coalesced_mmio_ring *ring = self->coalesced_ring;
+	struct kvm_coalesced_mmio *m;
+	int nr = 0;
+
+	if (!ring || ring->first == ring->last)
+		return 0;
+
+	while (ring->first != ring->last) {
+		rmb();
+
+		m	= &ring->coalesced_mmio[ring->first];
+		if (m->pad)
+			kvm__emulate_io(self, m->phys_addr, m->data, KVM_EXIT_IO_OUT, m->len, 1);
+		else
+			kvm__emulate_mmio(self, m->phys_addr, m->data, m->len, 1);
+
+		/* Done with the entry before KVM may reuse it */
+		mb();
+		ring->first	= (ring->first + 1) % self->coalesced_max;
+		nr++;
+	}
+
+	return nr;
+}
+
 void kvm__enable_singlestep(struct kvm *self)
 {
 	struct kvm_guest_debug debug = {
@@ -249,8 +404,46 @@ void kvm__enable_singlestep(struct kvm *self)
 #define BOOT_CMDLINE_OFFSET	0x20000
 
 #define BOOT_PROTOCOL_REQUIRED	0x202
+#define BOOT_PROTOCOL_64BIT	0x20c
 #define LOAD_HIGH		0x01
 
+/*
+ * Low memory used when the kernel is entered directly in protected or long
+ * mode, without the real-mode setup code and the BIOS.
+ */
+#define BOOT_GDT_START		0x0500
+#define BOOT_PVH_INFO_START	0x6000
+#define BOOT_PARAMS_START	0x7000
+#define BOOT_STACK_TOP		0x8ff0
+#define BOOT_PML4_START		0x9000
+#define BOOT_PDPT_START		0xa000
+#define BOOT_PD_START		0xb000	/* 4 pages, for the first 4 GB */
+
+#define BOOT_GDT_CODE32		0x08
+#define BOOT_GDT_CODE64		0x10	/* __BOOT_CS */
+#define BOOT_GDT_DATA		0x18	/* __BOOT_DS */
+#define BOOT_GDT_TSS		0x20
+
+/* Flat 4 GB segments, the 64-bit boot protocol wants them at these selectors */
+static const uint64_t boot_gdt[] = {
+	[BOOT_GDT_CODE32 >> 3]	= 0x00cf9b000000ffffULL,
+	[BOOT_GDT_CODE64 >> 3]	= 0x00af9b000000ffffULL,
+	[BOOT_GDT_DATA >> 3]	= 0x00cf93000000ffffULL,
+	[BOOT_GDT_TSS >> 3]	= 0x00008b0000000067ULL,
+};
+
+#define PTE_PRESENT		(1ULL << 0)
+#define PTE_RW			(1ULL << 1)
+#define PTE_PSE			(1ULL << 7)
+
+#define X86_CR0_PE		0x00000001
+#define X86_CR0_ET		0x00000010
+#define X86_CR0_PG		0x80000000
+#define X86_CR4_PAE		0x00000020
+
+#define EFER_LME		0x00000100
+#define EFER_LMA		0x00000400
+
 static int load_flat_binary(struct kvm *self, int fd)
 {
 	void *p;
@@ -264,6 +457,7 @@ static int load_flat_binary(struct kvm *self, int fd)
 	while ((nr = read(fd, p, 65536)) > 0)
 		p += nr;
 
+	self->boot_mode		= KVM_BOOT_REAL_MODE;
 	self->boot_selector	= BOOT_LOADER_SELECTOR;
 	self->boot_ip		= BOOT_LOADER_IP;
 	self->boot_sp		= BOOT_LOADER_SP;
@@ -271,6 +465,50 @@ static int load_flat_binary(struct kvm *self, int fd)
 	return true;
 }
 
+/*
+ * Maps @len bytes of @fd from @offset over guest memory at @guest_addr. The
+ * pages come from the page cache and are only copied once the guest writes
+ * to them, so loading doesn't scale with the size of the file. That needs
+ * both to be page aligned, otherwise, or if the file can't be mapped, it is
+ * read into guest memory instead. The rest of the last page is taken from
+ * the file too, or zeroed past its end.
+ */
+static bool kvm__load_file(struct kvm *self, int fd, off_t offset, uint64_t guest_addr, size_t len)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	void *p = guest_flat_to_host(self, guest_addr);
+	struct stat st;
+	ssize_t nr;
+
+	if (guest_addr + len > self->ram_size)
+		return false;
+
+	if (!((offset | guest_addr) & (page_size - 1)) && !fstat(fd, &st) && S_ISREG(st.st_mode)) {
+		if (mmap(p, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE,
+			 fd, offset) != MAP_FAILED)
+			return true;
+
+		/* A failed MAP_FIXED may have left a hole in guest memory */
+		if (mmap(p, len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE,
+			 -1, 0) == MAP_FAILED)
+			die_perror("mmap");
+	}
+
+	while (len) {
+		nr	= pread(fd, p, len, offset);
+		if (nr < 0 && errno == EINTR)
+			continue;
+		if (nr <= 0)
+			return false;
+
+		p	+= nr;
+		offset	+= nr;
+		len	-= nr;
+	}
+
+	return true;
+}
+
 /*
  * The protected mode kernel part of a modern bzImage is loaded at 1 MB by
  * default.
@@ -280,16 +518,121 @@ static int load_flat_binary(struct kvm *self, int fd)
 #define BZ_DEFAULT_SETUP_SECTS		4
 static const char *BZIMAGE_MAGIC	= "HdrS";
 
+#define BOOT_E820_ENTRIES		4
+
+/* The memory map the guest sees, through int 15h or in its boot info */
+static unsigned int kvm__e820_map(struct kvm *self, struct e820_entry *map)
+{
+	map[0]	= (struct e820_entry) {
+		.addr		= REAL_MODE_IVT_BEGIN,
+		.size		= EBDA_START - REAL_MODE_IVT_BEGIN,
+		.type		= E820_MEM_USABLE,
+	};
+	map[1]	= (struct e820_entry) {
+		.addr		= EBDA_START,
+		.size		= VGA_RAM_BEGIN - EBDA_START,
+		.type		= E820_MEM_RESERVED,
+	};
+	map[2]	= (struct e820_entry) {
+		.addr		= MB_BIOS_BEGIN,
+		.size		= MB_BIOS_END - MB_BIOS_BEGIN,
+		.type		= E820_MEM_RESERVED,
+	};
+	map[3]	= (struct e820_entry) {
+		.addr		= BZ_KERNEL_START,
+		.size		= self->ram_size - BZ_KERNEL_START,
+		.type		= E820_MEM_USABLE,
+	};
+
+	return BOOT_E820_ENTRIES;
+}
+
+static void kvm__setup_boot_gdt(struct kvm *self)
+{
+	memcpy(guest_flat_to_host(self, BOOT_GDT_START), boot_gdt, sizeof(boot_gdt));
+}
+
+/* Identity maps the first 4 GB with 2 MB pages */
+static void kvm__setup_boot_page_tables(struct kvm *self)
+{
+	uint64_t *pml4 = guest_flat_to_host(self, BOOT_PML4_START);
+	uint64_t *pdpt = guest_flat_to_host(self, BOOT_PDPT_START);
+	uint64_t *pd = guest_flat_to_host(self, BOOT_PD_START);
+	unsigned int i;
+
+	pml4[0]		= BOOT_PDPT_START | PTE_PRESENT | PTE_RW;
+
+	for (i = 0; i < 4; i++)
+		pdpt[i]	= (BOOT_PD_START + i * 0x1000) | PTE_PRESENT | PTE_RW;
+
+	for (i = 0; i < 4 * 512; i++)
+		pd[i]	= ((uint64_t) i << 21) | PTE_PRESENT | PTE_RW | PTE_PSE;
+}
+
+static void kvm__load_cmdline(struct kvm *self, const char *kernel_cmdline, size_t max_size)
+{
+	void *p = guest_flat_to_host(self, BOOT_CMDLINE_OFFSET);
+	size_t cmdline_size;
+
+	if (!kernel_cmdline)
+		return;
+
+	cmdline_size = strlen(kernel_cmdline) + 1;
+	if (cmdline_size > max_size)
+		cmdline_size = max_size;
+
+	memset(p, 0, max_size);
+	memcpy(p, kernel_cmdline, cmdline_size - 1);
+}
+
+/*
+ * Loads the initrd on the highest 1 MB boundary that keeps it below both
+ * @max_addr and the end of guest memory, but not below @min_addr.
+ */
+static uint64_t kvm__load_initrd(struct kvm *self, int fd_initrd, uint64_t min_addr,
+				 uint64_t max_addr, uint64_t *size)
+{
+	struct stat initrd_stat;
+	uint64_t addr;
+
+	if (fstat(fd_initrd, &initrd_stat))
+		die_perror("fstat");
+
+	addr = max_addr & ~0xfffffULL;
+	for (;;) {
+		if (addr < min_addr)
+			die("Not enough memory for initrd");
+		else if (addr < (self->ram_size - initrd_stat.st_size))
+			break;
+		addr -= 0x100000;
+	}
+
+	boot_profile__begin("read initrd");
+
+	if (!kvm__load_file(self, fd_initrd, 0, addr, initrd_stat.st_size))
+		die("Failed to read initrd");
+
+	boot_profile__end();
+
+	*size	= initrd_stat.st_size;
+
+	return addr;
+}
+
 static bool load_bzimage(struct kvm *self, int fd_kernel,
-			int fd_initrd, const char *kernel_cmdline)
+			int fd_initrd, const char *kernel_cmdline, bool direct)
 {
+	struct e820_entry e820[BOOT_E820_ENTRIES];
 	struct boot_params *kern_boot;
 	unsigned long setup_sects;
 	struct boot_params boot;
-	size_t cmdline_size;
+	struct stat kernel_stat;
+	unsigned int i, nr;
 	ssize_t setup_size;
+	bool real_mode;
+	size_t hdr_size;
+	uint64_t size;
 	void *p;
-	int nr;
 
 	/*
 	 * See Documentation/x86/boot.txt for details no bzImage on-disk and
@@ -309,37 +652,55 @@ static bool load_bzimage(struct kvm *self, int fd_kernel,
 		die("Too old kernel");
 	}
 
-	if (lseek(fd_kernel, 0, SEEK_SET) < 0)
-		die_perror("lseek");
+	/*
+	 * With --direct-boot, a kernel with a 64-bit entry point is started
+	 * there in long mode, with the zero page filled in here. That skips the
+	 * real-mode setup code and the BIOS calls it makes.
+	 */
+	real_mode	= !direct || boot.hdr.version < BOOT_PROTOCOL_64BIT ||
+			  !(boot.hdr.xloadflags & XLF_KERNEL_64);
 
 	if (!boot.hdr.setup_sects)
 		boot.hdr.setup_sects = BZ_DEFAULT_SETUP_SECTS;
 	setup_sects = boot.hdr.setup_sects + 1;
 
 	setup_size = setup_sects << 9;
-	p = guest_real_to_host(self, BOOT_LOADER_SELECTOR, BOOT_LOADER_IP);
 
-	/* copy setup.bin to mem*/
-	if (read(fd_kernel, p, setup_size) != setup_size)
-		die_perror("read");
+	if (real_mode) {
+		if (lseek(fd_kernel, 0, SEEK_SET) < 0)
+			die_perror("lseek");
 
-	/* copy vmlinux.bin to BZ_KERNEL_START*/
-	p = guest_flat_to_host(self, BZ_KERNEL_START);
+		p = guest_real_to_host(self, BOOT_LOADER_SELECTOR, BOOT_LOADER_IP);
 
-	while ((nr = read(fd_kernel, p, 65536)) > 0)
-		p += nr;
+		/* copy setup.bin to mem*/
+		if (read(fd_kernel, p, setup_size) != setup_size)
+			die_perror("read");
+
+		kern_boot	= guest_real_to_host(self, BOOT_LOADER_SELECTOR, 0x00);
+	} else {
+		/* The header ends where the jump at 0x200 lands */
+		hdr_size	= 0x202 + (boot.hdr.jump >> 8) - offsetof(struct boot_params, hdr);
+		if (hdr_size > sizeof(boot.hdr))
+			hdr_size = sizeof(boot.hdr);
 
-	p = guest_flat_to_host(self, BOOT_CMDLINE_OFFSET);
-	if (kernel_cmdline) {
-		cmdline_size = strlen(kernel_cmdline) + 1;
-		if (cmdline_size > boot.hdr.cmdline_size)
-			cmdline_size = boot.hdr.cmdline_size;
+		kern_boot	= guest_flat_to_host(self, BOOT_PARAMS_START);
 
-		memset(p, 0, boot.hdr.cmdline_size);
-		memcpy(p, kernel_cmdline, cmdline_size - 1);
+		memset(kern_boot, 0, sizeof(*kern_boot));
+		memcpy(&kern_boot->hdr, &boot.hdr, hdr_size);
 	}
 
-	kern_boot	= guest_real_to_host(self, BOOT_LOADER_SELECTOR, 0x00);
+	/* copy vmlinux.bin to BZ_KERNEL_START*/
+	boot_profile__begin("read kernel");
+
+	if (fstat(fd_kernel, &kernel_stat))
+		die_perror("fstat");
+
+	if (!kvm__load_file(self, fd_kernel, setup_size, BZ_KERNEL_START, kernel_stat.st_size - setup_size))
+		die("Failed to read kernel");
+
+	boot_profile__end();
+
+	kvm__load_cmdline(self, kernel_cmdline, boot.hdr.cmdline_size);
 
 	kern_boot->hdr.cmd_line_ptr	= BOOT_CMDLINE_OFFSET;
 	kern_boot->hdr.type_of_loader	= 0xff;
@@ -350,30 +711,35 @@ static bool load_bzimage(struct kvm *self, int fd_kernel,
 	 * Read initrd image into guest memory
 	 */
 	if (fd_initrd >= 0) {
-		struct stat initrd_stat;
-		unsigned long addr;
-
-		if (fstat(fd_initrd, &initrd_stat))
-			die_perror("fstat");
+		kern_boot->hdr.ramdisk_image	= kvm__load_initrd(self, fd_initrd, BZ_KERNEL_START,
+								   boot.hdr.initrd_addr_max, &size);
+		kern_boot->hdr.ramdisk_size	= size;
+	}
 
-		addr = boot.hdr.initrd_addr_max & ~0xfffff;
-		for (;;) {
-			if (addr < BZ_KERNEL_START)
-				die("Not enough memory for initrd");
-			else if (addr < (self->ram_size - initrd_stat.st_size))
-				break;
-			addr -= 0x100000;
+	if (!real_mode) {
+		nr	= kvm__e820_map(self, e820);
+		for (i = 0; i < nr; i++) {
+			kern_boot->e820_table[i]	= (struct boot_e820_entry) {
+				.addr		= e820[i].addr,
+				.size		= e820[i].size,
+				.type		= e820[i].type,
+			};
 		}
+		kern_boot->e820_entries	= nr;
 
-		p = guest_flat_to_host(self, addr);
-		nr = read(fd_initrd, p, initrd_stat.st_size);
-		if (nr != initrd_stat.st_size)
-			die("Failed to read initrd");
+		kvm__setup_boot_gdt(self);
+		kvm__setup_boot_page_tables(self);
 
-		kern_boot->hdr.ramdisk_image	= addr;
-		kern_boot->hdr.ramdisk_size	= initrd_stat.st_size;
+		self->boot_mode		= KVM_BOOT_64BIT;
+		/* startup_64 is 0x200 into the protected mode kernel */
+		self->boot_ip		= BZ_KERNEL_START + 0x200;
+		self->boot_sp		= BOOT_STACK_TOP;
+		self->boot_info		= BOOT_PARAMS_START;
+
+		return true;
 	}
 
+	self->boot_mode		= KVM_BOOT_REAL_MODE;
 	self->boot_selector	= BOOT_LOADER_SELECTOR;
 	/*
 	 * The real-mode setup code starts at offset 0x200 of a bzImage. See
@@ -385,13 +751,176 @@ static bool load_bzimage(struct kvm *self, int fd_kernel,
 	/*
 	 * Drum roll, BIOS is coming to live, oh dear...
 	 */
+	boot_profile__begin("setup_bios");
 	setup_bios(self);
+	boot_profile__end();
+
+	return true;
+}
+
+#define ELF_MAX_PHDRS			64
+#define ELF_NOTE_ALIGN(x)		(((x) + 3) & ~3UL)
+
+/* COMMAND_LINE_SIZE on x86, PVH has no header to say otherwise */
+#define PVH_CMDLINE_SIZE		2048
+
+/* Everything PVH passes to the kernel, in one page at BOOT_PVH_INFO_START */
+struct pvh_boot_info {
+	struct hvm_start_info		start_info;
+	struct hvm_modlist_entry	initrd;
+	struct hvm_memmap_table_entry	memmap[BOOT_E820_ENTRIES];
+};
+
+/* Returns the entry point from the kernel's Xen ELF notes, or 0 */
+static uint64_t elf_pvh_entry(int fd, Elf64_Phdr *phdrs, unsigned int nr_phdrs)
+{
+	size_t off, name, desc, size;
+	uint64_t entry = 0;
+	Elf64_Nhdr note;
+	unsigned int i;
+	char *notes;
+
+	for (i = 0; i < nr_phdrs && !entry; i++) {
+		size	= phdrs[i].p_filesz;
+		if (phdrs[i].p_type != PT_NOTE || size > 65536)
+			continue;
+
+		notes	= malloc(size);
+		if (!notes)
+			die("out of memory");
+
+		if (pread(fd, notes, size, phdrs[i].p_offset) != (ssize_t) size)
+			die("Failed to read ELF notes");
+
+		for (off = 0; off + sizeof(note) <= size; ) {
+			memcpy(&note, notes + off, sizeof(note));
+
+			name	= off + sizeof(note);
+			desc	= name + ELF_NOTE_ALIGN(note.n_namesz);
+			off	= desc + ELF_NOTE_ALIGN(note.n_descsz);
+			if (off > size)
+				break;
+
+			if (note.n_type != XEN_ELFNOTE_PHYS32_ENTRY || note.n_namesz != 4 ||
+			    memcmp(notes + name, "Xen", 4) || note.n_descsz < 4)
+				continue;
+
+			/* A 32-bit physical address, stored as a pointer */
+			memcpy(&entry, notes + desc, note.n_descsz < 8 ? 4 : 8);
+			entry	&= 0xffffffff;
+			break;
+		}
+
+		free(notes);
+	}
+
+	return entry;
+}
+
+/*
+ * Loads an uncompressed vmlinux and starts it through its PVH entry point,
+ * in flat protected mode with paging disabled. There's no setup code and
+ * nothing to decompress.
+ */
+static bool load_elf_pvh(struct kvm *self, int fd_kernel,
+			int fd_initrd, const char *kernel_cmdline)
+{
+	struct e820_entry e820[BOOT_E820_ENTRIES];
+	Elf64_Phdr phdrs[ELF_MAX_PHDRS];
+	uint64_t entry, kernel_end = 0;
+	struct pvh_boot_info *info;
+	unsigned int i, nr;
+	Elf64_Ehdr ehdr;
+	Elf64_Phdr *ph;
+	uint64_t size;
+
+	if (pread(fd_kernel, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr))
+		return false;
+
+	if (memcmp(ehdr.e_ident, ELFMAG, SELFMAG))
+		return false;
+
+	if (ehdr.e_ident[EI_CLASS] != ELFCLASS64 || ehdr.e_machine != EM_X86_64)
+		die("Only x86-64 ELF kernels are supported");
+
+	if (ehdr.e_phentsize != sizeof(Elf64_Phdr) || ehdr.e_phnum > ELF_MAX_PHDRS)
+		die("Unsupported ELF program headers");
+
+	size	= ehdr.e_phnum * sizeof(Elf64_Phdr);
+	if (pread(fd_kernel, phdrs, size, ehdr.e_phoff) != (ssize_t) size)
+		die("Failed to read ELF program headers");
+
+	entry	= elf_pvh_entry(fd_kernel, phdrs, ehdr.e_phnum);
+	if (!entry)
+		die("ELF kernel has no PVH entry point, is CONFIG_PVH enabled?");
+
+	boot_profile__begin("read kernel");
+
+	for (i = 0; i < ehdr.e_phnum; i++) {
+		ph	= &phdrs[i];
+		if (ph->p_type != PT_LOAD)
+			continue;
+
+		if (ph->p_filesz > ph->p_memsz || ph->p_memsz > self->ram_size ||
+		    ph->p_paddr > self->ram_size - ph->p_memsz)
+			die("Kernel segment at 0x%" PRIx64 " doesn't fit in guest memory",
+				(uint64_t) ph->p_paddr);
+
+		if (!kvm__load_file(self, fd_kernel, ph->p_offset, ph->p_paddr, ph->p_filesz))
+			die("Failed to read kernel");
+
+		/* The file may have been mapped over what should be the BSS */
+		memset(guest_flat_to_host(self, ph->p_paddr + ph->p_filesz), 0,
+			ph->p_memsz - ph->p_filesz);
+
+		if (ph->p_paddr + ph->p_memsz > kernel_end)
+			kernel_end	= ph->p_paddr + ph->p_memsz;
+	}
+
+	boot_profile__end();
+
+	kvm__load_cmdline(self, kernel_cmdline, PVH_CMDLINE_SIZE);
+
+	info	= guest_flat_to_host(self, BOOT_PVH_INFO_START);
+	memset(info, 0, sizeof(*info));
+
+	nr	= kvm__e820_map(self, e820);
+	for (i = 0; i < nr; i++) {
+		info->memmap[i]	= (struct hvm_memmap_table_entry) {
+			.addr		= e820[i].addr,
+			.size		= e820[i].size,
+			.type		= e820[i].type,
+		};
+	}
+
+	info->start_info	= (struct hvm_start_info) {
+		.magic		= XEN_HVM_START_MAGIC_VALUE,
+		.version	= 1,
+		.cmdline_paddr	= kernel_cmdline ? BOOT_CMDLINE_OFFSET : 0,
+		.memmap_paddr	= BOOT_PVH_INFO_START + offsetof(struct pvh_boot_info, memmap),
+		.memmap_entries	= nr,
+	};
+
+	if (fd_initrd >= 0) {
+		info->initrd.paddr	= kvm__load_initrd(self, fd_initrd, kernel_end, UINT32_MAX, &size);
+		info->initrd.size	= size;
+
+		info->start_info.nr_modules	= 1;
+		info->start_info.modlist_paddr	= BOOT_PVH_INFO_START + offsetof(struct pvh_boot_info, initrd);
+	}
+
+	kvm__setup_boot_gdt(self);
+
+	self->boot_mode		= KVM_BOOT_PVH;
+	self->boot_ip		= entry;
+	self->boot_sp		= BOOT_STACK_TOP;
+	self->boot_info		= BOOT_PVH_INFO_START;
 
 	return true;
 }
 
 bool kvm__load_kernel(struct kvm *kvm, const char *kernel_filename,
-		const char *initrd_filename, const char *kernel_cmdline)
+		const char *initrd_filename, const char *kernel_cmdline, bool direct)
 {
 	bool ret;
 	int fd_kernel = -1, fd_initrd = -1;
@@ -406,7 +935,9 @@ bool kvm__load_kernel(struct kvm *kvm, const char *kernel_filename,
 			die("Unable to open initrd %s", initrd_filename);
 	}
 
-	ret = load_bzimage(kvm, fd_kernel, fd_initrd, kernel_cmdline);
+	ret = load_bzimage(kvm, fd_kernel, fd_initrd, kernel_cmdline, direct);
+	if (!ret && direct)
+		ret = load_elf_pvh(kvm, fd_kernel, fd_initrd, kernel_cmdline);
 
 	if (initrd_filename)
 		close(fd_initrd);
@@ -414,7 +945,8 @@ bool kvm__load_kernel(struct kvm *kvm, const char *kernel_filename,
 	if (ret)
 		goto found_kernel;
 
-	warning("%s is not a bzImage. Trying to load it as a flat binary...", kernel_filename);
+	warning("%s is not a %s. Trying to load it as a flat binary...", kernel_filename,
+		direct ? "bzImage or ELF kernel" : "bzImage");
 
 	ret = load_flat_binary(kvm, fd_kernel);
 	if (ret)
@@ -525,7 +1057,6 @@ static void kvm__setup_fpu(struct kvm *self)
 static void kvm__setup_regs(struct kvm *self)
 {
 	self->regs = (struct kvm_regs) {
-		/* We start the guest in 16-bit real mode  */
 		.rflags		= 0x0000000000000002ULL,
 
 		.rip		= self->boot_ip,
@@ -533,19 +1064,81 @@ static void kvm__setup_regs(struct kvm *self)
 		.rbp		= self->boot_sp,
 	};
 
-	if (self->regs.rip > USHRT_MAX)
-		die("ip 0x%" PRIx64 " is too high for real mode", (uint64_t) self->regs.rip);
+	switch (self->boot_mode) {
+	case KVM_BOOT_REAL_MODE:
+		if (self->regs.rip > USHRT_MAX)
+			die("ip 0x%" PRIx64 " is too high for real mode", (uint64_t) self->regs.rip);
+		break;
+	case KVM_BOOT_64BIT:
+		self->regs.rsi	= self->boot_info;
+		break;
+	case KVM_BOOT_PVH:
+		self->regs.rbx	= self->boot_info;
+		break;
+	}
 
 	if (ioctl(self->vcpu_fd, KVM_SET_REGS, &self->regs) < 0)
 		die_perror("KVM_SET_REGS failed");
 }
 
-static void kvm__setup_sregs(struct kvm *self)
+/* Unpacks a boot_gdt descriptor into the hidden segment state KVM takes */
+static struct kvm_segment boot_gdt_segment(uint16_t selector)
 {
+	uint64_t desc = boot_gdt[selector >> 3];
+	struct kvm_segment seg = {
+		.base		= ((desc >> 16) & 0xffffff) | ((desc >> 56) & 0xff) << 24,
+		.limit		= (desc & 0xffff) | ((desc >> 48) & 0xf) << 16,
+		.selector	= selector,
+		.type		= (desc >> 40) & 0xf,
+		.s		= (desc >> 44) & 0x1,
+		.dpl		= (desc >> 45) & 0x3,
+		.present	= (desc >> 47) & 0x1,
+		.avl		= (desc >> 52) & 0x1,
+		.l		= (desc >> 53) & 0x1,
+		.db		= (desc >> 54) & 0x1,
+		.g		= (desc >> 55) & 0x1,
+	};
 
-	if (ioctl(self->vcpu_fd, KVM_GET_SREGS, &self->sregs) < 0)
-		die_perror("KVM_GET_SREGS failed");
+	/* KVM wants the limit in bytes */
+	if (seg.g)
+		seg.limit	= (seg.limit << 12) | 0xfff;
+
+	return seg;
+}
 
+/*
+ * Flat segments from boot_gdt, and for the 64-bit entry also the identity
+ * mapping and long mode.
+ */
+static void kvm__setup_protected_sregs(struct kvm *self)
+{
+	bool long_mode = self->boot_mode == KVM_BOOT_64BIT;
+
+	self->sregs.gdt.base	= BOOT_GDT_START;
+	self->sregs.gdt.limit	= sizeof(boot_gdt) - 1;
+
+	self->sregs.cs		= boot_gdt_segment(long_mode ? BOOT_GDT_CODE64 : BOOT_GDT_CODE32);
+	self->sregs.ss		= boot_gdt_segment(BOOT_GDT_DATA);
+	self->sregs.ds		= boot_gdt_segment(BOOT_GDT_DATA);
+	self->sregs.es		= boot_gdt_segment(BOOT_GDT_DATA);
+	self->sregs.fs		= boot_gdt_segment(BOOT_GDT_DATA);
+	self->sregs.gs		= boot_gdt_segment(BOOT_GDT_DATA);
+	self->sregs.tr		= boot_gdt_segment(BOOT_GDT_TSS);
+
+	self->sregs.cr0		= X86_CR0_PE | X86_CR0_ET;
+	self->sregs.cr4		= 0;
+	self->sregs.efer	= 0;
+
+	if (long_mode) {
+		self->sregs.cr3		= BOOT_PML4_START;
+		self->sregs.cr4		|= X86_CR4_PAE;
+		self->sregs.cr0		|= X86_CR0_PG;
+		self->sregs.efer	|= EFER_LME | EFER_LMA;
+	}
+}
+
+static void kvm__setup_real_mode_sregs(struct kvm *self)
+{
 	self->sregs.cs.selector	= self->boot_selector;
 	self->sregs.cs.base	= selector_to_base(self->boot_selector);
 	self->sregs.ss.selector	= self->boot_selector;
@@ -558,6 +1151,18 @@ static void kvm__setup_sregs(struct kvm *self)
 	self->sregs.fs.base	= selector_to_base(self->boot_selector);
 	self->sregs.gs.selector	= self->boot_selector;
 	self->sregs.gs.base	= selector_to_base(self->boot_selector);
+}
+
+static void kvm__setup_sregs(struct kvm *self)
+{
+
+	if (ioctl(self->vcpu_fd, KVM_GET_SREGS, &self->sregs) < 0)
+		die_perror("KVM_GET_SREGS failed");
+
+	if (self->boot_mode == KVM_BOOT_REAL_MODE)
+		kvm__setup_real_mode_sregs(self);
+	else
+		kvm__setup_protected_sregs(self);
 
 	if (ioctl(self->vcpu_fd, KVM_SET_SREGS, &self->sregs) < 0)
 		die_perror("KVM_SET_SREGS failed");
@@ -576,34 +1181,11 @@ void kvm__reset_vcpu(struct kvm *self)
 
 void kvm__setup_mem(struct kvm *self)
 {
-	struct e820_entry *mem_map;
 	unsigned char *size;
 
 	size		= guest_flat_to_host(self, E820_MAP_SIZE);
-	mem_map		= guest_flat_to_host(self, E820_MAP_START);
-
-	*size		= 4;
 
-	mem_map[0]	= (struct e820_entry) {
-		.addr		= REAL_MODE_IVT_BEGIN,
-		.size		= EBDA_START - REAL_MODE_IVT_BEGIN,
-		.type		= E820_MEM_USABLE,
-	};
-	mem_map[1]	= (struct e820_entry) {
-		.addr		= EBDA_START,
-		.size		= VGA_RAM_BEGIN - EBDA_START,
-		.type		= E820_MEM_RESERVED,
-	};
-	mem_map[2]	= (struct e820_entry) {
-		.addr		= MB_BIOS_BEGIN,
-		.size		= MB_BIOS_END - MB_BIOS_BEGIN,
-		.type		= E820_MEM_RESERVED,
-	};
-	mem_map[3]	= (struct e820_entry) {
-		.addr		= BZ_KERNEL_START,
-		.size		= self->ram_size - BZ_KERNEL_START,
-		.type		= E820_MEM_USABLE,
-	};
+	*size		= kvm__e820_map(self, guest_flat_to_host(self, E820_MAP_START));
 }
 
 void kvm__run(struct kvm *self)
@@ -1,8 +1,19 @@
 #include "kvm/kvm.h"
 
 #include "kvm/8250-serial.h"
+#include "kvm/9p-virtio.h"
 #include "kvm/blk-virtio.h"
+#include "kvm/blk-trace.h"
+#include "kvm/boot-trace.h"
+#include "kvm/compressed-image.h"
 #include "kvm/disk-image.h"
+#include "kvm/control.h"
+#include "kvm/console-virtio.h"
+#include "kvm/boot-profile.h"
+#include "kvm/console.h"
+#include "kvm/marker.h"
+#include "kvm/pmem-virtio.h"
+#include "kvm/shared-cache.h"
 #include "kvm/util.h"
 #include "kvm/pci.h"
 
@@ -21,9 +32,14 @@ extern bool ioport_debug;
 static void usage(char *argv[])
 {
 	fprintf(stderr, "  usage: %s "
-		"[--single-step] [--ioport-debug] "
+		"[--single-step] [--ioport-debug] [--direct-boot] "
 		"[--kvm-dev=<device>] [--mem=<size-in-MiB>] [--params=<kernel-params>] "
-		"[--initrd=<initrd>] [--kernel=]<kernel-image> [--image=]<disk-image>\n",
+		"[--initrd=<initrd>] [--kernel=]<kernel-image> [--image=<disk-image>[,cache=none]...] "
+		"[--blk-poll=<idle-usecs>] [--blk-irq-coalesce=<max-completions>,<max-delay-usecs>] "
+		"[--blk-throttle=<key>=<rate>[:<burst>][,...]] [--blk-stats] [--blk-trace=<file>] [--image-cache=<size-in-MiB>] "
+		"[--boot-trace[=<record-secs>]] [--boot-profile[=<trace.json>]] "
+		"[--shared-cache=<name>[,<size-in-MiB>]] [--pmem=<file>] [--9p=<dir>[,<tag>]] [--control=<socket>] "
+		"[--console-log=<file>] [--marker-log=<file>] [--serial=<0-3>,<stdio|none|pty|unix:<socket>|file>...] [--virtio-console=[<name>:]<stdio|file>...]\n",
 		argv[0]);
 	exit(1);
 }
@@ -86,60 +102,57 @@ static void handle_sigquit(int sig)
 
 static char real_cmdline[2048];
 
-static bool option_matches(char *arg, const char *option)
+#define BOOT_TRACE_DEFAULT_SECS	30
+
+/*
+ * Strips the options following the image file name and returns whether the
+ * image bypasses the host page cache.
+ */
+static bool parse_image_options(char *arg)
 {
-	return !strncmp(arg, option, strlen(option));
-}
+	char *opt = strchr(arg, ',');
 
-#define TIMER_INTERVAL_NS 1000000	/* 1 msec */
+	if (!opt)
+		return false;
 
-static void alarm_handler(int sig)
-{
+	*opt++	= '\0';
+
+	if (!strcmp(opt, "cache=none"))
+		return true;
+
+	die("Unknown disk image option: %s", opt);
 }
 
-/*
- * This function sets up a timer that's used to inject interrupts from the
- * userspace hypervisor into the guest at periodical intervals. Please note
- * that clock interrupt, for example, is not handled here.
- */
-static void setup_timer(void)
+static bool option_matches(char *arg, const char *option)
 {
-	struct itimerspec its;
-	struct sigaction sa;
-	struct sigevent sev;
-	timer_t timerid;
-
-	sigfillset(&sa.sa_mask);
-	sa.sa_flags			= 0;
-	sa.sa_handler			= alarm_handler;
-
-	sigaction(SIGALRM, &sa, NULL);
-
-	memset(&sev, 0, sizeof(struct sigevent));
-	sev.sigev_value.sival_int	= 0;
-	sev.sigev_notify		= SIGEV_SIGNAL;
-	sev.sigev_signo			= SIGALRM;
-
-	its.it_value.tv_sec		= TIMER_INTERVAL_NS / 1000000000;
-	its.it_value.tv_nsec		= TIMER_INTERVAL_NS % 1000000000;
-	its.it_interval.tv_sec		= its.it_value.tv_sec;
-	its.it_interval.tv_nsec		= its.it_value.tv_nsec;
-	if (timer_create(CLOCK_MONOTONIC, &sev, &timerid) < 0)
-		die("timer_create()");
-
-	if (timer_settime(timerid, 0, &its, NULL) < 0)
-		die("timer_settime()");
+	return !strncmp(arg, option, strlen(option));
 }
 
 int main(int argc, char *argv[])
 {
 	const char *kernel_filename = NULL;
 	const char *initrd_filename = NULL;
-	const char *image_filename = NULL;
+	const char *image_filenames[MAX_DISK_IMAGES];
+	bool image_direct[MAX_DISK_IMAGES];
+	int nr_images = 0;
 	const char *kernel_cmdline = NULL;
+	const char *control_path = NULL;
+	const char *console_log = NULL;
+	const char *marker_log = NULL;
+	const char *pmem_filename = NULL;
+	const char *p9_root = NULL;
+	const char *p9_tag = P9_DEFAULT_TAG;
 	const char *kvm_dev = "/dev/kvm";
+	struct blk_virtio_params blk_params = { };
 	unsigned long ram_size = 64UL << 20;
+	unsigned int boot_trace_secs = 0;
+	const char *boot_profile_json = NULL;
+	bool boot_profile = false;
+	const char *shared_cache_name = NULL;
+	unsigned long shared_cache_mb = SHARED_CACHE_DEFAULT_MB;
+	struct shared_cache *shared_cache = NULL;
 	bool single_step = false;
+	bool direct_boot = false;
 	int i;
 
 	tty_save_origins();
@@ -154,7 +167,10 @@ int main(int argc, char *argv[])
 			kernel_filename	= &argv[i][9];
 			continue;
 		} else if (option_matches(argv[i], "--image=")) {
-			image_filename	= &argv[i][8];
+			if (nr_images == MAX_DISK_IMAGES)
+				die("Too many disk images (max %d)", MAX_DISK_IMAGES);
+			image_direct[nr_images]		= parse_image_options(&argv[i][8]);
+			image_filenames[nr_images++]	= &argv[i][8];
 			continue;
 		} else if (option_matches(argv[i], "--initrd=")) {
 			initrd_filename	= &argv[i][9];
@@ -168,6 +184,9 @@ int main(int argc, char *argv[])
 		} else if (option_matches(argv[i], "--single-step")) {
 			single_step	= true;
 			continue;
+		} else if (option_matches(argv[i], "--direct-boot")) {
+			direct_boot	= true;
+			continue;
 		} else if (option_matches(argv[i], "--mem=")) {
 			unsigned long val = atol(&argv[i][6]) << 20;
 			if (val < ram_size)
@@ -175,6 +194,77 @@ int main(int argc, char *argv[])
 					argv[i], ram_size >> 20);
 			ram_size = val;
 			continue;
+		} else if (option_matches(argv[i], "--blk-poll=")) {
+			blk_params.poll_idle_us	= atol(&argv[i][11]);
+			continue;
+		} else if (option_matches(argv[i], "--blk-irq-coalesce=")) {
+			if (sscanf(&argv[i][19], "%u,%u", &blk_params.irq_max_pending,
+						&blk_params.irq_max_delay_us) != 2)
+				die("Invalid interrupt coalescing parameters: %s", argv[i]);
+			continue;
+		} else if (option_matches(argv[i], "--blk-throttle=")) {
+			if (!throttle__parse_limits(&blk_params.throttle, &argv[i][15]))
+				die("Invalid I/O limits: %s", argv[i]);
+			continue;
+		} else if (option_matches(argv[i], "--blk-stats")) {
+			blk_params.dump_stats	= true;
+			continue;
+		} else if (option_matches(argv[i], "--blk-trace=")) {
+			blk_params.trace	= blk_trace__create(&argv[i][12]);
+			continue;
+		} else if (option_matches(argv[i], "--image-cache=")) {
+			compressed_image_cache_mb	= atol(&argv[i][14]);
+			continue;
+		} else if (option_matches(argv[i], "--boot-trace=")) {
+			boot_trace_secs	= atoi(&argv[i][13]);
+			continue;
+		} else if (option_matches(argv[i], "--boot-trace")) {
+			boot_trace_secs	= BOOT_TRACE_DEFAULT_SECS;
+			continue;
+		} else if (option_matches(argv[i], "--boot-profile=")) {
+			boot_profile		= true;
+			boot_profile_json	= &argv[i][15];
+			continue;
+		} else if (option_matches(argv[i], "--boot-profile")) {
+			boot_profile		= true;
+			continue;
+		} else if (option_matches(argv[i], "--shared-cache=")) {
+			char *size = strchr(&argv[i][15], ',');
+
+			shared_cache_name	= &argv[i][15];
+			if (size) {
+				*size++			= '\0';
+				shared_cache_mb		= atol(size);
+			}
+			continue;
+		} else if (option_matches(argv[i], "--pmem=")) {
+			pmem_filename	= &argv[i][7];
+			continue;
+		} else if (option_matches(argv[i], "--9p=")) {
+			char *tag = strchr(&argv[i][5], ',');
+
+			p9_root		= &argv[i][5];
+			if (tag) {
+				*tag++		= '\0';
+				p9_tag		= tag;
+			}
+			continue;
+		} else if (option_matches(argv[i], "--control=")) {
+			control_path	= &argv[i][10];
+			continue;
+		} else if (option_matches(argv[i], "--console-log=")) {
+			console_log	= &argv[i][14];
+			continue;
+		} else if (option_matches(argv[i], "--marker-log=")) {
+			marker_log	= &argv[i][13];
+			continue;
+		} else if (option_matches(argv[i], "--serial=")) {
+			if (!serial8250__set_backend(&argv[i][9]))
+				die("Invalid serial port: %s", argv[i]);
+			continue;
+		} else if (option_matches(argv[i], "--virtio-console=")) {
+			console_virtio__add_port(&argv[i][17]);
+			continue;
 		} else if (option_matches(argv[i], "--ioport-debug")) {
 			ioport_debug	= true;
 			continue;
@@ -191,13 +281,34 @@ int main(int argc, char *argv[])
 	if (!kernel_filename)
 		usage(argv);
 
+	marker__init(marker_log);
+
+	if (boot_profile)
+		boot_profile__init(boot_profile_json);
+
+	boot_profile__begin("kvm__init");
 	kvm = kvm__init(kvm_dev, ram_size);
+	boot_profile__end();
 
-	if (image_filename) {
-		kvm->disk_image	= disk_image__open(image_filename);
-		if (!kvm->disk_image)
-			die("unable to load disk image %s", image_filename);
+	if (shared_cache_name)
+		shared_cache	= shared_cache__attach(shared_cache_name, shared_cache_mb);
+
+	boot_profile__begin("open disk images");
+	for (i = 0; i < nr_images; i++) {
+		kvm->disks[i]	= disk_image__open(image_filenames[i], image_direct[i]);
+		if (!kvm->disks[i])
+			die("unable to load disk image %s", image_filenames[i]);
+
+		if (boot_trace_secs)
+			boot_trace__start(kvm->disks[i], image_filenames[i], boot_trace_secs);
+
+		if (shared_cache && image_direct[i])
+			warning("%s: cache=none images don't use the shared cache", image_filenames[i]);
+		else if (shared_cache && !shared_cache__add_image(shared_cache, kvm->disks[i]))
+			die("unable to add disk image %s to the shared cache", image_filenames[i]);
 	}
+	kvm->nr_disks	= nr_images;
+	boot_profile__end();
 
 	kvm__setup_cpuid(kvm);
 
@@ -207,8 +318,10 @@ int main(int argc, char *argv[])
 		real_cmdline[sizeof(real_cmdline)-1] = '\0';
 	}
 
-	if (!kvm__load_kernel(kvm, kernel_filename, initrd_filename, real_cmdline))
+	boot_profile__begin("load kernel");
+	if (!kvm__load_kernel(kvm, kernel_filename, initrd_filename, real_cmdline, direct_boot))
 		die("unable to load kernel %s", kernel_filename);
+	boot_profile__end();
 
 	kvm__reset_vcpu(kvm);
 
@@ -217,18 +330,36 @@ int main(int argc, char *argv[])
 	if (single_step)
 		kvm__enable_singlestep(kvm);
 
-	serial8250__init();
+	boot_profile__begin("device init");
+
+	console__init(console_log);
+
+	console_virtio__init(kvm);
+	serial8250__init(kvm);
 	pci__init();
 
-	blk_virtio__init(kvm);
+	blk_virtio__init(kvm, &blk_params);
+
+	if (pmem_filename)
+		pmem_virtio__init(kvm, pmem_filename);
 
-	setup_timer();
+	if (p9_root)
+		p9_virtio__init(kvm, p9_root, p9_tag);
+
+	if (control_path && !control__init(kvm, control_path))
+		die("unable to create control socket %s", control_path);
+
+	boot_profile__end();
 
 	tty_set_canon_flag(fileno(stdin), 1);
 
+	boot_profile__event(BOOT_PROFILE_FIRST_RUN);
+
 	for (;;) {
 		kvm__run(kvm);
 
+		kvm__drain_coalesced(kvm);
+
 		switch (kvm->kvm_run->exit_reason) {
 		case KVM_EXIT_DEBUG:
 			kvm__show_registers(kvm);
@@ -261,16 +392,15 @@ int main(int argc, char *argv[])
 				goto exit_kvm;
 			break;
 		}
-		case KVM_EXIT_INTR: {
-			serial8250__interrupt(kvm);
+		case KVM_EXIT_INTR:
 			break;
-		}
 		default:
 			goto exit_kvm;
 		}
 	}
 
 exit_kvm:
+	console__flush();
 
 	fprintf(stderr, "KVM exit reason: %" PRIu32 " (\"%s\")\n",
 		kvm->kvm_run->exit_reason, kvm_exit_reasons[kvm->kvm_run->exit_reason]);
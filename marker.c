@@ -0,0 +1,109 @@
+#include "kvm/marker.h"
+
+#include "kvm/boot-profile.h"
+#include "kvm/util.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+struct marker {
+	/* Index + 1 once the entry is complete, 0 while it is written */
+	uint64_t		seq;
+	uint64_t		time_ns;
+	uint64_t		tsc;
+	uint16_t		id;
+};
+
+/*
+ * Writers claim a slot with an atomic increment of head and publish it by
+ * setting its sequence number last, so recording never takes a lock. When
+ * the ring wraps the oldest markers are overwritten.
+ */
+static struct {
+	uint64_t		head;
+	uint64_t		start_ns;
+	const char		*log_path;
+	struct marker		ring[MARKER_RING_SIZE];
+} markers;
+
+void marker__record(uint16_t id)
+{
+	uint64_t tsc = rdtsc(), ns = clock_ns();
+	struct marker *m;
+	uint64_t idx;
+
+	idx		= __sync_fetch_and_add(&markers.head, 1);
+	m		= &markers.ring[idx % MARKER_RING_SIZE];
+
+	m->seq		= 0;
+	__sync_synchronize();
+
+	m->time_ns	= ns - markers.start_ns;
+	m->tsc		= tsc;
+	m->id		= id;
+
+	__sync_synchronize();
+	m->seq		= idx + 1;
+
+	boot_profile__event(BOOT_PROFILE_FIRST_MARKER);
+}
+
+/* One line per marker: id, time since start and since the previous one, TSC */
+static void marker__exit(void)
+{
+	uint64_t head = markers.head, idx, prev_ns = 0, lost;
+	struct marker *m;
+	FILE *f = stderr;
+
+	if (!head)
+		return;
+
+	if (markers.log_path) {
+		f	= fopen(markers.log_path, "w");
+		if (!f) {
+			warning("Unable to write markers to %s", markers.log_path);
+			return;
+		}
+	}
+
+	idx	= head > MARKER_RING_SIZE ? head - MARKER_RING_SIZE : 0;
+	lost	= idx;
+
+	fprintf(f, "# marker time_ns delta_ns tsc\n");
+
+	for (; idx < head; idx++) {
+		m	= &markers.ring[idx % MARKER_RING_SIZE];
+
+		/* Still being written by a vCPU, or already overwritten */
+		if (m->seq != idx + 1) {
+			lost++;
+			continue;
+		}
+
+		fprintf(f, "%" PRIu16 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+			m->id, m->time_ns, m->time_ns - prev_ns, m->tsc);
+
+		prev_ns	= m->time_ns;
+	}
+
+	if (lost)
+		fprintf(f, "# %" PRIu64 " earlier markers lost\n", lost);
+
+	if (markers.log_path) {
+		if (fclose(f) != 0)
+			warning("Unable to write markers to %s", markers.log_path);
+		else
+			info("Recorded %" PRIu64 " markers to %s", head - lost, markers.log_path);
+	}
+}
+
+/* Marker times count from here; without a log file they go to stderr */
+void marker__init(const char *log_path)
+{
+	markers.start_ns	= clock_ns();
+	markers.log_path	= log_path;
+
+	atexit(marker__exit);
+}
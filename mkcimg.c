@@ -0,0 +1,88 @@
+/*
+ * Converts a raw disk image to the compressed image format.
+ */
+#include "kvm/compressed-image.h"
+
+#include "kvm/util.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+static void usage(char *argv[])
+{
+	fprintf(stderr, "  usage: %s [--codec=zlib|zstd] [--chunk-shift=<shift>] <raw-image> <compressed-image>\n",
+		argv[0]);
+	exit(1);
+}
+
+static uint32_t parse_codec(const char *name)
+{
+	uint32_t codec;
+
+	if (!strcmp(name, "zlib"))
+		codec	= COMPRESSED_IMAGE_ZLIB;
+	else if (!strcmp(name, "zstd"))
+		codec	= COMPRESSED_IMAGE_ZSTD;
+	else
+		die("Unknown codec: %s", name);
+
+	if (!compressed_image__codec_supported(codec))
+		die("Codec %s is not supported by this build", name);
+
+	return codec;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *src_filename = NULL, *dst_filename = NULL;
+	uint32_t codec = COMPRESSED_IMAGE_ZLIB;
+	uint32_t chunk_shift = 16;
+	int src_fd, dst_fd;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (!strncmp(argv[i], "--codec=", 8))
+			codec		= parse_codec(&argv[i][8]);
+		else if (!strncmp(argv[i], "--chunk-shift=", 14))
+			chunk_shift	= atoi(&argv[i][14]);
+		else if (argv[i][0] == '-')
+			usage(argv);
+		else if (!src_filename)
+			src_filename	= argv[i];
+		else if (!dst_filename)
+			dst_filename	= argv[i];
+		else
+			usage(argv);
+	}
+
+	if (!src_filename || !dst_filename)
+		usage(argv);
+
+	src_fd	= open(src_filename, O_RDONLY);
+	if (src_fd < 0)
+		die("Unable to open %s", src_filename);
+
+	dst_fd	= open(dst_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (dst_fd < 0)
+		die("Unable to create %s", dst_filename);
+
+	if (compressed_image__create(src_fd, dst_fd, codec, chunk_shift) < 0) {
+		int err = errno;
+
+		/* Don't leave a half written image behind */
+		unlink(dst_filename);
+
+		die("Unable to write %s: %s", dst_filename, strerror(err));
+	}
+
+	if (close(dst_fd) < 0)
+		die_perror("close");
+
+	close(src_fd);
+
+	return 0;
+}
@@ -10,8 +10,19 @@ static const char *to_direction(uint8_t is_write)
 	return "read";
 }
 
+/*
+ * Guests tend to poll whatever they probe, so only the first of a run of
+ * accesses to the same page is reported.
+ */
+static uint64_t last_warned_page = ~0ULL;
+
 bool kvm__emulate_mmio(struct kvm *self, uint64_t phys_addr, uint8_t *data, uint32_t len, uint8_t is_write)
 {
+	if (phys_addr >> 12 == last_warned_page)
+		return true;
+
+	last_warned_page	= phys_addr >> 12;
+
 	fprintf(stderr, "Warning: Ignoring MMIO %s at %016" PRIx64 " (length %" PRIu32 ")\n",
 		to_direction(is_write), phys_addr, len);
 
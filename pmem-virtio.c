@@ -0,0 +1,254 @@
+#include "kvm/pmem-virtio.h"
+
+#include "kvm/virtio-pci-dev.h"
+#include "kvm/virtio_pmem.h"
+#include "kvm/virtio_pci.h"
+#include "kvm/virtio.h"
+#include "kvm/ioport.h"
+#include "kvm/util.h"
+#include "kvm/kvm.h"
+#include "kvm/pci.h"
+
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <fcntl.h>
+
+#define VIRTIO_PMEM_QUEUE_SIZE	16
+#define VIRTIO_PMEM_IRQ		9
+
+/* The region goes above RAM and the 32-bit PCI hole, 1 GiB aligned */
+#define VIRTIO_PMEM_MIN_ADDR	(1ULL << 32)
+#define VIRTIO_PMEM_ADDR_ALIGN	(1ULL << 30)
+
+/* The guest maps the region with memory hotplug which wants 2 MiB pieces */
+#define VIRTIO_PMEM_SIZE_ALIGN	(2ULL << 20)
+
+struct pmem_device {
+	struct kvm			*kvm;
+	int				fd;
+	void				*mem;
+
+	struct virtio_pmem_config	pmem_config;
+	uint32_t			host_features;
+	uint32_t			guest_features;
+	uint8_t				status;
+
+	/* The request queue only carries flushes */
+	struct virt_queue		queue;
+
+	struct pci_device_header	pci_header;
+
+	/* Flushes can take a while, so they are done by a separate thread */
+	pthread_t			flush_thread;
+	int				flush_efd;
+};
+
+static struct pmem_device pmem_device;
+
+static bool pmem_virtio_in(struct kvm *self, uint16_t port, void *data, int size, uint32_t count)
+{
+	unsigned long offset = port - IOPORT_VIRTIO_PMEM;
+
+	switch (offset) {
+	case VIRTIO_PCI_HOST_FEATURES:
+		ioport__write32(data, pmem_device.host_features);
+		break;
+	case VIRTIO_PCI_GUEST_FEATURES:
+		return false;
+	case VIRTIO_PCI_QUEUE_PFN:
+		ioport__write32(data, pmem_device.queue.pfn);
+		break;
+	case VIRTIO_PCI_QUEUE_NUM:
+		ioport__write16(data, VIRTIO_PMEM_QUEUE_SIZE);
+		break;
+	case VIRTIO_PCI_QUEUE_SEL:
+	case VIRTIO_PCI_QUEUE_NOTIFY:
+		return false;
+	case VIRTIO_PCI_STATUS:
+		ioport__write8(data, pmem_device.status);
+		break;
+	case VIRTIO_PCI_ISR:
+		virtio_pci__isr_in(self, data, VIRTIO_PMEM_IRQ);
+		break;
+	default:
+		return virtio_pci__config_in(data, offset, size, count, &pmem_device.pmem_config,
+					     sizeof(pmem_device.pmem_config));
+	};
+
+	return true;
+}
+
+static bool pmem_virtio_flush(struct kvm *self, uint16_t head)
+{
+	struct virtio_pmem_resp *resp;
+	struct vring_desc *desc;
+	int ret;
+
+	if (head >= pmem_device.queue.vring.num)
+		return false;
+
+	/* request */
+	desc		= &pmem_device.queue.vring.desc[head];
+	if (!(desc->flags & VRING_DESC_F_NEXT) || desc->next >= pmem_device.queue.vring.num)
+		return false;
+
+	/* response */
+	desc		= &pmem_device.queue.vring.desc[desc->next];
+	if (desc->len < sizeof(*resp))
+		return false;
+
+	/* Guest stores to the region are in the page cache of the file */
+	ret		= fsync(pmem_device.fd);
+	if (ret < 0)
+		warning("virtio-pmem: fsync() failed");
+
+	resp		= guest_flat_to_host(self, desc->addr);
+	resp->ret	= ret < 0 ? 1 : 0;
+
+	return true;
+}
+
+static int pmem_virtio_request_queue(struct kvm *self)
+{
+	struct virt_queue *queue = &pmem_device.queue;
+	int head, nr;
+
+	for (nr = 0; (head = virt_queue__pop(queue)) >= 0; nr++) {
+		if (!pmem_virtio_flush(self, head)) {
+			warning("virtio-pmem: malformed request");
+			return -1;
+		}
+
+		virt_queue__set_used(queue, nr, head, sizeof(struct virtio_pmem_resp));
+	}
+
+	virt_queue__publish_used(queue, nr);
+
+	return nr;
+}
+
+static void *pmem_virtio__flush_thread(void *arg)
+{
+	struct kvm *self = arg;
+	eventfd_t kicks;
+
+	prctl(PR_SET_NAME, "kvm-pmem");
+
+	for (;;) {
+		if (eventfd_read(pmem_device.flush_efd, &kicks) < 0) {
+			if (errno == EINTR)
+				continue;
+			die_perror("eventfd_read");
+		}
+
+		if (!pmem_device.queue.pfn)
+			continue;
+
+		if (pmem_virtio_request_queue(self) > 0)
+			kvm__irq_line(self, VIRTIO_PMEM_IRQ, 1);
+	}
+
+	return NULL;
+}
+
+static bool pmem_virtio_out(struct kvm *self, uint16_t port, void *data, int size, uint32_t count)
+{
+	unsigned long offset = port - IOPORT_VIRTIO_PMEM;
+
+	switch (offset) {
+	case VIRTIO_PCI_GUEST_FEATURES:
+		pmem_device.guest_features	= ioport__read32(data);
+		break;
+	case VIRTIO_PCI_QUEUE_PFN:
+		virt_queue__init(self, &pmem_device.queue, ioport__read32(data), VIRTIO_PMEM_QUEUE_SIZE);
+		break;
+	case VIRTIO_PCI_QUEUE_SEL:
+		if (ioport__read16(data) != 0)
+			return false;
+		break;
+	case VIRTIO_PCI_QUEUE_NOTIFY:
+		if (ioport__read16(data) != 0)
+			return false;
+
+		if (eventfd_write(pmem_device.flush_efd, 1) < 0)
+			die_perror("eventfd_write");
+		break;
+	case VIRTIO_PCI_STATUS:
+		pmem_device.status	= ioport__read8(data);
+		break;
+	default:
+		return false;
+	};
+
+	return true;
+}
+
+static struct ioport_operations pmem_virtio_io_ops = {
+	.io_in		= pmem_virtio_in,
+	.io_out		= pmem_virtio_out,
+};
+
+static struct pci_device_header pmem_virtio_pci_template = {
+	.vendor_id		= PCI_VENDOR_ID_REDHAT_QUMRANET,
+	.device_id		= PCI_DEVICE_ID_VIRTIO_PMEM,
+	.header_type		= PCI_HEADER_TYPE_NORMAL,
+	.revision_id		= 0,
+	.class			= 0x058000,
+	.subsys_vendor_id	= PCI_SUBSYSTEM_VENDOR_ID_REDHAT_QUMRANET,
+	.subsys_id		= PCI_SUBSYSTEM_ID_VIRTIO_PMEM,
+	.bar[0]			= IOPORT_VIRTIO_PMEM | PCI_BASE_ADDRESS_SPACE_IO,
+	.irq_pin		= 1,
+	.irq_line		= VIRTIO_PMEM_IRQ,
+};
+
+/*
+ * Maps @filename shared into a memory slot of its own, so guest accesses to
+ * the region go straight to the host page cache of the file without exits.
+ */
+void pmem_virtio__init(struct kvm *self, const char *filename)
+{
+	uint64_t guest_phys;
+	struct stat st;
+
+	pmem_device.fd	= open(filename, O_RDWR);
+	if (pmem_device.fd < 0)
+		die("unable to open %s", filename);
+
+	if (fstat(pmem_device.fd, &st) < 0)
+		die_perror("fstat");
+
+	if (!st.st_size || st.st_size % VIRTIO_PMEM_SIZE_ALIGN)
+		die("%s: size must be a non-zero multiple of 2 MiB", filename);
+
+	pmem_device.mem	= mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, pmem_device.fd, 0);
+	if (pmem_device.mem == MAP_FAILED)
+		die_perror("mmap");
+
+	guest_phys	= (self->ram_size + VIRTIO_PMEM_ADDR_ALIGN - 1) & ~(VIRTIO_PMEM_ADDR_ALIGN - 1);
+	if (guest_phys < VIRTIO_PMEM_MIN_ADDR)
+		guest_phys	= VIRTIO_PMEM_MIN_ADDR;
+
+	kvm__register_mem(self, guest_phys, st.st_size, pmem_device.mem);
+
+	pmem_device.kvm			= self;
+	pmem_device.pmem_config		= (struct virtio_pmem_config) {
+		.start			= guest_phys,
+		.size			= st.st_size,
+	};
+	pmem_device.pci_header		= pmem_virtio_pci_template;
+
+	pmem_device.flush_efd	= eventfd(0, 0);
+	if (pmem_device.flush_efd < 0)
+		die_perror("eventfd");
+
+	if (pthread_create(&pmem_device.flush_thread, NULL, pmem_virtio__flush_thread, self) != 0)
+		die("unable to create virtio-pmem flush thread");
+
+	pci__register(&pmem_device.pci_header, VIRTIO_PMEM_PCI_SLOT);
+
+	ioport__register(IOPORT_VIRTIO_PMEM, &pmem_virtio_io_ops, IOPORT_VIRTIO_PMEM_SIZE);
+}
@@ -0,0 +1,468 @@
+#include "kvm/shared-cache.h"
+
+#include "kvm/disk-image.h"
+#include "kvm/barrier.h"
+#include "kvm/util.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+
+#define SHARED_CACHE_MAGIC	"KVMSHC1"
+#define SHARED_CACHE_WAYS	8
+
+/* Largest run of missing blocks read from the image at once */
+#define SHARED_CACHE_MAX_RUN	64
+
+struct shared_cache_header {
+	char			magic[8];
+	uint32_t		block_size;
+	uint32_t		ways;
+	uint64_t		nr_slots;
+};
+
+/*
+ * Each slot is protected by a sequence count which is odd while a writer
+ * fills the slot in. Readers copy the block out and treat a sequence change
+ * as a miss. Writers claim a slot by making the count odd with a
+ * compare-and-swap, and give up if somebody else got there first.
+ *
+ * While a slot is claimed the upper half of the count holds the pid of the
+ * writer, so that a claim left behind by a VMM that was killed halfway
+ * through an insert can be taken over instead of losing the slot for good.
+ */
+#define SHARED_CACHE_OWNER_SHIFT	32
+
+struct shared_cache_slot {
+	uint64_t		seq;
+	uint64_t		image_id;
+	uint64_t		block;
+	uint64_t		pad;
+};
+
+struct shared_cache {
+	struct shared_cache_header	*header;
+	struct shared_cache_slot	*slots;
+	void				*data;
+	uint64_t			nr_buckets;
+	size_t				size;
+};
+
+struct shared_cache_image {
+	struct shared_cache	*cache;
+	uint64_t		id;
+	uint64_t		nr_blocks;
+	unsigned long		*dirty;		/* blocks written by this guest */
+};
+
+static uint64_t hash64(uint64_t x)
+{
+	x	^= x >> 33;
+	x	*= 0xff51afd7ed558ccdULL;
+	x	^= x >> 33;
+	x	*= 0xc4ceb9fe1a85ec53ULL;
+	x	^= x >> 33;
+
+	return x;
+}
+
+static struct shared_cache_slot *shared_cache__bucket(struct shared_cache *self, uint64_t image_id, uint64_t block)
+{
+	uint64_t bucket = hash64(image_id ^ hash64(block)) % self->nr_buckets;
+
+	return &self->slots[bucket * SHARED_CACHE_WAYS];
+}
+
+static void *shared_cache__slot_data(struct shared_cache *self, struct shared_cache_slot *slot)
+{
+	return self->data + ((slot - self->slots) << SHARED_CACHE_BLOCK_SHIFT);
+}
+
+static bool shared_cache__lookup(struct shared_cache *self, uint64_t image_id, uint64_t block, void *buf)
+{
+	struct shared_cache_slot *slot = shared_cache__bucket(self, image_id, block);
+	uint64_t seq;
+	int i;
+
+	for (i = 0; i < SHARED_CACHE_WAYS; i++, slot++) {
+		seq	= __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		if (__atomic_load_n(&slot->image_id, __ATOMIC_RELAXED) != image_id ||
+		    __atomic_load_n(&slot->block, __ATOMIC_RELAXED) != block)
+			continue;
+
+		if (!buf)
+			return true;
+
+		memcpy(buf, shared_cache__slot_data(self, slot), SHARED_CACHE_BLOCK_SIZE);
+
+		rmb();
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+			return false;
+
+		return true;
+	}
+
+	return false;
+}
+
+static bool shared_cache__owner_dead(uint64_t seq)
+{
+	pid_t owner = seq >> SHARED_CACHE_OWNER_SHIFT;
+
+	return owner && kill(owner, 0) < 0 && errno == ESRCH;
+}
+
+static void shared_cache__insert(struct shared_cache *self, uint64_t image_id, uint64_t block, void *buf)
+{
+	static unsigned int victim_seed;
+	struct shared_cache_slot *bucket = shared_cache__bucket(self, image_id, block);
+	struct shared_cache_slot *slot = NULL;
+	uint64_t seq, claim;
+	int i;
+
+	for (i = 0; i < SHARED_CACHE_WAYS; i++) {
+		if (__atomic_load_n(&bucket[i].image_id, __ATOMIC_RELAXED) == image_id &&
+		    __atomic_load_n(&bucket[i].block, __ATOMIC_RELAXED) == block)
+			return;
+
+		if (!slot && !__atomic_load_n(&bucket[i].image_id, __ATOMIC_RELAXED))
+			slot	= &bucket[i];
+	}
+
+	if (!slot)
+		slot	= &bucket[__sync_fetch_and_add(&victim_seed, 1) % SHARED_CACHE_WAYS];
+
+	seq	= __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+	if (seq & 1) {
+		if (!shared_cache__owner_dead(seq))
+			return;
+
+		/* Take the dead writer's claim over, the count stays odd */
+		claim	= (uint32_t) (seq + 2);
+	} else
+		claim	= (uint32_t) (seq + 1);
+
+	claim	|= (uint64_t) getpid() << SHARED_CACHE_OWNER_SHIFT;
+
+	if (!__atomic_compare_exchange_n(&slot->seq, &seq, claim, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	wmb();
+
+	__atomic_store_n(&slot->image_id, image_id, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->block, block, __ATOMIC_RELAXED);
+	memcpy(shared_cache__slot_data(self, slot), buf, SHARED_CACHE_BLOCK_SIZE);
+
+	__atomic_store_n(&slot->seq, (uint32_t) (claim + 1), __ATOMIC_RELEASE);
+}
+
+static bool shared_cache__is_dirty(struct shared_cache_image *self, uint64_t block)
+{
+	unsigned long word = __atomic_load_n(&self->dirty[block / BITS_PER_LONG], __ATOMIC_RELAXED);
+
+	return word & (1UL << (block % BITS_PER_LONG));
+}
+
+void shared_cache__written(struct shared_cache_image *self, uint64_t sector, uint64_t len)
+{
+	uint64_t offset = sector << SECTOR_SHIFT;
+	uint64_t block, end;
+
+	if (!len)
+		return;
+
+	end	= MIN((offset + len - 1) >> SHARED_CACHE_BLOCK_SHIFT, self->nr_blocks - 1);
+
+	for (block = offset >> SHARED_CACHE_BLOCK_SHIFT; block <= end; block++)
+		__atomic_fetch_or(&self->dirty[block / BITS_PER_LONG], 1UL << (block % BITS_PER_LONG), __ATOMIC_RELAXED);
+}
+
+static void iov_copy_to(const struct iovec **iov, size_t *iov_off, void *buf, size_t len)
+{
+	while (len) {
+		size_t n = MIN(len, (*iov)->iov_len - *iov_off);
+
+		memcpy((*iov)->iov_base + *iov_off, buf, n);
+
+		buf		+= n;
+		len		-= n;
+		*iov_off	+= n;
+
+		if (*iov_off == (*iov)->iov_len) {
+			(*iov)++;
+			*iov_off	= 0;
+		}
+	}
+}
+
+static pthread_key_t run_buf_key;
+static pthread_once_t run_buf_once = PTHREAD_ONCE_INIT;
+
+static void shared_cache__run_buf_key_init(void)
+{
+	if (pthread_key_create(&run_buf_key, free))
+		die("pthread_key_create");
+}
+
+/* Reads come from several I/O threads, each gets a buffer for its runs */
+static void *shared_cache__run_buf(void)
+{
+	void *buf;
+
+	pthread_once(&run_buf_once, shared_cache__run_buf_key_init);
+
+	buf	= pthread_getspecific(run_buf_key);
+	if (buf)
+		return buf;
+
+	buf	= malloc(SHARED_CACHE_MAX_RUN << SHARED_CACHE_BLOCK_SHIFT);
+	if (buf && pthread_setspecific(run_buf_key, buf)) {
+		free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+/*
+ * Serves a read from the shared cache where possible. Runs of missing or
+ * dirty blocks are read from the image in one go, and the clean ones are
+ * added to the cache on the way.
+ */
+int shared_cache__read(struct shared_cache_image *self, struct disk_image *disk, uint64_t sector, const struct iovec *iov, int iovcount)
+{
+	struct shared_cache *cache = self->cache;
+	uint64_t offset = sector << SECTOR_SHIFT;
+	uint64_t len = 0, end;
+	size_t iov_off = 0;
+	void *buf;
+	int i;
+
+	for (i = 0; i < iovcount; i++)
+		len	+= iov[i].iov_len;
+
+	if (offset + len > disk->size)
+		return -1;
+
+	buf	= shared_cache__run_buf();
+	if (!buf)
+		return disk->ops->read_sector_iov(disk, sector, iov, iovcount);
+
+	end	= offset + len;
+
+	while (offset < end) {
+		uint64_t block = offset >> SHARED_CACHE_BLOCK_SHIFT;
+		uint64_t start = block << SHARED_CACHE_BLOCK_SHIFT;
+		uint64_t run_end, nr, n;
+		struct iovec run;
+
+		if (!shared_cache__is_dirty(self, block) && shared_cache__lookup(cache, self->id, block, buf)) {
+			n	= MIN(end, start + SHARED_CACHE_BLOCK_SIZE) - offset;
+			iov_copy_to(&iov, &iov_off, buf + (offset - start), n);
+			offset	+= n;
+			continue;
+		}
+
+		for (nr = 1; nr < SHARED_CACHE_MAX_RUN; nr++) {
+			uint64_t next = block + nr;
+
+			if (next << SHARED_CACHE_BLOCK_SHIFT >= end)
+				break;
+
+			if (!shared_cache__is_dirty(self, next) && shared_cache__lookup(cache, self->id, next, NULL))
+				break;
+		}
+
+		run_end	= MIN((block + nr) << SHARED_CACHE_BLOCK_SHIFT, disk->size);
+		run	= (struct iovec) {
+			.iov_base	= buf,
+			.iov_len	= run_end - start,
+		};
+
+		if (disk->ops->read_sector_iov(disk, start >> SECTOR_SHIFT, &run, 1) < 0)
+			return -1;
+
+		/* The tail of the last block of the image reads as zeroes */
+		memset(buf + run.iov_len, 0, (nr << SHARED_CACHE_BLOCK_SHIFT) - run.iov_len);
+
+		for (i = 0; i < (int) nr; i++) {
+			if (!shared_cache__is_dirty(self, block + i))
+				shared_cache__insert(cache, self->id, block + i, buf + ((uint64_t) i << SHARED_CACHE_BLOCK_SHIFT));
+		}
+
+		n	= MIN(end, run_end) - offset;
+		iov_copy_to(&iov, &iov_off, buf + (offset - start), n);
+		offset	+= n;
+	}
+
+	return 0;
+}
+
+/*
+ * The id covers the identity and the version of the image file, so that a
+ * modified image doesn't hit blocks cached for its previous contents.
+ */
+static uint64_t shared_cache__image_id(struct stat *st)
+{
+	uint64_t id;
+
+	id	= hash64(st->st_dev);
+	id	= hash64(id ^ st->st_ino);
+	id	= hash64(id ^ st->st_size);
+	id	= hash64(id ^ st->st_mtim.tv_sec);
+	id	= hash64(id ^ st->st_mtim.tv_nsec);
+
+	/* Zero marks empty slots */
+	return id | 1;
+}
+
+bool shared_cache__add_image(struct shared_cache *self, struct disk_image *disk)
+{
+	struct shared_cache_image *image;
+	struct stat st;
+
+	if (fstat(disk->fd, &st) < 0)
+		return false;
+
+	image	= calloc(1, sizeof *image);
+	if (!image)
+		return false;
+
+	image->cache		= self;
+	image->id		= shared_cache__image_id(&st);
+	image->nr_blocks	= (disk->size + SHARED_CACHE_BLOCK_SIZE - 1) >> SHARED_CACHE_BLOCK_SHIFT;
+
+	image->dirty		= calloc((image->nr_blocks + BITS_PER_LONG - 1) / BITS_PER_LONG, sizeof(unsigned long));
+	if (!image->dirty) {
+		free(image);
+		return false;
+	}
+
+	disk->cache	= image;
+
+	return true;
+}
+
+/* Header page, slots rounded up to a page, then block data */
+static size_t shared_cache__slots_size(uint64_t nr_slots)
+{
+	uint64_t size = nr_slots * sizeof(struct shared_cache_slot);
+
+	return (size + SHARED_CACHE_BLOCK_SIZE - 1) & ~(SHARED_CACHE_BLOCK_SIZE - 1);
+}
+
+static size_t shared_cache__size(uint64_t nr_slots)
+{
+	return SHARED_CACHE_BLOCK_SIZE + shared_cache__slots_size(nr_slots) + (nr_slots << SHARED_CACHE_BLOCK_SHIFT);
+}
+
+static void *shared_cache__map(int fd, size_t size)
+{
+	void *p;
+
+	p	= mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		die_perror("mmap");
+
+	return p;
+}
+
+/*
+ * Creates the cache segment or attaches to an existing one. The creator
+ * sizes the segment and fills the header in, magic last; others wait for
+ * the magic to show up.
+ */
+struct shared_cache *shared_cache__attach(const char *name, unsigned long size_mb)
+{
+	struct shared_cache_header *header;
+	struct shared_cache *self;
+	char path[NAME_MAX];
+	uint64_t nr_slots;
+	struct stat st;
+	size_t size;
+	int fd, i;
+
+	snprintf(path, sizeof(path), "/kvm-cache-%s", name);
+
+	nr_slots	= ((uint64_t) size_mb << 20) / (SHARED_CACHE_BLOCK_SIZE + sizeof(struct shared_cache_slot));
+	nr_slots	&= ~(uint64_t) (SHARED_CACHE_WAYS - 1);
+	if (!nr_slots)
+		die("Shared cache %s is too small", name);
+
+	fd	= shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd >= 0) {
+		size	= shared_cache__size(nr_slots);
+
+		if (ftruncate(fd, size) < 0)
+			die_perror("ftruncate");
+
+		header			= shared_cache__map(fd, size);
+		header->block_size	= SHARED_CACHE_BLOCK_SIZE;
+		header->ways		= SHARED_CACHE_WAYS;
+		header->nr_slots	= nr_slots;
+
+		wmb();
+		memcpy(header->magic, SHARED_CACHE_MAGIC, sizeof(SHARED_CACHE_MAGIC));
+	} else {
+		if (errno != EEXIST)
+			die_perror("shm_open");
+
+		fd	= shm_open(path, O_RDWR, 0);
+		if (fd < 0)
+			die_perror("shm_open");
+
+		for (i = 0; ; i++) {
+			if (fstat(fd, &st) < 0)
+				die_perror("fstat");
+			if (st.st_size >= (off_t) sizeof(*header))
+				break;
+			if (i == 1000)
+				die("Shared cache %s is not initialized", name);
+			usleep(1000);
+		}
+
+		size	= st.st_size;
+		header	= shared_cache__map(fd, size);
+
+		for (i = 0; memcmp(header->magic, SHARED_CACHE_MAGIC, sizeof(header->magic)); i++) {
+			if (i == 1000)
+				die("Shared cache %s is not initialized", name);
+			usleep(1000);
+		}
+		rmb();
+
+		if (header->block_size != SHARED_CACHE_BLOCK_SIZE || header->ways != SHARED_CACHE_WAYS ||
+		    shared_cache__size(header->nr_slots) != size)
+			die("Shared cache %s has an incompatible layout", name);
+
+		nr_slots	= header->nr_slots;
+	}
+
+	close(fd);
+
+	self	= calloc(1, sizeof *self);
+	if (!self)
+		die("out of memory");
+
+	self->header		= header;
+	self->slots		= (void *) header + SHARED_CACHE_BLOCK_SIZE;
+	self->data		= (void *) self->slots + shared_cache__slots_size(nr_slots);
+	self->nr_buckets	= nr_slots / SHARED_CACHE_WAYS;
+	self->size		= size;
+
+	info("Attached to shared cache %s (%" PRIu64 " MiB)", name, (nr_slots << SHARED_CACHE_BLOCK_SHIFT) >> 20);
+
+	return self;
+}
@@ -0,0 +1,379 @@
+/*
+ * Device model microbenchmarks. The devices are driven through
+ * kvm__emulate_io() the way the vCPU loop does it, against a fake VM with
+ * malloc'd guest memory, so this runs without /dev/kvm.
+ */
+#include "kvm/blk-virtio.h"
+#include "kvm/8250-serial.h"
+#include "kvm/virtio-pci-dev.h"
+#include "kvm/virtio_ring.h"
+#include "kvm/virtio_blk.h"
+#include "kvm/virtio_pci.h"
+#include "kvm/disk-image.h"
+#include "kvm/console.h"
+#include "kvm/barrier.h"
+#include "kvm/ioport.h"
+#include "kvm/util.h"
+#include "kvm/kvm.h"
+#include "kvm/pci.h"
+
+#include <linux/serial_reg.h>
+
+#include <sys/mman.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#define DEVBENCH_RAM_SIZE	(64 << 20)
+#define DEVBENCH_DISK_SIZE	(16 << 20)
+#define DEVBENCH_ITERATIONS	1000000
+
+/* Guest physical layout of the virtio-blk benchmarks */
+#define BLK_QUEUE_SIZE		16
+#define BLK_RING_PFN		0x10
+#define BLK_HDR_ADDR		0x100000
+#define BLK_DATA_ADDR		0x200000
+#define BLK_STATUS_ADDR		0x300000
+#define BLK_REQ_SIZE		4096
+#define BLK_MAX_BATCH		(BLK_QUEUE_SIZE / 3)
+
+#define SERIAL_BASE		0x3f8
+#define UNUSED_PORT		0x80
+
+struct bench {
+	const char		*name;
+	void			(*fn)(void);
+	/* Fraction of the iterations to run, for the slow ones */
+	unsigned int		divisor;
+};
+
+static struct kvm	fake_kvm;
+static struct vring	blk_vring;
+static FILE		*report;
+
+/*
+ * Allocations made by the device code, counted by wrapping the allocator
+ * at link time (-Wl,--wrap=...). Allocations inside libc aren't seen.
+ */
+static uint64_t		nr_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+int __real_posix_memalign(void **memptr, size_t alignment, size_t size);
+
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t nmemb, size_t size);
+void *__wrap_realloc(void *ptr, size_t size);
+int __wrap_posix_memalign(void **memptr, size_t alignment, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	__sync_fetch_and_add(&nr_allocs, 1);
+
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	__sync_fetch_and_add(&nr_allocs, 1);
+
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	__sync_fetch_and_add(&nr_allocs, 1);
+
+	return __real_realloc(ptr, size);
+}
+
+int __wrap_posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	__sync_fetch_and_add(&nr_allocs, 1);
+
+	return __real_posix_memalign(memptr, alignment, size);
+}
+
+/* Interrupts go nowhere */
+void kvm__irq_line(struct kvm *self, int irq, int level)
+{
+}
+
+void kvm__register_mem(struct kvm *self, uint64_t guest_phys, uint64_t size, void *userspace_addr)
+{
+}
+
+/* Every write goes through kvm__emulate_io() */
+bool kvm__register_coalesced_pio(struct kvm *self, uint16_t port, uint32_t size)
+{
+	return false;
+}
+
+static void io_out(uint16_t port, uint32_t val, int size)
+{
+	kvm__emulate_io(&fake_kvm, port, &val, KVM_EXIT_IO_OUT, size, 1);
+}
+
+static uint32_t io_in(uint16_t port, int size)
+{
+	uint32_t val = 0;
+
+	kvm__emulate_io(&fake_kvm, port, &val, KVM_EXIT_IO_IN, size, 1);
+
+	return val;
+}
+
+/*
+ * Port I/O benchmarks
+ */
+static void bench_unassigned_port(void)
+{
+	io_out(UNUSED_PORT, 0, 1);
+}
+
+static void bench_serial_scratch(void)
+{
+	io_out(SERIAL_BASE + UART_SCR, 0x5a, 1);
+}
+
+static void bench_serial_lsr(void)
+{
+	io_in(SERIAL_BASE + UART_LSR, 1);
+}
+
+/* Output is buffered for the console thread, which writes it to /dev/null */
+static void bench_serial_tx(void)
+{
+	io_out(SERIAL_BASE + UART_TX, 'x', 1);
+}
+
+static void bench_pci_config_read(void)
+{
+	/* Vendor and device id of the first disk */
+	io_out(PCI_CONFIG_ADDRESS, 0x80000000 | (VIRTIO_BLK_PCI_SLOT << 11), 4);
+	io_in(PCI_CONFIG_DATA, 4);
+}
+
+/*
+ * virtio-blk benchmarks: a batch of 4 KiB reads is made available, the
+ * queue is kicked and we spin until the device has published them all.
+ */
+static void blk_setup(void)
+{
+	unsigned int i, d;
+
+	io_out(IOPORT_VIRTIO_BLK + VIRTIO_PCI_QUEUE_SEL, 0, 2);
+	io_out(IOPORT_VIRTIO_BLK + VIRTIO_PCI_QUEUE_PFN, BLK_RING_PFN, 4);
+
+	vring_init(&blk_vring, BLK_QUEUE_SIZE, fake_kvm.ram_start + (BLK_RING_PFN << 12), 4096);
+
+	/* Request i uses descriptors 3i (header), 3i + 1 (data) and 3i + 2 (status) */
+	for (i = 0; i < BLK_MAX_BATCH; i++) {
+		struct virtio_blk_outhdr *hdr = fake_kvm.ram_start + BLK_HDR_ADDR + i * sizeof(*hdr);
+
+		*hdr		= (struct virtio_blk_outhdr) {
+			.type		= VIRTIO_BLK_T_IN,
+			.sector		= i * (BLK_REQ_SIZE >> SECTOR_SHIFT) * 7,
+		};
+
+		d		= i * 3;
+
+		blk_vring.desc[d]	= (struct vring_desc) {
+			.addr		= BLK_HDR_ADDR + i * sizeof(*hdr),
+			.len		= sizeof(*hdr),
+			.flags		= VRING_DESC_F_NEXT,
+			.next		= d + 1,
+		};
+		blk_vring.desc[d + 1]	= (struct vring_desc) {
+			.addr		= BLK_DATA_ADDR + i * BLK_REQ_SIZE,
+			.len		= BLK_REQ_SIZE,
+			.flags		= VRING_DESC_F_NEXT | VRING_DESC_F_WRITE,
+			.next		= d + 2,
+		};
+		blk_vring.desc[d + 2]	= (struct vring_desc) {
+			.addr		= BLK_STATUS_ADDR + i,
+			.len		= 1,
+			.flags		= VRING_DESC_F_WRITE,
+		};
+	}
+}
+
+static void blk_read_batch(unsigned int nr)
+{
+	volatile uint16_t *used_idx = &blk_vring.used->idx;
+	uint16_t idx = blk_vring.avail->idx;
+	unsigned int i;
+
+	for (i = 0; i < nr; i++)
+		blk_vring.avail->ring[(idx + i) % BLK_QUEUE_SIZE]	= i * 3;
+
+	wmb();
+
+	blk_vring.avail->idx	= idx + nr;
+
+	mb();
+
+	if (!(blk_vring.used->flags & VRING_USED_F_NO_NOTIFY))
+		io_out(IOPORT_VIRTIO_BLK + VIRTIO_PCI_QUEUE_NOTIFY, 0, 2);
+
+	/* Back off now and then in case the I/O thread shares our CPU */
+	for (i = 0; *used_idx != (uint16_t) (idx + nr); i++) {
+		if (i % 1024 == 1023)
+			sched_yield();
+		else
+			cpu_relax();
+	}
+
+	rmb();
+}
+
+static void bench_blk_read(void)
+{
+	blk_read_batch(1);
+}
+
+static void bench_blk_read_batch(void)
+{
+	blk_read_batch(BLK_MAX_BATCH);
+}
+
+static struct bench benches[] = {
+	{ "ioport-unassigned",		bench_unassigned_port,		1 },
+	{ "serial-scratch-out",		bench_serial_scratch,		1 },
+	{ "serial-lsr-in",		bench_serial_lsr,		1 },
+	{ "serial-tx",			bench_serial_tx,		10 },
+	{ "pci-config-read",		bench_pci_config_read,		1 },
+	{ "blk-read-4k",		bench_blk_read,			20 },
+	{ "blk-read-4k-batch",		bench_blk_read_batch,		20 },
+};
+
+static void run_bench(struct bench *b, uint64_t iterations)
+{
+	uint64_t i, start, elapsed, allocs;
+
+	iterations	= MAX(iterations / b->divisor, 1);
+
+	/* Warm up caches and lazily set up state */
+	for (i = 0; i < iterations / 100; i++)
+		b->fn();
+
+	allocs		= nr_allocs;
+	start		= clock_ns();
+
+	for (i = 0; i < iterations; i++)
+		b->fn();
+
+	elapsed		= clock_ns() - start;
+	allocs		= nr_allocs - allocs;
+
+	fprintf(report, "%-24s %10" PRIu64 " ops %10.1f ns/op %8.3f allocs/op\n",
+		b->name, iterations, (double) elapsed / iterations, (double) allocs / iterations);
+}
+
+static void usage(char *argv[])
+{
+	unsigned int i;
+
+	fprintf(stderr, "  usage: %s [--iterations=<n>] [--blk-poll=<idle-usecs>] [<benchmark>...]\n"
+		"  benchmarks:", argv[0]);
+
+	for (i = 0; i < ARRAY_SIZE(benches); i++)
+		fprintf(stderr, " %s", benches[i].name);
+
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+static struct disk_image *create_disk(void)
+{
+	char path[] = "/tmp/devbench-XXXXXX";
+	struct disk_image *disk;
+	int fd;
+
+	fd	= mkstemp(path);
+	if (fd < 0)
+		die_perror("mkstemp");
+
+	if (ftruncate(fd, DEVBENCH_DISK_SIZE) < 0)
+		die_perror("ftruncate");
+
+	disk	= disk_image__open(path, false);
+	if (!disk)
+		die("unable to open %s", path);
+
+	unlink(path);
+	close(fd);
+
+	return disk;
+}
+
+int main(int argc, char *argv[])
+{
+	struct blk_virtio_params blk_params = { };
+	uint64_t iterations = DEVBENCH_ITERATIONS;
+	const char *selected[ARRAY_SIZE(benches)];
+	unsigned int nr_selected = 0;
+	unsigned int i, j;
+	int k;
+
+	for (k = 1; k < argc; k++) {
+		if (!strncmp(argv[k], "--iterations=", 13))
+			iterations		= strtoull(&argv[k][13], NULL, 0);
+		else if (!strncmp(argv[k], "--blk-poll=", 11))
+			blk_params.poll_idle_us	= atol(&argv[k][11]);
+		else if (argv[k][0] == '-' || nr_selected == ARRAY_SIZE(selected))
+			usage(argv);
+		else
+			selected[nr_selected++]	= argv[k];
+	}
+
+	for (j = 0; j < nr_selected; j++) {
+		for (i = 0; i < ARRAY_SIZE(benches); i++) {
+			if (!strcmp(selected[j], benches[i].name))
+				break;
+		}
+
+		if (i == ARRAY_SIZE(benches))
+			usage(argv);
+	}
+
+	/* Results go to the original stdout, guest serial output nowhere */
+	report	= fdopen(dup(STDOUT_FILENO), "w");
+	if (!report || !freopen("/dev/null", "w", stdout))
+		die_perror("stdout");
+	setvbuf(report, NULL, _IOLBF, 0);
+
+	fake_kvm.ram_size	= DEVBENCH_RAM_SIZE;
+	fake_kvm.ram_start	= mmap(NULL, DEVBENCH_RAM_SIZE, PROT_READ | PROT_WRITE,
+				       MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (fake_kvm.ram_start == MAP_FAILED)
+		die_perror("mmap");
+
+	fake_kvm.disks[fake_kvm.nr_disks++]	= create_disk();
+
+	console__init(NULL);
+	serial8250__init(&fake_kvm);
+	pci__init();
+	blk_virtio__init(&fake_kvm, &blk_params);
+
+	blk_setup();
+
+	for (i = 0; i < ARRAY_SIZE(benches); i++) {
+		bool run = !nr_selected;
+
+		for (j = 0; j < nr_selected; j++)
+			run	|= !strcmp(selected[j], benches[i].name);
+
+		if (run)
+			run_bench(&benches[i], iterations);
+	}
+
+	return 0;
+}
@@ -0,0 +1,20 @@
+/*
+ * Shared by the exit cost guests. Each one writes the number of exits its
+ * loop makes to DBG_PORT as a 32-bit value right before and right after
+ * the loop, then ends the VM with a byte write to the same port. 16-bit
+ * writes are markers, which the VMM timestamps and logs at exit.
+ */
+#define DBG_PORT	0xe0
+
+#define BENCH_START(nr_exits)			\
+	movl	$(nr_exits), %eax;		\
+	outl	%eax, $DBG_PORT
+
+#define BENCH_END(nr_exits)			\
+	movl	$(nr_exits), %eax;		\
+	outl	%eax, $DBG_PORT;		\
+	outb	%al, $DBG_PORT
+
+#define MARK(id)				\
+	movw	id, %ax;			\
+	outw	%ax, $DBG_PORT
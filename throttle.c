@@ -0,0 +1,201 @@
+#include "kvm/throttle.h"
+
+#include "kvm/util.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+static void token_bucket__init(struct token_bucket *self, struct throttle_limit *limit, uint64_t now)
+{
+	self->rate	= limit->rate;
+	self->burst	= limit->burst ? limit->burst : limit->rate;
+	self->tokens	= self->burst;
+	self->last_ns	= now;
+}
+
+static void token_bucket__refill(struct token_bucket *self, uint64_t now)
+{
+	self->tokens	+= (double) self->rate * (now - self->last_ns) / NSEC_PER_SEC;
+	if (self->tokens > self->burst)
+		self->tokens	= self->burst;
+
+	self->last_ns	= now;
+}
+
+/*
+ * Returns the time in nanoseconds until @cost tokens are available. A cost
+ * larger than the burst is let through once the bucket is full and leaves
+ * the bucket in debt, otherwise such requests would never pass.
+ */
+static uint64_t token_bucket__wait_ns(struct token_bucket *self, uint64_t cost)
+{
+	double needed;
+
+	if (!self->rate)
+		return 0;
+
+	needed		= cost < self->burst ? cost : self->burst;
+	if (self->tokens >= needed)
+		return 0;
+
+	return (needed - self->tokens) * NSEC_PER_SEC / self->rate + 1;
+}
+
+static void token_bucket__take(struct token_bucket *self, uint64_t cost)
+{
+	if (self->rate)
+		self->tokens	-= cost;
+}
+
+void throttle__init(struct throttle *self, struct throttle_limits *limits)
+{
+	pthread_mutex_init(&self->mutex, NULL);
+
+	throttle__set_limits(self, limits);
+}
+
+void throttle__set_limits(struct throttle *self, struct throttle_limits *limits)
+{
+	uint64_t now = clock_ns();
+	int dir;
+
+	pthread_mutex_lock(&self->mutex);
+
+	for (dir = 0; dir < THROTTLE_NR_DIRS; dir++) {
+		token_bucket__init(&self->iops[dir], &limits->iops[dir], now);
+		token_bucket__init(&self->bps[dir], &limits->bps[dir], now);
+	}
+
+	pthread_mutex_unlock(&self->mutex);
+}
+
+void throttle__get_limits(struct throttle *self, struct throttle_limits *limits)
+{
+	int dir;
+
+	pthread_mutex_lock(&self->mutex);
+
+	for (dir = 0; dir < THROTTLE_NR_DIRS; dir++) {
+		limits->iops[dir]	= (struct throttle_limit) {
+			.rate		= self->iops[dir].rate,
+			.burst		= self->iops[dir].burst,
+		};
+		limits->bps[dir]	= (struct throttle_limit) {
+			.rate		= self->bps[dir].rate,
+			.burst		= self->bps[dir].burst,
+		};
+	}
+
+	pthread_mutex_unlock(&self->mutex);
+}
+
+/*
+ * Charges one request of @bytes in direction @dir. Returns zero if the
+ * request may go ahead, otherwise the number of nanoseconds after which it
+ * should be retried. Nothing is charged in the latter case.
+ */
+uint64_t throttle__account(struct throttle *self, int dir, uint64_t bytes)
+{
+	uint64_t iops_wait, bps_wait;
+	uint64_t now = clock_ns();
+
+	pthread_mutex_lock(&self->mutex);
+
+	token_bucket__refill(&self->iops[dir], now);
+	token_bucket__refill(&self->bps[dir], now);
+
+	iops_wait	= token_bucket__wait_ns(&self->iops[dir], 1);
+	bps_wait	= token_bucket__wait_ns(&self->bps[dir], bytes);
+
+	if (!iops_wait && !bps_wait) {
+		token_bucket__take(&self->iops[dir], 1);
+		token_bucket__take(&self->bps[dir], bytes);
+	}
+
+	pthread_mutex_unlock(&self->mutex);
+
+	return iops_wait > bps_wait ? iops_wait : bps_wait;
+}
+
+static const char *throttle_keys[] = { "riops", "wiops", "rbps", "wbps" };
+
+static struct throttle_limit *throttle_limit(struct throttle_limits *limits, unsigned int key)
+{
+	switch (key) {
+	case 0:
+		return &limits->iops[THROTTLE_READ];
+	case 1:
+		return &limits->iops[THROTTLE_WRITE];
+	case 2:
+		return &limits->bps[THROTTLE_READ];
+	default:
+		return &limits->bps[THROTTLE_WRITE];
+	}
+}
+
+/*
+ * Parses a comma separated list of "<key>=<rate>[:<burst>]" where key is one
+ * of riops, wiops, rbps or wbps. Keys that are not given keep their value.
+ */
+bool throttle__parse_limits(struct throttle_limits *limits, const char *arg)
+{
+	while (*arg) {
+		struct throttle_limit *limit = NULL;
+		unsigned int i;
+		size_t len;
+		char *end;
+
+		for (i = 0; i < ARRAY_SIZE(throttle_keys); i++) {
+			len	= strlen(throttle_keys[i]);
+			if (!strncmp(arg, throttle_keys[i], len) && arg[len] == '=') {
+				limit	= throttle_limit(limits, i);
+				break;
+			}
+		}
+
+		if (!limit)
+			return false;
+
+		arg		+= len + 1;
+
+		limit->rate	= strtoull(arg, &end, 0);
+		limit->burst	= 0;
+		if (end == arg)
+			return false;
+
+		if (*end == ':') {
+			arg		= end + 1;
+			limit->burst	= strtoull(arg, &end, 0);
+			if (end == arg)
+				return false;
+		}
+
+		if (*end == ',')
+			end++;
+		else if (*end)
+			return false;
+
+		arg		= end;
+	}
+
+	return true;
+}
+
+int throttle__format_limits(struct throttle_limits *limits, char *buf, size_t size)
+{
+	struct throttle_limit *limit;
+	unsigned int i;
+	int len = 0;
+
+	for (i = 0; i < ARRAY_SIZE(throttle_keys); i++) {
+		limit	= throttle_limit(limits, i);
+
+		len	+= snprintf(buf + len, size > (size_t) len ? size - len : 0,
+				"%s%s=%" PRIu64 ":%" PRIu64, i ? "," : "",
+				throttle_keys[i], limit->rate, limit->burst);
+	}
+
+	return len;
+}
@@ -0,0 +1,125 @@
+#include "kvm/virtio.h"
+
+#include "kvm/virtio_pci.h"
+#include "kvm/barrier.h"
+#include "kvm/ioport.h"
+#include "kvm/kvm.h"
+
+/* Called when the guest writes the queue's PFN */
+void virt_queue__init(struct kvm *kvm, struct virt_queue *queue, uint32_t pfn, unsigned int num)
+{
+	void *p;
+
+	p		= guest_flat_to_host(kvm, (uint64_t) pfn << 12);
+
+	vring_init(&queue->vring, num, p, VIRTIO_PCI_VRING_ALIGN);
+
+	queue->pfn	= pfn;
+}
+
+/* Returns the head of the next available chain, or -1 if there is none */
+int virt_queue__pop(struct virt_queue *queue)
+{
+	uint16_t head;
+
+	if (!queue->pfn || !virt_queue__available(queue))
+		return -1;
+
+	/* Read the ring entry only after the index that covers it */
+	rmb();
+
+	head	= queue->vring.avail->ring[queue->last_avail_idx++ % queue->vring.num];
+	if (head >= queue->vring.num)
+		return -1;
+
+	return head;
+}
+
+/*
+ * Fills in the @nth used entry after the ones the guest already sees. The
+ * guest only sees it once virt_queue__publish_used() covers it, so that a
+ * batch of completions costs one barrier.
+ */
+void virt_queue__set_used(struct virt_queue *queue, uint16_t nth, uint16_t head, uint32_t len)
+{
+	struct vring_used_elem *used_elem;
+
+	used_elem	= &queue->vring.used->ring[(uint16_t) (queue->vring.used->idx + nth) % queue->vring.num];
+	used_elem->id	= head;
+	used_elem->len	= len;
+}
+
+void virt_queue__publish_used(struct virt_queue *queue, uint16_t nr)
+{
+	/* The guest must see the used entries before the index update */
+	wmb();
+
+	queue->vring.used->idx	+= nr;
+}
+
+void virt_queue__push(struct virt_queue *queue, uint16_t head, uint32_t len)
+{
+	virt_queue__set_used(queue, 0, head, len);
+	virt_queue__publish_used(queue, 1);
+}
+
+/*
+ * Collects the descriptors of a chain that the device reads (@write false)
+ * or writes (@write true) into @iov. Returns the number of entries, or -1
+ * if the chain is malformed or doesn't fit.
+ */
+int virt_queue__chain(struct kvm *kvm, struct virt_queue *queue, uint16_t head,
+		      bool write, struct iovec *iov, int max)
+{
+	struct vring_desc *desc;
+	uint16_t idx = head;
+	unsigned int n = 0;
+	int nr = 0;
+
+	for (;;) {
+		if (idx >= queue->vring.num || n++ == queue->vring.num)
+			return -1;
+
+		desc	= &queue->vring.desc[idx];
+
+		if (!!(desc->flags & VRING_DESC_F_WRITE) == write) {
+			if (nr == max)
+				return -1;
+
+			iov[nr++]	= (struct iovec) {
+				.iov_base	= guest_flat_to_host(kvm, desc->addr),
+				.iov_len	= desc->len,
+			};
+		}
+
+		if (!(desc->flags & VRING_DESC_F_NEXT))
+			return nr;
+
+		idx	= desc->next;
+	}
+}
+
+/*
+ * Byte reads of the device specific config. There is no MSI-X, so it starts
+ * right where the MSI vector registers would otherwise be.
+ */
+bool virtio_pci__config_in(void *data, unsigned long offset, int size, uint32_t count,
+			   const void *config, size_t config_size)
+{
+	if (size != 1 || count != 1)
+		return false;
+
+	if (offset - VIRTIO_PCI_CONFIG_NOMSI >= config_size)
+		return false;
+
+	ioport__write8(data, ((const uint8_t *) config)[offset - VIRTIO_PCI_CONFIG_NOMSI]);
+
+	return true;
+}
+
+/* Reading the ISR acknowledges the interrupt */
+void virtio_pci__isr_in(struct kvm *kvm, void *data, int irq)
+{
+	ioport__write8(data, 0x1);
+	kvm__irq_line(kvm, irq, 0);
+}